@@ -14,6 +14,7 @@
 // here rather than in segment.h.
 typedef uint32_t docid_t;
 typedef uint32_t pos_t; // position of a term within a document
+typedef uint64_t offset_t; // offset into a segment's postings, positions or labels region
 
 // if you define DEBUGOUTPUT, all the DEBUG statements will magically start
 // printing stuff out...
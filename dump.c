@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include "whistlepig.h"
 
@@ -10,14 +11,17 @@ RAISING_STATIC(dump_posting_list(wp_segment* s, posting_list_header* plh)) {
   docid_t last_doc_id = 0;
   int started = 0;
 
-  uint32_t offset = plh->next_offset;
+  offset_t offset = plh->next_offset;
   printf("[%u entries]\n", plh->count);
 
   while(offset != OFFSET_NONE) {
-    RELAY_ERROR(wp_segment_read_posting(s, offset, &po, 1));
+    RELAY_ERROR(wp_segment_read_posting(s, offset, plh->options, &po, 1));
 
-    printf("  @%u doc %u:", offset, po.doc_id);
-    for(uint32_t i = 0; i < po.num_positions; i++) printf(" %d", po.positions[i]);
+    printf("  @%" PRIu64 " doc %u:", offset, po.doc_id);
+    if(po.positions == NULL) {
+      if(plh->options == WP_FIELD_FREQS) printf(" (%u occurrences)", po.num_positions);
+    }
+    else for(uint32_t i = 0; i < po.num_positions; i++) printf(" %d", po.positions[i]);
 
     if((po.doc_id == 0) || (started && (po.doc_id >= last_doc_id))) printf(" <-- BROKEN");
     started = 1;
@@ -31,26 +35,45 @@ RAISING_STATIC(dump_posting_list(wp_segment* s, posting_list_header* plh)) {
   return NO_ERROR;
 }
 
-RAISING_STATIC(dump_label_posting_list(wp_segment* s, posting_list_header* plh)) {
+RAISING_STATIC(dump_dense_posting_list(wp_segment* s, posting_list_header* plh)) {
   posting po;
-  docid_t last_doc_id = 0;
-  int started = 0;
+  pos_t* positions = NULL;
+  uint32_t positions_size = 0;
+  uint32_t num_docs = 0;
+
+  printf("[%u entries, dense]\n", plh->count);
+
+  RELAY_ERROR(wp_segment_read_dense_posting(s, plh->next_offset, plh->options, MAX_LOGICAL_DOCID, &po));
+  while(po.doc_id != DOCID_NONE) {
+    printf("  doc %u:", po.doc_id);
+    if(plh->options == WP_FIELD_FREQS) printf(" (%u occurrences)", po.num_positions);
+    else if(plh->options == WP_FIELD_POSITIONS) {
+      RELAY_ERROR(wp_segment_read_positions(s, &po, &positions, &positions_size));
+      for(uint32_t i = 0; i < po.num_positions; i++) printf(" %d", po.positions[i]);
+    }
+    printf("\n");
+    num_docs++;
+    RELAY_ERROR(wp_segment_read_dense_posting(s, plh->next_offset, plh->options, po.doc_id - 1, &po));
+  }
+  if(num_docs != plh->count) printf("  <-- BROKEN: found %u docs\n", num_docs);
 
-  uint32_t offset = plh->next_offset;
-  printf("[%u entries]\n", plh->count);
+  free(positions);
+  return NO_ERROR;
+}
 
-  while(offset != OFFSET_NONE) {
-    RELAY_ERROR(wp_segment_read_label(s, offset, &po));
+RAISING_STATIC(dump_label_posting_list(wp_segment* s, uint32_t label_s, posting_list_header* plh)) {
+  posting po;
+  uint32_t num_docs = 0;
 
-    printf("  @%u doc %u", offset, po.doc_id);
-    if((po.doc_id == 0) || (started && (po.doc_id >= last_doc_id))) printf(" <-- BROKEN");
-    started = 1;
-    last_doc_id = po.doc_id;
-    printf("\n");
+  printf("[%u entries]\n", plh->count);
 
-    offset = po.next_offset;
-    free(po.positions);
+  RELAY_ERROR(wp_segment_read_label(s, label_s, MAX_LOGICAL_DOCID, &po));
+  while(po.doc_id != DOCID_NONE) {
+    printf("  doc %u\n", po.doc_id);
+    num_docs++;
+    RELAY_ERROR(wp_segment_read_label(s, label_s, po.doc_id - 1, &po));
   }
+  if(num_docs != plh->count) printf("  <-- BROKEN: found %u docs\n", num_docs);
 
   return NO_ERROR;
 }
@@ -71,20 +94,20 @@ RAISING_STATIC(dump(wp_segment* segment)) {
       term t = thkeys[i];
 
       if(t.field_s == 0) { // sentinel label value
-        if(t.word_s == 0) { // sentinel dead list value
-          printf("%u: (dead list)\n", i);
-        }
-        else {
-          const char* label = stringmap_int_to_string(sh, sp, t.word_s);
-          printf("%u: ~%s\n", i, label);
-        }
-        RELAY_ERROR(dump_label_posting_list(segment, &thvals[i]));
+        const char* label = stringmap_int_to_string(sh, sp, t.word_s);
+        printf("%u: ~%s\n", i, label);
+        RELAY_ERROR(dump_label_posting_list(segment, t.word_s, &thvals[i]));
+      }
+      else if(t.field_s == WP_KEY_FIELD) {
+        const char* key = stringmap_int_to_string(sh, sp, t.word_s);
+        printf("%u: #%s -> doc %" PRIu64 "\n", i, key, thvals[i].next_offset);
       }
       else {
         const char* field = stringmap_int_to_string(sh, sp, t.field_s);
         const char* word = stringmap_int_to_string(sh, sp, t.word_s);
         printf("%u: %s:'%s'\n", i, field, word);
-        RELAY_ERROR(dump_posting_list(segment, &thvals[i]));
+        if(thvals[i].dense) RELAY_ERROR(dump_dense_posting_list(segment, &thvals[i]));
+        else RELAY_ERROR(dump_posting_list(segment, &thvals[i]));
       }
     }
   }
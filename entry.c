@@ -126,17 +126,16 @@ wp_error* wp_entry_write_to_segment(wp_entry* entry, wp_segment* seg, docid_t do
   return NO_ERROR;
 }
 
-// currently this is a crazy overestimate (it's calculating the size without
-// VBE) but that's fine. as long as we're not an underestimate, we should be ok.
-wp_error* wp_entry_sizeof_postings_region(wp_entry* entry, wp_segment* seg, uint32_t* size) {
-  *size = 0;
+// this is exact, except that a new field or word string used by several terms
+// is counted once per term. that's fine; an overestimate is safe.
+wp_error* wp_entry_sizeof_postings_region(wp_entry* entry, wp_segment* seg, segment_growth* growth) {
+  memset(growth, 0, sizeof(segment_growth));
   for(khiter_t i = kh_begin(entry->entries); i < kh_end(entry->entries); i++) {
     if(kh_exist(entry->entries, i)) {
+      fielded_term ft = kh_key(entry->entries, i);
       RARRAY(pos_t) positions = kh_val(entry->entries, i);
 
-      uint32_t this_size;
-      RELAY_ERROR(wp_segment_sizeof_posarray(seg, RARRAY_NELEM(positions), RARRAY_ALL(positions), &this_size));
-      *size += this_size;
+      RELAY_ERROR(wp_segment_sizeof_posting(seg, ft.field, ft.term, RARRAY_NELEM(positions), RARRAY_ALL(positions), growth));
     }
   }
 
@@ -6,12 +6,18 @@
 #include "whistlepig.h"
 
 #define PATH_BUF_SIZE 4096
-#define INDEX_VERSION 1
+#define INDEX_VERSION 3
 
 int wp_index_exists(const char* pathname_base) {
+  struct stat fstat;
   char buf[PATH_BUF_SIZE];
-  snprintf(buf, PATH_BUF_SIZE, "%s0", pathname_base);
-  return wp_segment_exists(buf);
+  snprintf(buf, PATH_BUF_SIZE, "%s.ii", pathname_base);
+  return !stat(buf, &fstat);
+}
+
+// the pathname of segment number i on disk
+static void segment_pathname(char* buf, const char* pathname_base, uint32_t i) {
+  snprintf(buf, PATH_BUF_SIZE, "%s%u", pathname_base, i);
 }
 
 RAISING_STATIC(grab_writelock(wp_index* index)) {
@@ -35,6 +41,9 @@ RAISING_STATIC(release_lock(wp_index* index)) {
 RAISING_STATIC(index_info_init(index_info* ii, uint32_t index_version)) {
   ii->index_version = index_version;
   ii->num_segments = 0;
+  ii->next_segment_id = 0;
+  ii->layout_generation = 0;
+  ii->first_docid_offset = 0;
 
   RELAY_ERROR(wp_lock_setup(&ii->lock));
   return NO_ERROR;
@@ -54,17 +63,23 @@ wp_error* wp_index_create(wp_index** indexptr, const char* pathname_base) {
   RELAY_ERROR(index_info_init(MMAP_OBJ(index->indexinfo, index_info), INDEX_VERSION));
 
   index->pathname_base = pathname_base;
+  index->layout_generation = 0;
   index->sizeof_segments = 1;
+  index->max_segment_docs = 0;
   index->open = 1;
   index->segments = malloc(sizeof(wp_segment));
   index->docid_offsets = malloc(sizeof(uint64_t));
+  index->segment_ids = malloc(sizeof(uint32_t));
 
-  snprintf(buf, PATH_BUF_SIZE, "%s0", pathname_base);
+  segment_pathname(buf, pathname_base, 0);
   RELAY_ERROR(wp_segment_create(&index->segments[0], buf));
   index->docid_offsets[0] = 0;
+  index->segment_ids[0] = 0;
   index->num_segments = 1;
 
   index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  ii->segment_ids[0] = 0;
+  ii->next_segment_id = 1;
   ii->num_segments = 1;
 
   return NO_ERROR;
@@ -78,33 +93,89 @@ RAISING_STATIC(ensure_segment_pointer_fit(wp_index* index)) {
     while(index->sizeof_segments < index->num_segments) index->sizeof_segments *= 2; // lame
     index->segments = realloc(index->segments, sizeof(wp_segment) * index->sizeof_segments);
     index->docid_offsets = realloc(index->docid_offsets, sizeof(uint64_t) * index->sizeof_segments);
+    index->segment_ids = realloc(index->segment_ids, sizeof(uint32_t) * index->sizeof_segments);
     if(index->segments == NULL) RAISE_ERROR("oom");
-    if(index->segments == NULL) RAISE_ERROR("oom");
+    if(index->docid_offsets == NULL) RAISE_ERROR("oom");
+    if(index->segment_ids == NULL) RAISE_ERROR("oom");
   }
 
   return NO_ERROR;
 }
 
-// ensures that we know about all segments. should be wrapped
-// in a global read mutex to prevent creation.
+// segments have been dropped or merged since we last looked, so the ones
+// we have loaded may have moved, or be gone. line them up with the segments
+// the index has now, keeping the ones that are still around and loading any
+// new ones, and recompute the docid offsets.
+RAISING_STATIC(reload_layout(wp_index* index)) {
+  char buf[PATH_BUF_SIZE];
+
+  index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  uint16_t num_segments = (uint16_t)ii->num_segments;
+  DEBUG("segment layout changed from generation %u to %u", index->layout_generation, ii->layout_generation);
+
+  wp_segment* segments = malloc(sizeof(wp_segment) * (num_segments > 0 ? num_segments : 1));
+  uint64_t* docid_offsets = malloc(sizeof(uint64_t) * (num_segments > 0 ? num_segments : 1));
+  uint32_t* segment_ids = malloc(sizeof(uint32_t) * (num_segments > 0 ? num_segments : 1));
+  uint8_t* kept = calloc(index->num_segments + 1, sizeof(uint8_t));
+
+  for(uint16_t i = 0; i < num_segments; i++) {
+    uint16_t j;
+    for(j = 0; j < index->num_segments; j++) if(!kept[j] && (index->segment_ids[j] == ii->segment_ids[i])) break;
+
+    if(j < index->num_segments) {
+      segments[i] = index->segments[j];
+      kept[j] = 1;
+    }
+    else {
+      segment_pathname(buf, index->pathname_base, ii->segment_ids[i]);
+      DEBUG("loading segment %u from %s", i, buf);
+      RELAY_ERROR(wp_segment_load(&segments[i], buf));
+    }
+
+    segment_ids[i] = ii->segment_ids[i];
+    if(i == 0) docid_offsets[i] = ii->first_docid_offset;
+    else docid_offsets[i] = docid_offsets[i - 1] + wp_segment_num_docs(&segments[i - 1]);
+  }
+
+  for(uint16_t j = 0; j < index->num_segments; j++) if(!kept[j]) RELAY_ERROR(wp_segment_unload(&index->segments[j]));
+  free(kept);
+
+  free(index->segments);
+  free(index->docid_offsets);
+  free(index->segment_ids);
+  index->segments = segments;
+  index->docid_offsets = docid_offsets;
+  index->segment_ids = segment_ids;
+  index->num_segments = index->sizeof_segments = num_segments;
+  index->layout_generation = ii->layout_generation;
+
+  return NO_ERROR;
+}
+
+// ensures that we know about all segments, and have forgotten about any
+// that have been dropped or merged away. should be wrapped in a global read
+// mutex to prevent creation.
 RAISING_STATIC(ensure_all_segments(wp_index* index)) {
   char buf[PATH_BUF_SIZE];
 
   index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  if(ii->layout_generation != index->layout_generation) RELAY_ERROR(reload_layout(index));
+
   if(ii->num_segments < index->num_segments) RAISE_ERROR("invalid value for num_segments: %u vs %u", index->num_segments, ii->num_segments);
   if(ii->num_segments == index->num_segments) return NO_ERROR;
 
   // otherwise, we need to load some more segments
   uint16_t old_num_segments = index->num_segments;
-  index->num_segments = ii->num_segments;
+  index->num_segments = (uint16_t)ii->num_segments;
   RELAY_ERROR(ensure_segment_pointer_fit(index));
 
   for(uint16_t i = old_num_segments; i < index->num_segments; i++) {
-    snprintf(buf, PATH_BUF_SIZE, "%s%u", index->pathname_base, i);
+    index->segment_ids[i] = ii->segment_ids[i];
+    segment_pathname(buf, index->pathname_base, index->segment_ids[i]);
     DEBUG("trying to loading segment %u from %s", i, buf);
     RELAY_ERROR(wp_segment_load(&index->segments[i], buf));
 
-    if(i == 0) index->docid_offsets[i] = 0;
+    if(i == 0) index->docid_offsets[i] = ii->first_docid_offset;
     else {
       // segments return docids 1 through N, so the num_docs in a segment is
       // also the max document id
@@ -125,11 +196,14 @@ wp_error* wp_index_load(wp_index** indexptr, const char* pathname_base) {
   RELAY_ERROR(index_info_validate(MMAP_OBJ(index->indexinfo, index_info), INDEX_VERSION));
 
   index->pathname_base = pathname_base;
+  index->layout_generation = MMAP_OBJ(index->indexinfo, index_info)->layout_generation;
+  index->max_segment_docs = 0;
   index->open = 1;
   index->num_segments = 0;
   index->sizeof_segments = 0;
   index->segments = NULL;
   index->docid_offsets = NULL;
+  index->segment_ids = NULL;
 
   RELAY_ERROR(ensure_all_segments(index));
 
@@ -143,11 +217,53 @@ wp_error* wp_index_load(wp_index** indexptr, const char* pathname_base) {
 
 wp_error* wp_index_setup_query(wp_index* index, wp_query* query) {
   (void)index;
+  wp_query_optimize(query);
   query->segment_idx = SEGMENT_UNINITIALIZED;
 
   return NO_ERROR;
 }
 
+// set up the search state for query->segment_idx. we remember the generation
+// of the segment's postings region, because if the segment is sealed while
+// the query is in flight, the search state becomes invalid and we have to
+// start over (see wp_index_run_query).
+RAISING_STATIC(start_query_on_segment(wp_index* index, wp_query* query)) {
+  DEBUG("setting up segment %u", query->segment_idx);
+  wp_segment* seg = &index->segments[query->segment_idx];
+  RELAY_ERROR(wp_segment_grab_readlock(seg));
+  RELAY_ERROR(wp_segment_reload(seg));
+  RELAY_ERROR(wp_search_init_search_state(query, seg));
+  query->segment_generation = wp_segment_generation(seg);
+  query->last_doc_id = DOCID_NONE;
+  RELAY_ERROR(wp_segment_release_lock(seg));
+
+  return NO_ERROR;
+}
+
+// the segments have changed under a query in progress. every doc at or
+// above resume_below has been taken care of, so carry on from the segment
+// that now holds the docs just below it, if any.
+RAISING_STATIC(relocate_query(wp_index* index, wp_query* query)) {
+  RELAY_ERROR(wp_search_release_search_state(query));
+
+  uint16_t i = index->num_segments;
+  while((i > 0) && (query->resume_below <= index->docid_offsets[i - 1] + 1)) i--;
+  if(i == 0) {
+    DEBUG("nothing left below doc %" PRIu64 "; query is done", query->resume_below);
+    query->segment_idx = SEGMENT_DONE;
+    return NO_ERROR;
+  }
+
+  query->segment_idx = i - 1;
+  DEBUG("resuming query below doc %" PRIu64 " in segment %u", query->resume_below, query->segment_idx);
+  RELAY_ERROR(start_query_on_segment(index, query));
+  if(query->resume_below - index->docid_offsets[query->segment_idx] <= wp_segment_num_docs(&index->segments[query->segment_idx])) {
+    query->last_doc_id = (docid_t)(query->resume_below - index->docid_offsets[query->segment_idx]);
+  }
+
+  return NO_ERROR;
+}
+
 #define RESULT_BUF_SIZE 1024
 // count the results by running the query until it stops. slow!
 RAISING_STATIC(count_query_by_running_it(wp_index* index, wp_query* query, uint32_t* num_results)) {
@@ -164,13 +280,16 @@ RAISING_STATIC(count_query_by_running_it(wp_index* index, wp_query* query, uint3
   return NO_ERROR;
 }
 
-RAISING_STATIC(count_query_from_posting_list_header(wp_index* index, wp_query* query, uint32_t* num_results)) {
+// posting list counts include deleted docs, so this sets success to 0 if
+// there are any
+RAISING_STATIC(count_query_from_posting_list_header(wp_index* index, wp_query* query, uint32_t* num_results, int* success)) {
   // make sure we have know about all segments (one could've been added by a writer)
   RELAY_ERROR(grab_readlock(index));
   RELAY_ERROR(ensure_all_segments(index));
   RELAY_ERROR(release_lock(index));
 
   *num_results = 0;
+  *success = 1;
   for(int i = 0; i < index->num_segments; i++) {
     uint32_t this_num_results;
 
@@ -178,8 +297,10 @@ RAISING_STATIC(count_query_from_posting_list_header(wp_index* index, wp_query* q
     wp_segment* seg = &index->segments[i];
     RELAY_ERROR(wp_segment_grab_readlock(seg));
     RELAY_ERROR(wp_segment_reload(seg));
-    RELAY_ERROR(wp_segment_count_term(seg, query->field, query->word, &this_num_results));
+    if(wp_segment_num_deleted(seg) > 0) *success = 0;
+    else RELAY_ERROR(wp_segment_count_term(seg, query->field, query->word, &this_num_results));
     RELAY_ERROR(wp_segment_release_lock(seg));
+    if(!*success) return NO_ERROR;
     *num_results += this_num_results;
     DEBUG("got %d results from segment %d", this_num_results, i);
   }
@@ -188,10 +309,13 @@ RAISING_STATIC(count_query_from_posting_list_header(wp_index* index, wp_query* q
 }
 
 RAISING_STATIC(count_query(wp_index* index, wp_query* query, uint32_t* num_results)) {
+  int success = 1;
+
   switch(query->type) {
     case WP_QUERY_TERM:
     case WP_QUERY_LABEL:
-      RELAY_ERROR(count_query_from_posting_list_header(index, query, num_results));
+      RELAY_ERROR(count_query_from_posting_list_header(index, query, num_results, &success));
+      if(!success) RELAY_ERROR(count_query_by_running_it(index, query, num_results));
       break;
     case WP_QUERY_EVERY: // TODO -- special case this
     default:
@@ -210,14 +334,15 @@ wp_error* wp_index_run_query(wp_index* index, wp_query* query, uint32_t max_num_
 
   if(index->num_segments == 0) return NO_ERROR;
 
+  // if segments have been dropped or merged since we last ran, the one
+  // we're on may have moved or be gone
+  if((query->segment_idx != SEGMENT_UNINITIALIZED) && (query->segment_idx != SEGMENT_DONE) && (query->layout_generation != index->layout_generation)) RELAY_ERROR(relocate_query(index, query));
+  query->layout_generation = index->layout_generation;
+
   if(query->segment_idx == SEGMENT_UNINITIALIZED) {
     query->segment_idx = index->num_segments - 1;
-    DEBUG("setting up segment %u", query->segment_idx);
-    wp_segment* seg = &index->segments[query->segment_idx];
-    RELAY_ERROR(wp_segment_grab_readlock(seg));
-    RELAY_ERROR(wp_segment_reload(seg));
-    RELAY_ERROR(wp_search_init_search_state(query, seg));
-    RELAY_ERROR(wp_segment_release_lock(seg));
+    query->resume_below = UINT64_MAX;
+    RELAY_ERROR(start_query_on_segment(index, query));
   }
 
   // at this point, we assume we're initialized and query->segment_idx is the index
@@ -225,32 +350,50 @@ wp_error* wp_index_run_query(wp_index* index, wp_query* query, uint32_t max_num_
   while((*num_results < max_num_results) && (query->segment_idx != SEGMENT_DONE)) {
     uint32_t want_num_results = max_num_results - *num_results;
     uint32_t got_num_results = 0;
-    search_result* segment_results = malloc(sizeof(search_result) * want_num_results);
+    docid_t* segment_results = malloc(sizeof(docid_t) * want_num_results);
 
     DEBUG("searching segment %d", query->segment_idx);
     wp_segment* seg = &index->segments[query->segment_idx];
     RELAY_ERROR(wp_segment_grab_readlock(seg));
     RELAY_ERROR(wp_segment_reload(seg));
-    RELAY_ERROR(wp_search_run_query_on_segment(query, seg, want_num_results, &got_num_results, segment_results));
+
+    // if the segment was sealed since we last looked at it, our search state
+    // points into the old postings region. start over, and skip everything
+    // we've already returned below.
+    if(wp_segment_generation(seg) != query->segment_generation) {
+      DEBUG("segment %d changed from generation %u to %u; restarting query on it", query->segment_idx, query->segment_generation, wp_segment_generation(seg));
+      RELAY_ERROR(wp_search_release_search_state(query));
+      RELAY_ERROR(wp_search_init_search_state(query, seg));
+      query->segment_generation = wp_segment_generation(seg);
+    }
+
+    RELAY_ERROR(wp_search_run_query_on_segment_docids(query, seg, want_num_results, &got_num_results, segment_results));
     RELAY_ERROR(wp_segment_release_lock(seg));
     DEBUG("asked segment %d for %d results, got %d", query->segment_idx, want_num_results, got_num_results);
 
-    // extract the per-segment docids from the search results and adjust by
-    // each segment's docid offset to form global docids
+    // adjust the per-segment docids by each segment's docid offset to form
+    // global docids. results come in decreasing docid order, so anything at
+    // or above the last docid we returned is a repeat from a restart.
+    uint32_t num_new_results = 0;
     for(uint32_t i = 0; i < got_num_results; i++) {
-      results[*num_results + i] = index->docid_offsets[query->segment_idx] + segment_results[i].doc_id;
-      wp_search_result_free(&segment_results[i]);
+      docid_t doc_id = segment_results[i];
+      if((query->last_doc_id == DOCID_NONE) || (doc_id < query->last_doc_id)) {
+        results[*num_results + num_new_results] = index->docid_offsets[query->segment_idx] + doc_id;
+        query->resume_below = results[*num_results + num_new_results];
+        num_new_results++;
+        query->last_doc_id = doc_id;
+      }
     }
     free(segment_results);
-    *num_results += got_num_results;
+    *num_results += num_new_results;
 
     if(got_num_results < want_num_results) { // this segment is finished; move to the next one
       DEBUG("releasing index %d", query->segment_idx);
       RELAY_ERROR(wp_search_release_search_state(query));
+      query->resume_below = index->docid_offsets[query->segment_idx] + 1;
       if(query->segment_idx > 0) {
         query->segment_idx--;
-        DEBUG("setting up index %d", query->segment_idx);
-        RELAY_ERROR(wp_search_init_search_state(query, &index->segments[query->segment_idx]));
+        RELAY_ERROR(start_query_on_segment(index, query));
       }
       else query->segment_idx = SEGMENT_DONE;
     }
@@ -278,17 +421,33 @@ wp_error* wp_index_teardown_query(wp_index* index, wp_query* query) {
   return NO_ERROR;
 }
 
-RAISING_STATIC(get_and_writelock_last_segment(wp_index* index, wp_entry* entry, wp_segment** returned_seg)) {
+// how much adding an entry, and setting its key if key isn't NULL, will grow
+// a segment by
+RAISING_STATIC(sizeof_entry(wp_segment* seg, wp_entry* entry, const char* key, segment_growth* growth)) {
+  RELAY_ERROR(wp_entry_sizeof_postings_region(entry, seg, growth));
+  if(key != NULL) RELAY_ERROR(wp_segment_sizeof_key(seg, key, growth));
+  return NO_ERROR;
+}
+
+#define NO_SEGMENT_ID ((uint32_t)-1)
+
+// sets full_segment_id to the number of the segment we rolled over from if
+// the last one was full, or to NO_SEGMENT_ID. it's left for the caller to
+// seal with seal_full_segment once it's let go of the index lock.
+RAISING_STATIC(get_and_writelock_last_segment(wp_index* index, wp_entry* entry, const char* key, wp_segment** returned_seg, uint32_t* full_segment_id)) {
   // assume we have a writelock on the index object here, so that no one can
   // add segments while we're doing this stuff.
 
   int success;
+  *full_segment_id = NO_SEGMENT_ID;
   RELAY_ERROR(ensure_all_segments(index)); // make sure we know about all segments
   wp_segment* seg = &index->segments[index->num_segments - 1]; // get last segment
   RELAY_ERROR(wp_segment_grab_writelock(seg)); // grab the writelock
-  uint32_t postings_bytes; // calculate how much space we'll need to fit this entry in there
-  RELAY_ERROR(wp_entry_sizeof_postings_region(entry, seg, &postings_bytes));
-  RELAY_ERROR(wp_segment_ensure_fit(seg, postings_bytes, 0, &success));
+  segment_growth growth; // calculate how much space we'll need to fit this entry in there
+  RELAY_ERROR(sizeof_entry(seg, entry, key, &growth));
+  RELAY_ERROR(wp_segment_ensure_fit(seg, &growth, &success));
+
+  if((index->max_segment_docs > 0) && (wp_segment_num_docs(seg) >= index->max_segment_docs)) success = 0;
 
   // if we can fit in there, then return it! (still locked)
   if(success) {
@@ -296,23 +455,34 @@ RAISING_STATIC(get_and_writelock_last_segment(wp_index* index, wp_entry* entry,
     return NO_ERROR;
   }
 
-  // otherwise, unlock it and let's make a new one
+  // otherwise, it's full, and will never receive another posting. let's make
+  // a new one. sealing the old one can wait until the index is unlocked.
   RELAY_ERROR(wp_segment_release_lock(seg));
+  *full_segment_id = index->segment_ids[index->num_segments - 1];
 
   char buf[PATH_BUF_SIZE];
+  index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  if(ii->num_segments >= WP_MAX_SEGMENTS) RAISE_ERROR("can't have more than %d segments", WP_MAX_SEGMENTS);
+  uint32_t segment_id = ii->next_segment_id++;
   DEBUG("segment %d is full, loading a new one", index->num_segments - 1);
-  snprintf(buf, PATH_BUF_SIZE, "%s%d", index->pathname_base, index->num_segments);
+  segment_pathname(buf, index->pathname_base, segment_id);
 
   // increase the two counters
-  index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  ii->segment_ids[ii->num_segments] = segment_id;
   ii->num_segments++;
   index->num_segments++;
 
   // make sure we have a pointer for this guy
   RELAY_ERROR(ensure_segment_pointer_fit(index));
+  index->segment_ids[index->num_segments - 1] = segment_id;
 
-  // create the new segment
+  // create the new segment, indexing fields the same way as the last one
   RELAY_ERROR(wp_segment_create(&index->segments[index->num_segments - 1], buf));
+  segment_info* lastsi = MMAP_OBJ(index->segments[index->num_segments - 2].seginfo, segment_info);
+  for(uint32_t i = 0; i < lastsi->num_field_options; i++) {
+    field_options* fo = &lastsi->field_options[i];
+    RELAY_ERROR(wp_segment_set_field_options(&index->segments[index->num_segments - 1], fo->field, fo->options));
+  }
 
   // set the docid_offset
   segment_info* prevsi = MMAP_OBJ(index->segments[index->num_segments - 2].seginfo, segment_info);
@@ -322,21 +492,60 @@ RAISING_STATIC(get_and_writelock_last_segment(wp_index* index, wp_entry* entry,
   DEBUG("loaded new segment %d at %p", index->num_segments - 1, seg);
 
   RELAY_ERROR(wp_segment_grab_writelock(seg)); // lock it
-  RELAY_ERROR(wp_entry_sizeof_postings_region(entry, seg, &postings_bytes));
-  RELAY_ERROR(wp_segment_ensure_fit(seg, postings_bytes, 0, &success));
+  RELAY_ERROR(sizeof_entry(seg, entry, key, &growth));
+  RELAY_ERROR(wp_segment_ensure_fit(seg, &growth, &success));
   if(!success) RAISE_ERROR("can't fit new entry into fresh segment. that's crazy");
 
   *returned_seg = seg;
   return NO_ERROR;
 }
 
+void wp_index_set_max_segment_docs(wp_index* index, uint32_t max_segment_docs) {
+  index->max_segment_docs = max_segment_docs;
+}
+
+// has anyone dropped or merged segments since we last looked? they need the
+// write lock of each segment they get rid of, so once we hold a segment's
+// lock and this is false, the segment stays in the index until we let go.
+static int layout_changed(wp_index* index) {
+  return MMAP_OBJ(index->indexinfo, index_info)->layout_generation != index->layout_generation;
+}
+
+// seals a segment we've rolled over from. searches on it notice the new
+// generation and restart on the sealed postings. if it's been merged or
+// dropped in the meantime, there's nothing left to do.
+RAISING_STATIC(seal_full_segment(wp_index* index, uint32_t segment_id)) {
+  while(1) {
+    RELAY_ERROR(grab_writelock(index));
+    RELAY_ERROR(ensure_all_segments(index));
+    RELAY_ERROR(release_lock(index));
+
+    uint32_t i = 0;
+    while((i < index->num_segments) && (index->segment_ids[i] != segment_id)) i++;
+    if(i == index->num_segments) return NO_ERROR;
+
+    wp_segment* seg = &index->segments[i];
+    RELAY_ERROR(wp_segment_grab_writelock(seg));
+    if(!layout_changed(index)) {
+      DEBUG("sealing full segment %u", segment_id);
+      wp_error* e = wp_segment_reload(seg);
+      if(e == NO_ERROR) e = wp_segment_seal(seg);
+      RELAY_ERROR(wp_segment_release_lock(seg));
+      RELAY_ERROR(e);
+      return NO_ERROR;
+    }
+    RELAY_ERROR(wp_segment_release_lock(seg));
+  }
+}
+
 wp_error* wp_index_add_entry(wp_index* index, wp_entry* entry, uint64_t* doc_id) {
   wp_segment* seg = NULL;
   docid_t seg_doc_id;
+  uint32_t full_segment_id;
 
   // interleaving lock access -- potential for deadlock is high. :(
   RELAY_ERROR(grab_writelock(index)); // grab full-index lock
-  RELAY_ERROR(get_and_writelock_last_segment(index, entry, &seg));
+  RELAY_ERROR(get_and_writelock_last_segment(index, entry, NULL, &seg, &full_segment_id));
   RELAY_ERROR(release_lock(index)); // release full-index lock
 
   RELAY_ERROR(wp_segment_reload(seg));
@@ -345,6 +554,22 @@ wp_error* wp_index_add_entry(wp_index* index, wp_entry* entry, uint64_t* doc_id)
   RELAY_ERROR(wp_segment_release_lock(seg));
   *doc_id = seg_doc_id + index->docid_offsets[index->num_segments - 1];
 
+  if(full_segment_id != NO_SEGMENT_ID) RELAY_ERROR(seal_full_segment(index, full_segment_id));
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_set_field_options(wp_index* index, const char* field, uint32_t options) {
+  // new segments copy their options from the last segment, so that's the only
+  // one we need to change
+  RELAY_ERROR(grab_writelock(index));
+  RELAY_ERROR(ensure_all_segments(index));
+  wp_segment* seg = &index->segments[index->num_segments - 1];
+  RELAY_ERROR(wp_segment_grab_writelock(seg));
+  RELAY_ERROR(wp_segment_set_field_options(seg, field, options));
+  RELAY_ERROR(wp_segment_release_lock(seg));
+  RELAY_ERROR(release_lock(index));
+
   return NO_ERROR;
 }
 
@@ -359,6 +584,7 @@ wp_error* wp_index_free(wp_index* index) {
   if(index->open) RELAY_ERROR(wp_index_unload(index));
   free(index->segments);
   free(index->docid_offsets);
+  free(index->segment_ids);
   free(index);
 
   return NO_ERROR;
@@ -368,8 +594,9 @@ wp_error* wp_index_dumpinfo(wp_index* index, FILE* stream) {
   index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
   fprintf(stream, "index resides at %s\n", index->pathname_base);
   fprintf(stream, "index has %d segments and version %d\n", ii->num_segments, ii->index_version);
+  if(ii->first_docid_offset > 0) fprintf(stream, "docs up to %" PRIu64 " have been dropped\n", ii->first_docid_offset);
   for(int i = 0; i < index->num_segments; i++) {
-    fprintf(stream, "\nsegment %d:\n", i);
+    fprintf(stream, "\nsegment %u (docs %" PRIu64 " and up):\n", index->segment_ids[i], index->docid_offsets[i] + 1);
     wp_segment* seg = &index->segments[i];
     RELAY_ERROR(wp_segment_grab_readlock(seg));
     RELAY_ERROR(wp_segment_reload(seg));
@@ -383,15 +610,25 @@ wp_error* wp_index_dumpinfo(wp_index* index, FILE* stream) {
 wp_error* wp_index_delete(const char* pathname_base) {
   char buf[PATH_BUF_SIZE];
 
-  int i = 0;
-  while(1) {
-    snprintf(buf, PATH_BUF_SIZE, "%s%d", pathname_base, i);
+  // segments get numbered in order of creation, but dropping and merging
+  // leaves gaps, so try every number the index has handed out. (that also
+  // catches any merges that were interrupted partway.)
+  uint32_t next_segment_id = 0;
+  if(wp_index_exists(pathname_base)) {
+    mmap_obj indexinfo;
+    snprintf(buf, PATH_BUF_SIZE, "%s.ii", pathname_base);
+    RELAY_ERROR(mmap_obj_load(&indexinfo, "wp/indexinfo", buf));
+    next_segment_id = MMAP_OBJ(indexinfo, index_info)->next_segment_id;
+    RELAY_ERROR(mmap_obj_unload(&indexinfo));
+  }
+
+  for(uint32_t i = 0; ; i++) {
+    segment_pathname(buf, pathname_base, i);
     if(wp_segment_exists(buf)) {
       DEBUG("deleting segment %s", buf);
       RELAY_ERROR(wp_segment_delete(buf));
-      i++;
     }
-    else break;
+    else if(i >= next_segment_id) break;
   }
 
   snprintf(buf, PATH_BUF_SIZE, "%s.ii", pathname_base);
@@ -400,56 +637,537 @@ wp_error* wp_index_delete(const char* pathname_base) {
   return NO_ERROR;
 }
 
+// finds the segment with doc_id and locks it: with its label lock for label,
+// or with its write lock if label is NULL. if the segment goes away between
+// looking it up and locking it, we look again.
+RAISING_STATIC(lock_doc_segment(wp_index* index, uint64_t doc_id, const char* label, wp_segment** seg, docid_t* seg_doc_id)) {
+  while(1) {
+    RELAY_ERROR(grab_writelock(index));
+    RELAY_ERROR(ensure_all_segments(index));
+    RELAY_ERROR(release_lock(index));
+
+    uint32_t i = index->num_segments;
+    while((i > 0) && (doc_id <= index->docid_offsets[i - 1])) i--;
+    if(i == 0) RAISE_ERROR("couldn't find doc id %"PRIu64, doc_id);
+
+    DEBUG("found doc %"PRIu64" in segment %u", doc_id, i - 1);
+    *seg = &index->segments[i - 1];
+    *seg_doc_id = (docid_t)(doc_id - index->docid_offsets[i - 1]);
+    if(label == NULL) {
+      RELAY_ERROR(wp_segment_grab_writelock(*seg));
+      RELAY_ERROR(wp_segment_reload(*seg));
+    }
+    else RELAY_ERROR(wp_segment_grab_label_lock(*seg, label));
+
+    if(!layout_changed(index)) return NO_ERROR;
+
+    DEBUG("segment %u went away before we could lock it; looking again", i - 1);
+    if(label == NULL) RELAY_ERROR(wp_segment_release_lock(*seg));
+    else RELAY_ERROR(wp_segment_release_label_lock(*seg));
+  }
+}
+
 wp_error* wp_index_add_label(wp_index* index, const char* label, uint64_t doc_id) {
-  int found = 0;
+  wp_segment* seg;
+  docid_t seg_doc_id;
 
-  RELAY_ERROR(grab_writelock(index));
+  RELAY_ERROR(lock_doc_segment(index, doc_id, label, &seg, &seg_doc_id));
+  RELAY_ERROR(wp_segment_add_label(seg, label, seg_doc_id));
+  RELAY_ERROR(wp_segment_release_label_lock(seg));
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_remove_label(wp_index* index, const char* label, uint64_t doc_id) {
+  wp_segment* seg;
+  docid_t seg_doc_id;
+
+  RELAY_ERROR(lock_doc_segment(index, doc_id, label, &seg, &seg_doc_id));
+  RELAY_ERROR(wp_segment_remove_label(seg, label, seg_doc_id));
+  RELAY_ERROR(wp_segment_release_label_lock(seg));
+
+  return NO_ERROR;
+}
+
+// apply a label change to a batch of docs in ascending order, one segment
+// at a time. seg_doc_ids has room for num_docs docids.
+RAISING_STATIC(change_label_on_segments(wp_index* index, const char* label, uint32_t num_docs, uint64_t* doc_ids, docid_t* seg_doc_ids, int add)) {
+  uint32_t i = 0; // current segment
+  int stale = 1; // do we need to look at the segments again?
+  for(uint32_t j = 0; j < num_docs; ) {
+    if(stale) {
+      RELAY_ERROR(grab_writelock(index));
+      wp_error* e = ensure_all_segments(index);
+      RELAY_ERROR(release_lock(index));
+      RELAY_ERROR(e);
+      if((index->num_segments == 0) || (doc_ids[j] <= index->docid_offsets[0])) RAISE_ERROR("couldn't find doc id %"PRIu64, doc_ids[j]);
+      i = 0;
+      stale = 0;
+    }
+    while((i + 1 < index->num_segments) && (doc_ids[j] > index->docid_offsets[i + 1])) i++;
+
+    // every doc up to the next segment's range goes to this one
+    uint32_t n = 0;
+    while((j + n < num_docs) && ((i + 1 == index->num_segments) || (doc_ids[j + n] <= index->docid_offsets[i + 1]))) {
+      seg_doc_ids[n] = (docid_t)(doc_ids[j + n] - index->docid_offsets[i]);
+      n++;
+    }
+
+    wp_segment* seg = &index->segments[i];
+    DEBUG("%s label %s on %u docs in segment %u", add ? "adding" : "removing", label, n, i);
+    RELAY_ERROR(wp_segment_grab_label_lock(seg, label));
+    if(layout_changed(index)) { // it may have gone away; look again
+      RELAY_ERROR(wp_segment_release_label_lock(seg));
+      stale = 1;
+      continue;
+    }
+    if(seg_doc_ids[n - 1] > wp_segment_num_docs(seg)) {
+      RELAY_ERROR(wp_segment_release_label_lock(seg));
+      RAISE_ERROR("couldn't find doc id %"PRIu64, doc_ids[j + n - 1]);
+    }
+    wp_error* e;
+    if(add) e = wp_segment_add_label_to_docs(seg, label, n, seg_doc_ids);
+    else e = wp_segment_remove_label_from_docs(seg, label, n, seg_doc_ids);
+    RELAY_ERROR(wp_segment_release_label_lock(seg));
+    RELAY_ERROR(e);
+
+    j += n;
+  }
+
+  return NO_ERROR;
+}
+
+RAISING_STATIC(change_label_on_docs(wp_index* index, const char* label, uint32_t num_docs, uint64_t* doc_ids, int add)) {
+  for(uint32_t j = 0; j < num_docs; j++) {
+    if(doc_ids[j] == 0) RAISE_ERROR("couldn't find doc id 0");
+    if((j > 0) && (doc_ids[j] < doc_ids[j - 1])) RAISE_ERROR("doc ids must be in ascending order, but %"PRIu64" comes after %"PRIu64, doc_ids[j], doc_ids[j - 1]);
+  }
+
+  docid_t* seg_doc_ids = malloc(sizeof(docid_t) * (num_docs > 0 ? num_docs : 1));
+  wp_error* e = change_label_on_segments(index, label, num_docs, doc_ids, seg_doc_ids, add);
+  free(seg_doc_ids);
+  RELAY_ERROR(e);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_add_label_to_docs(wp_index* index, const char* label, uint32_t num_docs, uint64_t* doc_ids) {
+  RELAY_ERROR(change_label_on_docs(index, label, num_docs, doc_ids, 1));
+  return NO_ERROR;
+}
+
+wp_error* wp_index_remove_label_from_docs(wp_index* index, const char* label, uint32_t num_docs, uint64_t* doc_ids) {
+  RELAY_ERROR(change_label_on_docs(index, label, num_docs, doc_ids, 0));
+  return NO_ERROR;
+}
+
+// run the query to completion first, so that changing the label can't affect
+// which docs it matches
+RAISING_STATIC(change_label_on_query(wp_index* index, const char* label, wp_query* query, int add)) {
+  uint32_t num_docs = 0, size = RESULT_BUF_SIZE;
+  uint64_t* doc_ids = malloc(sizeof(uint64_t) * size);
+
+  RELAY_ERROR(wp_index_setup_query(index, query));
+  while(1) {
+    uint32_t this_num_results;
+    if(num_docs + RESULT_BUF_SIZE > size) {
+      size *= 2;
+      doc_ids = realloc(doc_ids, sizeof(uint64_t) * size);
+    }
+    RELAY_ERROR(wp_index_run_query(index, query, RESULT_BUF_SIZE, &this_num_results, &doc_ids[num_docs]));
+    num_docs += this_num_results;
+    if(this_num_results < RESULT_BUF_SIZE) break; // done
+  }
+  RELAY_ERROR(wp_index_teardown_query(index, query));
+
+  // results come in descending order
+  for(uint32_t i = 0; i < num_docs / 2; i++) {
+    uint64_t tmp = doc_ids[i];
+    doc_ids[i] = doc_ids[num_docs - 1 - i];
+    doc_ids[num_docs - 1 - i] = tmp;
+  }
+
+  RELAY_ERROR(change_label_on_docs(index, label, num_docs, doc_ids, add));
+  free(doc_ids);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_add_label_to_query(wp_index* index, const char* label, wp_query* query) {
+  RELAY_ERROR(change_label_on_query(index, label, query, 1));
+  return NO_ERROR;
+}
+
+wp_error* wp_index_remove_label_from_query(wp_index* index, const char* label, wp_query* query) {
+  RELAY_ERROR(change_label_on_query(index, label, query, 0));
+  return NO_ERROR;
+}
+
+#define LABEL_BUF_SIZE 32
+
+RAISING_STATIC(get_segment_doc_labels(wp_segment* seg, docid_t doc_id, char*** labels)) {
+  uint32_t buf[LABEL_BUF_SIZE];
+  uint32_t* label_ids = buf;
+  uint32_t num_labels;
+
+  RELAY_ERROR(wp_segment_get_doc_labels(seg, doc_id, LABEL_BUF_SIZE, &num_labels, label_ids));
+  if(num_labels > LABEL_BUF_SIZE) { // try again with a big enough buffer
+    label_ids = malloc(sizeof(uint32_t) * num_labels);
+    RELAY_ERROR(wp_segment_get_doc_labels(seg, doc_id, num_labels, &num_labels, label_ids));
+  }
+
+  stringmap* sh = MMAP_OBJ(seg->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(seg->stringpool, stringpool);
+  *labels = malloc(sizeof(char*) * (num_labels + 1));
+  for(uint32_t i = 0; i < num_labels; i++) (*labels)[i] = strdup(stringmap_int_to_string(sh, sp, label_ids[i]));
+  (*labels)[num_labels] = NULL;
+
+  if(label_ids != buf) free(label_ids);
+  return NO_ERROR;
+}
+
+wp_error* wp_index_get_labels(wp_index* index, uint32_t num_docs, uint64_t* doc_ids, char** labels[]) {
+  RELAY_ERROR(grab_readlock(index));
   RELAY_ERROR(ensure_all_segments(index));
   RELAY_ERROR(release_lock(index));
 
+  for(uint32_t j = 0; j < num_docs; j++) labels[j] = NULL;
+
+  for(uint32_t j = 0; j < num_docs; j++) {
+    uint64_t doc_id = doc_ids[j];
+
+    for(uint32_t i = index->num_segments; i > 0; i--) {
+      if(doc_id > index->docid_offsets[i - 1]) {
+        wp_segment* seg = &index->segments[i - 1];
+
+        DEBUG("found doc %"PRIu64" in segment %u", doc_id, i - 1);
+        docid_t seg_doc_id = (docid_t)(doc_id - index->docid_offsets[i - 1]);
+        RELAY_ERROR(wp_segment_grab_readlock(seg));
+        RELAY_ERROR(wp_segment_reload(seg));
+        if(seg_doc_id <= wp_segment_num_docs(seg)) RELAY_ERROR(get_segment_doc_labels(seg, seg_doc_id, &labels[j]));
+        RELAY_ERROR(wp_segment_release_lock(seg));
+        break;
+      }
+    }
+
+    if(labels[j] == NULL) {
+      for(uint32_t k = 0; k < j; k++) wp_index_free_labels(labels[k]);
+      RAISE_ERROR("couldn't find doc id %"PRIu64, doc_id);
+    }
+  }
+
+  return NO_ERROR;
+}
+
+void wp_index_free_labels(char** labels) {
+  for(char** label = labels; *label != NULL; label++) free(*label);
+  free(labels);
+}
+
+wp_error* wp_index_delete_doc(wp_index* index, uint64_t doc_id) {
+  wp_segment* seg;
+  docid_t seg_doc_id;
+
+  RELAY_ERROR(lock_doc_segment(index, doc_id, NULL, &seg, &seg_doc_id));
+  RELAY_ERROR(wp_segment_delete_doc(seg, seg_doc_id));
+  RELAY_ERROR(wp_segment_release_lock(seg));
+
+  return NO_ERROR;
+}
+
+// finds the doc a key points to, or 0 if there isn't one. the newest segment
+// to have seen the key has its latest doc, so we stop there. assumes
+// ensure_all_segments has been called.
+RAISING_STATIC(find_key(wp_index* index, const char* key, uint64_t* doc_id)) {
+  *doc_id = 0;
+
   for(uint32_t i = index->num_segments; i > 0; i--) {
-    if(doc_id > index->docid_offsets[i - 1]) {
-      wp_segment* seg = &index->segments[i - 1];
+    wp_segment* seg = &index->segments[i - 1];
+    RELAY_ERROR(wp_segment_grab_readlock(seg));
+    RELAY_ERROR(wp_segment_reload(seg));
+    docid_t seg_doc_id = wp_segment_lookup_key(seg, key);
+    if((seg_doc_id != DOCID_NONE) && !wp_segment_is_deleted(seg, seg_doc_id)) *doc_id = seg_doc_id + index->docid_offsets[i - 1];
+    RELAY_ERROR(wp_segment_release_lock(seg));
 
-      DEBUG("found doc %"PRIu64" in segment %u", doc_id, i - 1);
-      RELAY_ERROR(wp_segment_grab_writelock(seg));
-      RELAY_ERROR(wp_segment_reload(seg));
-      RELAY_ERROR(wp_segment_add_label(seg, label, (docid_t)(doc_id - index->docid_offsets[i - 1])));
-      RELAY_ERROR(wp_segment_release_lock(seg));
-      found = 1;
+    if(seg_doc_id != DOCID_NONE) {
+      DEBUG("found key '%s' in segment %u: doc %" PRIu64, key, i - 1, *doc_id);
       break;
     }
-    else DEBUG("did not find doc %"PRIu64" in segment %u", doc_id, i - 1);
   }
 
-  if(!found) RAISE_ERROR("couldn't find doc id %"PRIu64, doc_id);
+  return NO_ERROR;
+}
+
+wp_error* wp_index_lookup_key(wp_index* index, const char* key, uint64_t* doc_id) {
+  RELAY_ERROR(grab_readlock(index));
+  RELAY_ERROR(ensure_all_segments(index));
+  RELAY_ERROR(release_lock(index));
+
+  RELAY_ERROR(find_key(index, key, doc_id));
 
   return NO_ERROR;
 }
 
-wp_error* wp_index_remove_label(wp_index* index, const char* label, uint64_t doc_id) {
-  int found = 0;
+wp_error* wp_index_upsert_entry(wp_index* index, const char* key, wp_entry* entry, uint64_t* doc_id) {
+  wp_segment* seg = NULL;
+  docid_t seg_doc_id;
+  uint64_t old_doc_id;
+  uint32_t old_seg_idx = 0, full_segment_id;
+  char** labels = NULL;
 
+  // we hold the full-index lock throughout, so that no one else can change
+  // what the key points to while we're replacing it
   RELAY_ERROR(grab_writelock(index));
   RELAY_ERROR(ensure_all_segments(index));
-  RELAY_ERROR(release_lock(index));
+  RELAY_ERROR(find_key(index, key, &old_doc_id));
+
+  // the new version keeps the old one's labels
+  if(old_doc_id != 0) {
+    for(old_seg_idx = index->num_segments; old_seg_idx > 0; old_seg_idx--) if(old_doc_id > index->docid_offsets[old_seg_idx - 1]) break;
+    wp_segment* old_seg = &index->segments[old_seg_idx - 1];
+    RELAY_ERROR(wp_segment_grab_readlock(old_seg));
+    RELAY_ERROR(wp_segment_reload(old_seg));
+    RELAY_ERROR(get_segment_doc_labels(old_seg, (docid_t)(old_doc_id - index->docid_offsets[old_seg_idx - 1]), &labels));
+    RELAY_ERROR(wp_segment_release_lock(old_seg));
+  }
 
-  for(uint32_t i = index->num_segments; i > 0; i--) {
-    if(doc_id > index->docid_offsets[i - 1]) {
-      wp_segment* seg = &index->segments[i - 1];
+  RELAY_ERROR(get_and_writelock_last_segment(index, entry, key, &seg, &full_segment_id));
+  RELAY_ERROR(wp_segment_reload(seg));
+  RELAY_ERROR(wp_segment_grab_docid(seg, &seg_doc_id));
+  RELAY_ERROR(wp_entry_write_to_segment(entry, seg, seg_doc_id));
+  RELAY_ERROR(wp_segment_set_key(seg, key, seg_doc_id));
+  if(labels != NULL) {
+    for(char** label = labels; *label != NULL; label++) RELAY_ERROR(wp_segment_add_label(seg, *label, seg_doc_id));
+    wp_index_free_labels(labels);
+  }
+  *doc_id = seg_doc_id + index->docid_offsets[index->num_segments - 1];
 
-      DEBUG("found doc %"PRIu64" in segment %u", doc_id, i - 1);
-      RELAY_ERROR(wp_segment_grab_writelock(seg));
-      RELAY_ERROR(wp_segment_reload(seg));
-      RELAY_ERROR(wp_segment_remove_label(seg, label, (docid_t)(doc_id - index->docid_offsets[i - 1])));
-      RELAY_ERROR(wp_segment_release_lock(seg));
-      found = 1;
-      break;
+  // the old version disappears while we still hold the new one's segment, so
+  // searches never see both. searches only ever hold one segment lock at a
+  // time, and other writers are kept out by the index lock, so holding two
+  // can't deadlock.
+  wp_segment* old_seg = NULL;
+  if(old_doc_id != 0) {
+    old_seg = &index->segments[old_seg_idx - 1];
+    if(old_seg != seg) {
+      RELAY_ERROR(wp_segment_grab_writelock(old_seg));
+      RELAY_ERROR(wp_segment_reload(old_seg));
     }
-    else DEBUG("did not find doc %"PRIu64" in segment %u", doc_id, i - 1);
+    DEBUG("replacing doc %" PRIu64 " with doc %" PRIu64 " for key '%s'", old_doc_id, *doc_id, key);
+    RELAY_ERROR(wp_segment_delete_doc(old_seg, (docid_t)(old_doc_id - index->docid_offsets[old_seg_idx - 1])));
+  }
+
+  if((old_seg != NULL) && (old_seg != seg)) RELAY_ERROR(wp_segment_release_lock(old_seg));
+  RELAY_ERROR(wp_segment_release_lock(seg));
+  RELAY_ERROR(release_lock(index));
+
+  if(full_segment_id != NO_SEGMENT_ID) RELAY_ERROR(seal_full_segment(index, full_segment_id));
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_drop_oldest_segments(wp_index* index, uint32_t num_segments) {
+  char buf[PATH_BUF_SIZE];
+
+  RELAY_ERROR(grab_writelock(index));
+  RELAY_ERROR(ensure_all_segments(index));
+  if(num_segments >= index->num_segments) {
+    RELAY_ERROR(release_lock(index));
+    RAISE_ERROR("can't drop %u of %u segments; the newest one has to stay", num_segments, index->num_segments);
+  }
+
+  // wait for anyone in this process or another to finish with them, and
+  // keep them out until the segments are gone from the index
+  for(uint32_t i = 0; i < num_segments; i++) RELAY_ERROR(wp_segment_grab_writelock(&index->segments[i]));
+
+  // from here on, nobody will load them
+  index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  uint32_t* dropped_ids = malloc(sizeof(uint32_t) * (num_segments > 0 ? num_segments : 1));
+  memcpy(dropped_ids, index->segment_ids, sizeof(uint32_t) * num_segments);
+  ii->first_docid_offset = index->docid_offsets[num_segments];
+  memmove(ii->segment_ids, &ii->segment_ids[num_segments], sizeof(uint32_t) * (ii->num_segments - num_segments));
+  ii->num_segments -= num_segments;
+  ii->layout_generation++;
+  DEBUG("dropping %u segments; docs up to %" PRIu64 " are gone", num_segments, ii->first_docid_offset);
+
+  for(uint32_t i = 0; i < num_segments; i++) RELAY_ERROR(wp_segment_release_lock(&index->segments[i]));
+  RELAY_ERROR(reload_layout(index));
+
+  // processes that still have them loaded can keep reading them until they
+  // notice, since unlinking doesn't affect existing mappings
+  for(uint32_t i = 0; i < num_segments; i++) {
+    segment_pathname(buf, index->pathname_base, dropped_ids[i]);
+    RELAY_ERROR(wp_segment_delete(buf));
   }
+  free(dropped_ids);
+
+  RELAY_ERROR(release_lock(index));
+  return NO_ERROR;
+}
 
-  if(!found) RAISE_ERROR("couldn't find doc id %"PRIu64, doc_id);
+/* merging segments
+
+   the merged segment is built under a new number, without anyone else
+   knowing about it, by appending the postings of each segment in turn. each
+   of those is only read locked while it's being copied, so searches carry
+   on, and nothing else is held up.
+
+   then, with the index locked, we lock the segments for writing, which
+   waits out everyone using them and keeps label changers and deleters out,
+   copy over their labels and deletions, which may have changed in the
+   meantime, and swap the merged segment into their place in the index info.
+   bumping the layout generation tells everyone else to look again. */
+
+// finds where the segments with the given numbers are, next to each other
+// and not including the newest one. sets *first to index->num_segments if
+// they aren't.
+static void find_segment_run(wp_index* index, uint32_t num_segments, uint32_t* segment_ids, uint32_t* first) {
+  for(*first = 0; *first + num_segments < index->num_segments; (*first)++) {
+    if(!memcmp(&index->segment_ids[*first], segment_ids, sizeof(uint32_t) * num_segments)) return;
+  }
+  *first = index->num_segments;
+}
+
+// copy the postings of num_segments segments starting at first into merged,
+// and seal it. doc_offsets gets where each segment's docs start in merged.
+// success is set to 0 if they don't all fit.
+RAISING_STATIC(merge_postings(wp_index* index, uint32_t first, uint32_t num_segments, wp_segment* merged, docid_t* doc_offsets, int* success)) {
+  *success = 1;
+  for(uint32_t i = 0; (i < num_segments) && *success; i++) {
+    wp_segment* seg = &index->segments[first + i];
+    doc_offsets[i] = (docid_t)wp_segment_num_docs(merged);
+    RELAY_ERROR(wp_segment_grab_readlock(seg));
+    wp_error* e = wp_segment_reload(seg);
+    if(e == NO_ERROR) e = wp_segment_append_postings(merged, seg, success);
+    RELAY_ERROR(wp_segment_release_lock(seg));
+    RELAY_ERROR(e);
+  }
+  if(*success) RELAY_ERROR(wp_segment_seal(merged));
+
+  return NO_ERROR;
+}
+
+// with the index write lock held: copy the labels of the segments into
+// merged, and then put merged in their place. the segments are write-locked
+// from their labels being copied until they're gone from the layout, so
+// that no label change can get lost. swapped is set once they're gone.
+RAISING_STATIC(swap_in_merged_segment(wp_index* index, uint32_t first, uint32_t num_segments, uint32_t merged_id, wp_segment* merged, docid_t* doc_offsets, int* swapped)) {
+  uint32_t num_locked = 0;
+  wp_error* e = NO_ERROR;
+  while((e == NO_ERROR) && (num_locked < num_segments)) {
+    wp_segment* seg = &index->segments[first + num_locked];
+    e = wp_segment_grab_writelock(seg);
+    if(e != NO_ERROR) break;
+    num_locked++;
+    e = wp_segment_reload(seg);
+    if(e == NO_ERROR) e = wp_segment_append_labels(merged, seg, doc_offsets[num_locked - 1]);
+  }
+
+  if(e == NO_ERROR) {
+    index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+    ii->segment_ids[first] = merged_id;
+    memmove(&ii->segment_ids[first + 1], &ii->segment_ids[first + num_segments], sizeof(uint32_t) * (ii->num_segments - first - num_segments));
+    ii->num_segments -= num_segments - 1;
+    ii->layout_generation++;
+    *swapped = 1;
+  }
+
+  for(uint32_t i = 0; i < num_locked; i++) RELAY_ERROR(wp_segment_release_lock(&index->segments[first + i]));
+  RELAY_ERROR(e);
+  RELAY_ERROR(reload_layout(index));
+
+  return NO_ERROR;
+}
+
+// does the merging for wp_index_merge_segments, once merged has been
+// created. returns with no locks held, whatever happens.
+RAISING_STATIC(merge_segments_into(wp_index* index, uint32_t first, uint32_t num_segments, uint32_t* segment_ids, uint32_t merged_id, wp_segment* merged, docid_t* doc_offsets, int* swapped)) {
+  int success;
+  RELAY_ERROR(merge_postings(index, first, num_segments, merged, doc_offsets, &success));
+  if(!success) RAISE_ERROR("the docs of %u segments don't fit in one", num_segments);
+
+  // make sure no one else has merged or dropped them in the meantime
+  RELAY_ERROR(grab_writelock(index));
+  wp_error* e = ensure_all_segments(index);
+  if(e == NO_ERROR) {
+    find_segment_run(index, num_segments, segment_ids, &first);
+    if(first < index->num_segments) e = swap_in_merged_segment(index, first, num_segments, merged_id, merged, doc_offsets, swapped);
+  }
+  RELAY_ERROR(release_lock(index));
+  RELAY_ERROR(e);
+  if(!*swapped) RAISE_ERROR("segments were dropped or merged while we were merging them");
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_merge_segments(wp_index* index, uint32_t first, uint32_t num_segments) {
+  char buf[PATH_BUF_SIZE], merged_buf[PATH_BUF_SIZE];
+  wp_segment merged;
+
+  RELAY_ERROR(grab_writelock(index));
+  wp_error* e = ensure_all_segments(index);
+  if(e != NO_ERROR) {
+    RELAY_ERROR(release_lock(index));
+    RELAY_ERROR(e);
+  }
+  if((num_segments == 0) || ((uint64_t)first + num_segments >= index->num_segments)) {
+    RELAY_ERROR(release_lock(index));
+    RAISE_ERROR("can't merge %u segments starting at %u of %u; the newest one has to stay out of it", num_segments, first, index->num_segments);
+  }
+
+  index_info* ii = MMAP_OBJ(index->indexinfo, index_info);
+  uint32_t merged_id = ii->next_segment_id++;
+  uint32_t* segment_ids = malloc(sizeof(uint32_t) * num_segments);
+  memcpy(segment_ids, &index->segment_ids[first], sizeof(uint32_t) * num_segments);
+  RELAY_ERROR(release_lock(index));
+
+  segment_pathname(merged_buf, index->pathname_base, merged_id);
+  DEBUG("merging %u segments starting at %u into %s", num_segments, first, merged_buf);
+  e = wp_segment_create(&merged, merged_buf);
+  if(e != NO_ERROR) {
+    free(segment_ids);
+    RELAY_ERROR(wp_segment_delete(merged_buf)); // whatever got created
+    RELAY_ERROR(e);
+  }
+
+  docid_t* doc_offsets = malloc(sizeof(docid_t) * num_segments);
+  int swapped = 0;
+  e = merge_segments_into(index, first, num_segments, segment_ids, merged_id, &merged, doc_offsets, &swapped);
+  free(doc_offsets);
+  if(!swapped) { // throw it away
+    free(segment_ids);
+    RELAY_ERROR(wp_segment_unload(&merged));
+    RELAY_ERROR(wp_segment_delete(merged_buf));
+    RELAY_ERROR(e);
+  }
+  DEBUG("merged %u segments into %s", num_segments, merged_buf);
+
+  // from here on the merged segment is part of the index, and stays. as with
+  // dropping, anyone still reading the old ones can carry on until they
+  // notice.
+  if(e == NO_ERROR) e = wp_segment_unload(&merged);
+  for(uint32_t i = 0; (e == NO_ERROR) && (i < num_segments); i++) {
+    segment_pathname(buf, index->pathname_base, segment_ids[i]);
+    e = wp_segment_delete(buf);
+  }
+  free(segment_ids);
+  RELAY_ERROR(e);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_index_vacuum_labels(wp_index* index) {
+  RELAY_ERROR(grab_readlock(index));
+  RELAY_ERROR(ensure_all_segments(index));
+  RELAY_ERROR(release_lock(index));
+
+  for(uint32_t i = 0; i < index->num_segments; i++) {
+    wp_segment* seg = &index->segments[i];
+    RELAY_ERROR(wp_segment_grab_writelock(seg));
+    RELAY_ERROR(wp_segment_reload(seg));
+    RELAY_ERROR(wp_segment_vacuum_labels(seg));
+    RELAY_ERROR(wp_segment_release_lock(seg));
+  }
 
   return NO_ERROR;
 }
@@ -466,7 +1184,7 @@ wp_error* wp_index_num_docs(wp_index* index, uint64_t* num_docs) {
     wp_segment* seg = &index->segments[i - 1];
     RELAY_ERROR(wp_segment_grab_readlock(seg));
     RELAY_ERROR(wp_segment_reload(seg));
-    *num_docs += wp_segment_num_docs(seg);
+    *num_docs += wp_segment_num_docs(seg) - wp_segment_num_deleted(seg);
     RELAY_ERROR(wp_segment_release_lock(seg));
   }
 
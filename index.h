@@ -20,16 +20,23 @@
 
 typedef struct index_info {
   uint32_t index_version;
-  uint32_t num_segments;
+  uint32_t num_segments; // not counting dropped ones
+  uint32_t next_segment_id; // the on-disk number of the next new segment
+  uint32_t layout_generation; // bumped whenever segments are dropped or merged
+  uint64_t first_docid_offset; // the docid offset of the oldest segment
   pthread_rwlock_t lock;
+  uint32_t segment_ids[WP_MAX_SEGMENTS]; // the on-disk numbers of the segments, oldest first
 } index_info;
 
 typedef struct wp_index {
   const char* pathname_base;
+  uint32_t layout_generation; // of the segments we have loaded
   uint16_t num_segments;
   uint16_t sizeof_segments;
   uint64_t* docid_offsets;
+  uint32_t* segment_ids;
   wp_segment* segments;
+  uint32_t max_segment_docs; // see wp_index_set_max_segment_docs
   uint8_t open;
   mmap_obj indexinfo;
 } wp_index;
@@ -53,11 +60,11 @@ wp_error* wp_index_unload(wp_index* index) RAISES_ERROR;
 // anything on the index after calling this, though...
 wp_error* wp_index_free(wp_index* index) RAISES_ERROR;
 
-// public: returns the number of documents in the index.
+// public: returns the number of (undeleted) documents in the index.
 wp_error* wp_index_num_docs(wp_index* index, uint64_t* num_docs) RAISES_ERROR;
 
 // public: initializes a query for use on the index. must be called before
-// run_query
+// run_query. simplifies the query in place first; see wp_query_optimize.
 wp_error* wp_index_setup_query(wp_index* index, wp_query* query) RAISES_ERROR;
 
 // public: tears down a query from use on the index. must be called after
@@ -78,9 +85,39 @@ wp_error* wp_index_count_results(wp_index* index, wp_query* query, uint32_t* num
 // public: adds an entry to the index. sets doc_id to the new docid.
 wp_error* wp_index_add_entry(wp_index* index, wp_entry* entry, uint64_t* doc_id) RAISES_ERROR;
 
+// public: adds an entry under an external key (say, a message id), replacing
+// the doc that had the key before, if any. the old doc is deleted and its
+// labels are carried over to the new one. sets doc_id to the new docid.
+wp_error* wp_index_upsert_entry(wp_index* index, const char* key, wp_entry* entry, uint64_t* doc_id) RAISES_ERROR;
+
+// public: sets doc_id to the doc with an external key, or to 0 if there isn't
+// one (or it's been deleted). this is a hash lookup in each segment, newest
+// first, stopping at the first segment that has seen the key.
+wp_error* wp_index_lookup_key(wp_index* index, const char* key, uint64_t* doc_id) RAISES_ERROR;
+
+// public: sets the options (see WP_FIELD_* in segment.h) for a field, which
+// controls how much is stored for each of its terms. this only affects
+// documents added from now on, so you want to do this right after creating the
+// index. the options are kept with the index.
+wp_error* wp_index_set_field_options(wp_index* index, const char* field, uint32_t options) RAISES_ERROR;
+
+// public: starts a new segment whenever the newest one has max_segment_docs
+// docs, rather than only when it's full. 0, the default, means no limit.
+// this only applies to this wp_index object, and is mostly useful for
+// testing code that has to deal with more than one segment.
+void wp_index_set_max_segment_docs(wp_index* index, uint32_t max_segment_docs);
+
+// public: deletes a document. it will no longer appear in search results or
+// counts, and loses all its labels. its postings stay in the index. throws an
+// exception if the document doesn't exist. does nothing if it's already been
+// deleted.
+wp_error* wp_index_delete_doc(wp_index* index, uint64_t doc_id) RAISES_ERROR;
+
 // public: adds an label to a doc_id. throws an exception if the document
 // doesn't exist. does nothing if the label has already been added to the
-// document.
+// document. unless the label is new to the doc's segment, searches can keep
+// running on the segment while this happens (and likewise for the other
+// label changing calls below).
 wp_error* wp_index_add_label(wp_index* index, const char* label, uint64_t doc_id);
 
 // public: removes a label from a doc_id. throws an exception if the document
@@ -88,6 +125,56 @@ wp_error* wp_index_add_label(wp_index* index, const char* label, uint64_t doc_id
 // document.
 wp_error* wp_index_remove_label(wp_index* index, const char* label, uint64_t doc_id);
 
+// public: adds a label to a batch of docs, whose doc_ids must be in ascending
+// order. this takes each segment's lock once and merges the docs into the
+// label in one go, so it's much faster than adding them one at a time.
+// throws an exception if any document doesn't exist.
+wp_error* wp_index_add_label_to_docs(wp_index* index, const char* label, uint32_t num_docs, uint64_t* doc_ids) RAISES_ERROR;
+
+// public: removes a label from a batch of docs, whose doc_ids must be in
+// ascending order. throws an exception if any document doesn't exist.
+wp_error* wp_index_remove_label_from_docs(wp_index* index, const char* label, uint32_t num_docs, uint64_t* doc_ids) RAISES_ERROR;
+
+// public: adds a label to every doc matching a query. the query must not be
+// set up already.
+wp_error* wp_index_add_label_to_query(wp_index* index, const char* label, wp_query* query) RAISES_ERROR;
+
+// public: removes a label from every doc matching a query. the query must
+// not be set up already.
+wp_error* wp_index_remove_label_from_query(wp_index* index, const char* label, wp_query* query) RAISES_ERROR;
+
+// public: gets the labels on each of a batch of docs. labels[i] is set to a
+// newly malloc'd, NULL-terminated array of newly malloc'd label strings for
+// doc_ids[i]; free it with wp_index_free_labels. throws an exception if any
+// of the documents doesn't exist.
+wp_error* wp_index_get_labels(wp_index* index, uint32_t num_docs, uint64_t* doc_ids, char** labels[]) RAISES_ERROR;
+
+// public: frees an array of labels returned by wp_index_get_labels.
+void wp_index_free_labels(char** labels);
+
+// public: drops the num_segments oldest segments, along with their files, for
+// when you only want to keep so much history. the docs in them disappear,
+// and the other docs keep their doc ids. the newest segment can't be
+// dropped. searches in progress in other processes carry on over the dropped
+// segments until they next look at the index.
+wp_error* wp_index_drop_oldest_segments(wp_index* index, uint32_t num_segments) RAISES_ERROR;
+
+// public: merges num_segments adjacent segments, starting with segment
+// first (counting from the oldest one still around), into one, to keep the
+// number of segments down. every doc keeps its doc id, but the postings of
+// deleted docs are left behind, so this is also how their space gets
+// reclaimed. the newest segment can't be merged, since it's still being
+// added to. raises an error if the docs don't fit in one segment. this can
+// take a while, but searches carry on throughout, including ones already in
+// progress. only deletions, and labels new to a segment, wait while it's
+// being copied.
+wp_error* wp_index_merge_segments(wp_index* index, uint32_t first, uint32_t num_segments) RAISES_ERROR;
+
+// public: compacts the labels of every segment, reclaiming the space left
+// behind by removed labels and deleted docs. takes each segment's write lock
+// in turn.
+wp_error* wp_index_vacuum_labels(wp_index* index) RAISES_ERROR;
+
 // dumps some index to the stream.
 wp_error* wp_index_dumpinfo(wp_index* index, FILE* stream) RAISES_ERROR;
 
@@ -0,0 +1,144 @@
+#include "whistlepig.h"
+#include "intersect.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+uint32_t wp_docids_gallop(const docid_t* docids, uint32_t n, docid_t doc_id) {
+  if((n == 0) || (docids[0] <= doc_id)) return 0;
+
+  // docids[lo] is above doc_id throughout. double the step until we're past
+  // it, then binary search back.
+  uint32_t lo = 0, step = 1;
+  while((step < n - lo) && (docids[lo + step] > doc_id)) {
+    lo += step;
+    step *= 2;
+  }
+
+  uint32_t hi = (step < n - lo) ? lo + step : n;
+  while(hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(docids[mid] > doc_id) lo = mid;
+    else hi = mid;
+  }
+
+  return hi;
+}
+
+uint32_t wp_intersect_docids_scalar(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out) {
+  uint32_t i = 0, j = 0, n = 0;
+
+  while((i < na) && (j < nb)) {
+    if(a[i] > b[j]) i++;
+    else if(a[i] < b[j]) j++;
+    else {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+
+  return n;
+}
+
+uint32_t wp_intersect_docids_gallop(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out) {
+  uint32_t j = 0, n = 0;
+
+  for(uint32_t i = 0; (i < na) && (j < nb); i++) {
+    j += wp_docids_gallop(b + j, nb - j, a[i]);
+    if((j < nb) && (b[j] == a[i])) {
+      out[n++] = a[i];
+      j++;
+    }
+  }
+
+  return n;
+}
+
+/* the vector kernels compare a vector of a's docids against every rotation
+   of a vector of b's, which gives a bitmask of the a docids that are
+   somewhere in the b vector. whichever vector has the larger last docid
+   can't match anything further on in the other array, so it moves on.
+
+   a's matches are only written out once its vector moves on, so that out
+   can be a. */
+
+#if defined(__AVX2__)
+#define VECTOR_WIDTH 8
+
+static uint32_t vector_matches(const docid_t* a, const docid_t* b) {
+  __m256i va = _mm256_loadu_si256((const __m256i*)a);
+  __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i eq = _mm256_cmpeq_epi32(va, vb);
+
+  for(int r = 1; r < VECTOR_WIDTH; r++) {
+    __m256i rotation = _mm256_and_si256(_mm256_add_epi32(lanes, _mm256_set1_epi32(r)), _mm256_set1_epi32(VECTOR_WIDTH - 1));
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, _mm256_permutevar8x32_epi32(vb, rotation)));
+  }
+
+  return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+#elif defined(__SSE2__)
+#define VECTOR_WIDTH 4
+
+static uint32_t vector_matches(const docid_t* a, const docid_t* b) {
+  __m128i va = _mm_loadu_si128((const __m128i*)a);
+  __m128i vb = _mm_loadu_si128((const __m128i*)b);
+  __m128i eq = _mm_cmpeq_epi32(va, vb);
+
+  eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+  eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+  eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+
+  return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+#endif
+
+uint32_t wp_intersect_docids_merge(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out) {
+#ifdef VECTOR_WIDTH
+  uint32_t i = 0, j = 0, n = 0;
+  uint32_t matches = 0; // a's docids from a + i that we've found so far
+
+  while((i + VECTOR_WIDTH <= na) && (j + VECTOR_WIDTH <= nb)) {
+    docid_t last_a = a[i + VECTOR_WIDTH - 1], last_b = b[j + VECTOR_WIDTH - 1];
+    matches |= vector_matches(a + i, b + j);
+
+    if(last_a >= last_b) {
+      for(uint32_t k = 0; k < VECTOR_WIDTH; k++) if(matches & (1U << k)) out[n++] = a[i + k];
+      matches = 0;
+      i += VECTOR_WIDTH;
+    }
+    if(last_b >= last_a) j += VECTOR_WIDTH;
+  }
+
+  // write out what we found in the current vector of a, and carry on after
+  // the last of it. everything before that is above whatever's left of b.
+  if(matches != 0) {
+    uint32_t next = i;
+    for(uint32_t k = 0; k < VECTOR_WIDTH; k++) {
+      if(matches & (1U << k)) {
+        out[n++] = a[i + k];
+        next = i + k + 1;
+      }
+    }
+    i = next;
+  }
+
+  return n + wp_intersect_docids_scalar(a + i, na - i, b + j, nb - j, out + n);
+#else
+  return wp_intersect_docids_scalar(a, na, b, nb, out);
+#endif
+}
+
+uint32_t wp_intersect_docids(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out) {
+  if((na == 0) || (nb == 0)) return 0;
+  if(nb / na >= WP_INTERSECT_GALLOP_RATIO) return wp_intersect_docids_gallop(a, na, b, nb, out);
+  if(na / nb >= WP_INTERSECT_GALLOP_RATIO) return wp_intersect_docids_gallop(b, nb, a, na, out);
+  return wp_intersect_docids_merge(a, na, b, nb, out);
+}
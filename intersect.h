@@ -0,0 +1,41 @@
+#ifndef WP_INTERSECT_H_
+#define WP_INTERSECT_H_
+
+// whistlepig docid array intersection
+// (c) 2011 William Morgan. See COPYING for license terms.
+//
+// kernels for intersecting arrays of docids, as read off posting lists a
+// block at a time. like the posting lists themselves, arrays are in
+// descending docid order, without duplicates.
+//
+// the output of an intersection is in the same order. it can be written
+// over either input, since nothing is written ahead of what's been read.
+
+#include <stdint.h>
+#include "defaults.h"
+
+// when one array is this many times longer than the other, we search the
+// long one for each docid of the short one rather than walking both
+#define WP_INTERSECT_GALLOP_RATIO 32
+
+// returns the index of the first docid that's at most doc_id, or n if there
+// isn't one. searches outwards from the start, so it's cheap when the answer
+// is near the front.
+uint32_t wp_docids_gallop(const docid_t* docids, uint32_t n, docid_t doc_id);
+
+// writes the docids in both a and b to out, and returns how many there were.
+// picks one of the kernels below based on the sizes of a and b.
+uint32_t wp_intersect_docids(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out);
+
+// walks both arrays in step, a vector at a time if the compiler targets
+// SSE2 or AVX2
+uint32_t wp_intersect_docids_merge(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out);
+
+// walks a, galloping through b for each of its docids. for when a is much
+// shorter than b.
+uint32_t wp_intersect_docids_gallop(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out);
+
+// the element-by-element version of wp_intersect_docids_merge
+uint32_t wp_intersect_docids_scalar(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out);
+
+#endif
@@ -147,6 +147,21 @@ wp_error* wp_segment_grab_lock3(wp_segment* seg, int lock_type) {
 }
 */
 
+// grab the lock only if nobody else holds it (or, for a readlock, if nobody
+// is writing), without waiting. sets acquired to whether we got it.
+wp_error* wp_lock_try(pthread_rwlock_t* lock, int lock_type, int* acquired) {
+  int ret = 0;
+  switch(lock_type) {
+    case WP_LOCK_READLOCK: ret = pthread_rwlock_tryrdlock(lock); break;
+    case WP_LOCK_WRITELOCK: ret = pthread_rwlock_trywrlock(lock); break;
+    default: RAISE_ERROR("invalid lock type");
+  }
+
+  if((ret != 0) && (ret != EBUSY) && (ret != EAGAIN)) RAISE_SYSERROR("trying %slock", lock_type == WP_LOCK_READLOCK ? "read" : "write");
+  *acquired = (ret == 0);
+  return NO_ERROR;
+}
+
 wp_error* wp_lock_release(pthread_rwlock_t* lock) {
   if(pthread_rwlock_unlock(lock) != 0) RAISE_SYSERROR("releasing lock");
   return NO_ERROR;
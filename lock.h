@@ -13,6 +13,7 @@
 
 wp_error* wp_lock_setup(pthread_rwlock_t* lock) RAISES_ERROR;
 wp_error* wp_lock_grab(pthread_rwlock_t* lock, int lock_type) RAISES_ERROR;
+wp_error* wp_lock_try(pthread_rwlock_t* lock, int lock_type, int* acquired) RAISES_ERROR;
 wp_error* wp_lock_release(pthread_rwlock_t* lock) RAISES_ERROR;
 
 #endif
@@ -1,28 +1,29 @@
 #include <fcntl.h>
+#include <inttypes.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include "whistlepig.h"
 
 RAISING_STATIC(validate(mmap_obj_header* h, const char* magic)) {
   if(strncmp(magic, h->magic, MMAP_OBJ_MAGIC_SIZE)) RAISE_ERROR("invalid magic (expecting %s)", magic);
-  if(h->size == (uint32_t)-1) RAISE_ERROR("invalid size %d", h->size);
+  if(h->size == (uint64_t)-1) RAISE_ERROR("invalid size %" PRIu64, h->size);
   return NO_ERROR;
 }
 
-wp_error* mmap_obj_create(mmap_obj* o, const char* magic, const char* pathname, uint32_t initial_size) {
+wp_error* mmap_obj_create(mmap_obj* o, const char* magic, const char* pathname, uint64_t initial_size) {
   o->fd = open(pathname, O_EXCL | O_CREAT | O_RDWR, 0640);
   if(o->fd == -1) RAISE_SYSERROR("cannot create %s", pathname);
 
-  uint32_t size = initial_size + (uint32_t)sizeof(mmap_obj_header);
-  DEBUG("creating %s with %u + %lu = %u bytes for %s object", pathname, initial_size, sizeof(mmap_obj_header), size, magic);
-  lseek(o->fd, size - 1, SEEK_SET);
+  uint64_t size = initial_size + sizeof(mmap_obj_header);
+  DEBUG("creating %s with %" PRIu64 " + %lu = %" PRIu64 " bytes for %s object", pathname, initial_size, sizeof(mmap_obj_header), size, magic);
+  lseek(o->fd, (off_t)size - 1, SEEK_SET);
   ssize_t num_bytes = write(o->fd, "", 1);
   if(num_bytes == -1) RAISE_SYSERROR("write");
   o->content = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, 0);
   if(o->content == MAP_FAILED) RAISE_SYSERROR("mmap");
   strncpy(o->content->magic, magic, MMAP_OBJ_MAGIC_SIZE);
   o->content->size = o->loaded_size = initial_size;
-  DEBUG("created new %s object with %u bytes", magic, size);
+  DEBUG("created new %s object with %" PRIu64 " bytes", magic, size);
 
   return NO_ERROR;
 }
@@ -41,52 +42,65 @@ wp_error* mmap_obj_load(mmap_obj* o, const char* magic, const char* pathname) {
 
   o->loaded_size = o->content->size;
 
-  uint32_t size = o->content->size + (uint32_t)sizeof(mmap_obj_header);
-  DEBUG("full size is %u bytes (including %lu-byte header)", size, sizeof(mmap_obj_header));
+  uint64_t size = o->content->size + sizeof(mmap_obj_header);
+  DEBUG("full size is %" PRIu64 " bytes (including %lu-byte header)", size, sizeof(mmap_obj_header));
   if(munmap(o->content, sizeof(mmap_obj_header)) == -1) RAISE_SYSERROR("munmap");
 
   o->content = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, 0);
   if(o->content == MAP_FAILED) RAISE_SYSERROR("full mmap");
-  DEBUG("loaded full %s object of %u bytes", magic, size);
+  DEBUG("loaded full %s object of %" PRIu64 " bytes", magic, size);
 
   return NO_ERROR;
 }
 
 wp_error* mmap_obj_reload(mmap_obj* o) {
   if(o->loaded_size != o->content->size) {
-    DEBUG("need to reload %s because size of %u is now %u", o->content->magic, o->loaded_size, o->content->size);
-    uint32_t new_size = o->content->size + (uint32_t)sizeof(mmap_obj_header);
+    DEBUG("need to reload %s because size of %" PRIu64 " is now %" PRIu64, o->content->magic, o->loaded_size, o->content->size);
+    uint64_t new_size = o->content->size + sizeof(mmap_obj_header);
     if(munmap(o->content, sizeof(mmap_obj_header) + o->loaded_size) == -1) RAISE_SYSERROR("munmap");
     o->content = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, 0);
-    if(o->content == MAP_FAILED) RAISE_SYSERROR("mmap of %uk", new_size / 1024);
+    if(o->content == MAP_FAILED) RAISE_SYSERROR("mmap of %" PRIu64 "k", new_size / 1024);
     o->loaded_size = o->content->size;
-    DEBUG("loaded %u bytes for %s. header is at %p", o->content->size, o->content->magic, o->content);
+    DEBUG("loaded %" PRIu64 " bytes for %s. header is at %p", o->content->size, o->content->magic, o->content);
   }
 
   return NO_ERROR;
 }
 
-wp_error* mmap_obj_resize(mmap_obj* o, uint32_t data_size) {
-  DEBUG("going to expand from %u to %u bytes. current header is at %p", o->content->size, data_size, o->content);
+wp_error* mmap_obj_resize(mmap_obj* o, uint64_t data_size) {
+  DEBUG("going to resize from %" PRIu64 " to %" PRIu64 " bytes. current header is at %p", o->content->size, data_size, o->content);
 
+  uint64_t old_data_size = o->content->size;
   if(munmap(o->content, sizeof(mmap_obj_header) + o->content->size) == -1) RAISE_SYSERROR("munmap");
-  uint32_t size = data_size + (uint32_t)sizeof(mmap_obj_header);
+  uint64_t size = data_size + sizeof(mmap_obj_header);
 
-  lseek(o->fd, size - 1, SEEK_SET);
-  ssize_t num_bytes = write(o->fd, "", 1);
-  if(num_bytes == -1) RAISE_SYSERROR("write");
+  if(data_size < old_data_size) { // shrinking
+    if(ftruncate(o->fd, (off_t)size) == -1) RAISE_SYSERROR("ftruncate");
+  }
+  else {
+    lseek(o->fd, (off_t)size - 1, SEEK_SET);
+    ssize_t num_bytes = write(o->fd, "", 1);
+    if(num_bytes == -1) RAISE_SYSERROR("write");
+  }
   //lseek(fd, 0, SEEK_SET); // not necessary!
   o->content = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, 0);
   if(o->content == MAP_FAILED) RAISE_SYSERROR("mmap");
   o->content->size = o->loaded_size = data_size;
-  DEBUG("loaded %u bytes after resize. header is at %p", o->content->size, o->content);
+  DEBUG("loaded %" PRIu64 " bytes after resize. header is at %p", o->content->size, o->content);
+
+  return NO_ERROR;
+}
 
+wp_error* mmap_obj_sync(mmap_obj* o) {
+  if(msync(o->content, sizeof(mmap_obj_header) + o->content->size, MS_SYNC) == -1) RAISE_SYSERROR("msync");
+  if(fsync(o->fd) == -1) RAISE_SYSERROR("fsync"); // for the file size
   return NO_ERROR;
 }
 
 wp_error* mmap_obj_unload(mmap_obj* o) {
   DEBUG("unloading %lu bytes", sizeof(mmap_obj_header) + o->content->size);
   if(munmap(o->content, sizeof(mmap_obj_header) + o->content->size) == -1) RAISE_SYSERROR("munmap");
+  if(close(o->fd) == -1) RAISE_SYSERROR("close");
   o->content = NULL;
   return NO_ERROR;
 }
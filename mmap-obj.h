@@ -18,14 +18,14 @@
 // what's actually mmap'd
 typedef struct mmap_obj_header {
   char magic[MMAP_OBJ_MAGIC_SIZE];
-  uint32_t size; // size of payload, not including this header
+  uint64_t size; // size of payload, not including this header
   char obj[];    // the payload itself
 } mmap_obj_header;
 
 // what we pass around at runtime
 typedef struct mmap_obj {
   int fd;
-  uint32_t loaded_size; // compare against header->sizer
+  uint64_t loaded_size; // compare against header->sizer
   mmap_obj_header* content;
 } mmap_obj;
 
@@ -38,7 +38,7 @@ typedef struct mmap_obj {
 #define MMAP_OBJ_PTR(v, type) (type*)v->content->obj
 
 // public: create an object with an initial size
-wp_error* mmap_obj_create(mmap_obj* o, const char* magic, const char* pathname, uint32_t initial_size) RAISES_ERROR;
+wp_error* mmap_obj_create(mmap_obj* o, const char* magic, const char* pathname, uint64_t initial_size) RAISES_ERROR;
 
 // public: load an object, raising an error if it doesn't exist (or if the
 // magic doesn't match)
@@ -48,8 +48,12 @@ wp_error* mmap_obj_load(mmap_obj* o, const char* magic, const char* pathname) RA
 // first load.
 wp_error* mmap_obj_reload(mmap_obj* o) RAISES_ERROR;
 
-// public: resize an object. note that the obj pointer might change after this call.
-wp_error* mmap_obj_resize(mmap_obj* o, uint32_t new_size) RAISES_ERROR;
+// public: resize an object, growing or truncating the underlying file. note
+// that the obj pointer might change after this call.
+wp_error* mmap_obj_resize(mmap_obj* o, uint64_t new_size) RAISES_ERROR;
+
+// public: flush an object to disk, waiting until it's there
+wp_error* mmap_obj_sync(mmap_obj* o) RAISES_ERROR;
 
 // public: unload an object
 wp_error* mmap_obj_unload(mmap_obj* o) RAISES_ERROR;
@@ -109,6 +109,110 @@ void wp_query_free(wp_query* q) {
   free(q);
 }
 
+/* the parser, and anyone building queries out of other queries, produces
+   trees with more structure than they need. every level costs a search
+   state and a search_result per step, so wp_query_optimize strips out what
+   doesn't change which docs match. */
+
+static int strings_equal(const char* a, const char* b) {
+  if((a == NULL) || (b == NULL)) return a == b;
+  return !strcmp(a, b);
+}
+
+static int query_equals(wp_query* a, wp_query* b) {
+  if((a->type != b->type) || (a->num_children != b->num_children)) return 0;
+  if(!strings_equal(a->field, b->field) || !strings_equal(a->word, b->word)) return 0;
+
+  wp_query* bchild = b->children;
+  for(wp_query* achild = a->children; achild != NULL; achild = achild->next, bchild = bchild->next) {
+    if(!query_equals(achild, bchild)) return 0;
+  }
+
+  return 1;
+}
+
+// turns q into c, which must already be detached from its parent. q keeps its
+// place amongst its siblings, which is what lets us replace the root.
+static void become(wp_query* q, wp_query* c) {
+  if(q->field) free((void*)q->field);
+  if(q->word) free((void*)q->word);
+  q->type = c->type;
+  q->field = c->field;
+  q->word = c->word;
+  q->num_children = c->num_children;
+  q->children = c->children;
+  q->last = c->last;
+  free(c);
+}
+
+// adds c to q's children unless an identical child is already there
+static void add_unless_duplicate(wp_query* q, wp_query* c) {
+  for(wp_query* child = q->children; child != NULL; child = child->next) {
+    if(query_equals(child, c)) {
+      wp_query_free(c);
+      return;
+    }
+  }
+  c->next = NULL;
+  wp_query_add(q, c);
+}
+
+wp_query* wp_query_optimize(wp_query* q) {
+  for(wp_query* child = q->children; child != NULL; child = child->next) wp_query_optimize(child);
+
+  switch(q->type) {
+  case WP_QUERY_NEG:
+    if((q->children != NULL) && (q->children->type == WP_QUERY_NEG) && (q->children->children != NULL)) {
+      wp_query* neg = q->children;
+      wp_query* c = neg->children;
+      neg->children = NULL;
+      wp_query_free(neg);
+      become(q, c);
+    }
+    break;
+
+  case WP_QUERY_CONJ:
+  case WP_QUERY_DISJ: {
+    if(q->children == NULL) break; // matches nothing; leave it be
+    wp_query* every = NULL;
+    wp_query* child = q->children;
+    q->children = q->last = NULL;
+    q->num_children = 0;
+
+    while(child != NULL) {
+      wp_query* next = child->next;
+      if(child->type == q->type) { // children are optimized, so grandchildren aren't
+        wp_query* grandchild = child->children;
+        while(grandchild != NULL) {
+          wp_query* grandnext = grandchild->next;
+          add_unless_duplicate(q, grandchild);
+          grandchild = grandnext;
+        }
+        child->children = NULL;
+        wp_query_free(child);
+      }
+      else if((q->type == WP_QUERY_CONJ) && (child->type == WP_QUERY_EVERY)) {
+        if(every == NULL) every = child;
+        else wp_query_free(child);
+      }
+      else add_unless_duplicate(q, child);
+      child = next;
+    }
+
+    // a conjunction of nothing but every is every
+    if(every != NULL) {
+      if(q->children == NULL) add_unless_duplicate(q, every);
+      else wp_query_free(every);
+    }
+
+    if(q->num_children == 1) become(q, q->children);
+    break;
+  }
+  }
+
+  return q;
+}
+
 static int subquery_to_s(wp_query* q, size_t n, char* buf) {
   char* orig_buf = buf;
 
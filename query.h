@@ -35,6 +35,10 @@ typedef struct wp_query {
   struct wp_query* last;
 
   uint16_t segment_idx; // used to continue queries across segments (see index.c)
+  uint32_t layout_generation; // ditto
+  uint64_t resume_below; // ditto
+  uint32_t segment_generation; // ditto
+  docid_t last_doc_id; // ditto
   void* search_data; // whatever state we need for actually doing searches
 } wp_query;
 
@@ -79,6 +83,14 @@ wp_query* wp_query_set_all_child_fields(wp_query* q, const char* field);
 // public: free a query
 void wp_query_free(wp_query* q);
 
+// public: simplify a query in place without changing which docs it matches:
+// flattens nested conjunctions and disjunctions, drops duplicate children,
+// cancels double negations, and drops every-document nodes from
+// conjunctions. nodes left with one child are replaced by it, but q itself
+// stays the root. any nodes dropped are freed as with wp_query_free. returns
+// q.
+wp_query* wp_query_optimize(wp_query* q);
+
 // public: build a string representation of a query by writing at most n chars to buf
 size_t wp_query_to_s(wp_query* q, size_t n, char* buf);
 
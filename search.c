@@ -1,26 +1,74 @@
+#include <inttypes.h>
 #include "whistlepig.h"
+#include "intersect.h"
 
 /********* search states *********/
 typedef struct term_search_state {
-  posting posting;
+  posting posting; // read without positions; see term_search_result_init
+  int have_positions; // 1 if posting.positions has been filled in
+  pos_t* positions_buf; // scratch space for posting.positions
+  uint32_t positions_buf_size;
+  offset_t skip_offset; // the next skip record to consider, if any
   int started;
   int done;
   int label; // 1 if a label; 0 if a term
+  uint32_t label_s; // for labels, the label's string id
+  int dense; // 1 if a term with a dense posting list
+  offset_t dense_offset; // for dense terms, where the list is
+  int want_positions; // 1 if results should carry positions
+  uint32_t options; // the term's WP_FIELD_* options
+  uint32_t count; // the posting list header's count; see estimated_count
 } term_search_state;
 
+// a block of docids read from a child's stream with next_block(), for
+// operators that walk their children a block at a time
+typedef struct docid_block {
+  docid_t docids[SEARCH_BLOCK_SIZE];
+  uint32_t size;
+  uint32_t pos; // the current doc is docids[pos], if pos < size
+  int done; // 1 if the child has nothing after these
+} docid_block;
+
+// conjunctions and phrases are driven by their rarest child, and probe the
+// others rarest-first too, so most docs are ruled out after a probe or two.
+// results still come out in the order of q's children, which phrases rely on
+// for matching positions.
+//
+// next_block() intersects the rarest child's docids with those of the
+// children that aren't much more common, a block at a time, and only probes
+// the rest.
+typedef struct conj_search_state {
+  wp_query** children; // q's children by increasing estimated count
+  uint16_t* idx; // for each of those, its place amongst q's children
+  uint16_t num_merged; // how many of children are walked by next_block()
+  docid_block* blocks; // for those, their next docids, by place in children
+  int empty; // 1 if some child can't match anything in this segment
+} conj_search_state;
+
 typedef struct neg_search_state {
   docid_t next; // the next document in the child stream. we will never return this document.
   docid_t cur; // the last doc we returned
+  docid_block* block; // the child's stream, once we've been asked for a block
 } neg_search_state;
 
-#define DISJ_SEARCH_STATE_EMPTY 0
-#define DISJ_SEARCH_STATE_FILLED 1
-#define DISJ_SEARCH_STATE_DONE 2
-
+// disjunctions keep each child's next result in a heap, largest docid on
+// top, so returning a doc costs O(log n) per child that has it rather than
+// O(n) over all children. children whose results have been used up sit in
+// the pending list, and are moved along by the next call to next_doc (not
+// straight away, or an advance() to the doc just returned wouldn't find it).
+//
+// next_block() keeps each child's next block of docids in the same heap
+// instead of its next result.
 typedef struct disj_search_state {
-  docid_t last_docid;
-  uint8_t* states; // whether the search result has been initialized or not
-  search_result* results; // array of search results, one per child
+  wp_query** children; // q's children, by index
+  search_result* results; // each child's next result, if it's in the heap
+  docid_block* blocks; // each child's next docids, once we've been asked for a block
+  docid_t* heads; // each child's next docid, if it's in the heap
+  uint16_t* heap; // children with results, as a binary max-heap on docid
+  uint16_t heap_size;
+  uint16_t* pending; // children to move along before using the heap
+  uint16_t num_pending;
+  int empty; // 1 if no child can match anything in this segment
 } disj_search_state;
 
 void wp_search_result_free(search_result* result) {
@@ -39,10 +87,15 @@ RAISING_STATIC(search_result_init(search_result* result, const char* field, cons
   result->doc_matches[0].word = word;
   result->doc_matches[0].num_positions = posting->num_positions;
 
-  size_t size = sizeof(pos_t) * posting->num_positions;
-  result->doc_matches[0].positions = malloc(size);
-  //printf("for result at %p, allocated %u bytes for positions at %p\n", result, size, result->doc_matches[0].positions);
-  memcpy(result->doc_matches[0].positions, posting->positions, size);
+  // positions may be missing even when num_positions isn't zero, if the term
+  // only stores frequencies
+  if((posting->num_positions == 0) || (posting->positions == NULL)) result->doc_matches[0].positions = NULL;
+  else {
+    size_t size = sizeof(pos_t) * posting->num_positions;
+    result->doc_matches[0].positions = malloc(size);
+    //printf("for result at %p, allocated %u bytes for positions at %p\n", result, size, result->doc_matches[0].positions);
+    memcpy(result->doc_matches[0].positions, posting->positions, size);
+  }
 
   return NO_ERROR;
 }
@@ -59,7 +112,12 @@ RAISING_STATIC(search_result_combine_into(search_result* result, search_result*
       result->doc_matches[i].num_positions = 0;
       result->doc_matches[i].positions = NULL;
     }
-    else result->doc_matches[i] = child_results[i].doc_matches[0];
+    else {
+      // we only keep each child's first match
+      result->doc_matches[i] = child_results[i].doc_matches[0];
+      for(int j = 1; j < child_results[i].num_doc_matches; j++) free(child_results[i].doc_matches[j].positions);
+      free(child_results[i].doc_matches);
+    }
   }
 
   return NO_ERROR;
@@ -88,6 +146,15 @@ RAISING_STATIC(search_result_combine_into(search_result* result, search_result*
  * want to see if this stream contains it. if you want to actually see all the
  * docids in a stream, you must use next().
  *
+ * advance() can be given a NULL result, if all you want to know is whether
+ * the doc is there.
+ *
+ * there's also next_block(), which is next() for when only docids are
+ * wanted: it fills an array with up to max docids at once, without building
+ * any results, and sets done = true if the stream has run out. each node in
+ * a query is walked either with next_block() or with next() and advance(),
+ * never both, because operators that use next_block() read ahead in their
+ * children's streams.
  */
 
 /********** dispatch functions ***********/
@@ -115,6 +182,12 @@ static wp_error* disj_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id,
 static wp_error* phrase_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id, search_result* result, int* found, int* done) RAISES_ERROR;
 static wp_error* neg_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id, search_result* result, int* found, int* done) RAISES_ERROR;
 static wp_error* every_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id, search_result* result, int* found, int* done) RAISES_ERROR;
+static wp_error* term_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) RAISES_ERROR;
+static wp_error* conj_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) RAISES_ERROR;
+static wp_error* disj_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) RAISES_ERROR;
+static wp_error* phrase_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) RAISES_ERROR;
+static wp_error* neg_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) RAISES_ERROR;
+static wp_error* every_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) RAISES_ERROR;
 
 // the term_* functions also handle labels
 // we use conj for empty queries as well (why not)
@@ -168,6 +241,33 @@ RAISING_STATIC(query_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id,
   return NO_ERROR;
 }
 
+RAISING_STATIC(query_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done)) {
+  DISPATCH(q->type, next_block, q, s, max_num_docids, docids, num_docids, done);
+#ifdef DEBUGOUTPUT
+    char buf[1024];
+    wp_query_to_s(q, 1024, buf);
+    DEBUG("query %s has %u docs; done is %d", buf, *num_docids, *done);
+#endif
+  return NO_ERROR;
+}
+
+// reads the first block of q's stream. sets more to 0 if it's empty.
+RAISING_STATIC(docid_block_start(wp_query* q, wp_segment* s, docid_block* block, int* more)) {
+  RELAY_ERROR(query_next_block(q, s, SEARCH_BLOCK_SIZE, block->docids, &block->size, &block->done));
+  block->pos = 0;
+  *more = block->size > 0;
+  return NO_ERROR;
+}
+
+// moves a block on to its next docid, reading the next block from q's
+// stream if need be. sets more to 0 if there isn't one.
+RAISING_STATIC(docid_block_next(wp_query* q, wp_segment* s, docid_block* block, int* more)) {
+  block->pos++;
+  if((block->pos >= block->size) && !block->done) RELAY_ERROR(docid_block_start(q, s, block, more));
+  else *more = block->pos < block->size;
+  return NO_ERROR;
+}
+
 /************** init functions *************/
 
 RAISING_STATIC(init_children(wp_query* q, wp_segment* s)) {
@@ -180,6 +280,44 @@ RAISING_STATIC(release_children(wp_query* q)) {
   return NO_ERROR;
 }
 
+/* positions are decoded lazily: term iterators only read doc ids and offsets
+   as they move through a posting list, and go back for the positions of a
+   posting only when they return it as a result and someone has asked for
+   them. phrase queries ask for them for their children; everyone else can
+   call wp_search_request_positions(). */
+
+wp_error* wp_search_request_positions(wp_query* q) {
+  if((q->type == WP_QUERY_TERM) && (q->search_data != NULL)) ((term_search_state*)q->search_data)->want_positions = 1;
+  for(wp_query* child = q->children; child != NULL; child = child->next) RELAY_ERROR(wp_search_request_positions(child));
+  return NO_ERROR;
+}
+
+RAISING_STATIC(term_read_posting(term_search_state* state, wp_segment* s, offset_t offset)) {
+  state->have_positions = 0;
+  RELAY_ERROR(wp_segment_read_posting(s, offset, state->options, &state->posting, 0));
+  return NO_ERROR;
+}
+
+// labels and dense terms aren't lists to walk; we just look up the next docid
+// at or below doc_id each time
+RAISING_STATIC(term_read_at_most(term_search_state* state, wp_segment* s, docid_t doc_id)) {
+  state->have_positions = 0;
+  if(state->label) RELAY_ERROR(wp_segment_read_label(s, state->label_s, doc_id, &state->posting));
+  else RELAY_ERROR(wp_segment_read_dense_posting(s, state->dense_offset, state->options, doc_id, &state->posting));
+  if(state->posting.doc_id == DOCID_NONE) state->done = 1;
+  return NO_ERROR;
+}
+
+RAISING_STATIC(term_search_result_init(wp_query* q, wp_segment* s, search_result* result)) {
+  term_search_state* state = (term_search_state*)q->search_data;
+  if(state->want_positions && !state->have_positions && (state->options == WP_FIELD_POSITIONS)) {
+    RELAY_ERROR(wp_segment_read_positions(s, &state->posting, &state->positions_buf, &state->positions_buf_size));
+    state->have_positions = 1;
+  }
+  RELAY_ERROR(search_result_init(result, q->field, q->word, &state->posting));
+  return NO_ERROR;
+}
+
 static wp_error* term_init_search_state(wp_query* q, wp_segment* seg) {
   term t;
   stringmap* sh = MMAP_OBJ(seg->stringmap, stringmap);
@@ -188,6 +326,9 @@ static wp_error* term_init_search_state(wp_query* q, wp_segment* seg) {
 
   term_search_state* state = q->search_data = malloc(sizeof(term_search_state));
   state->started = 0;
+  state->want_positions = 0;
+  state->positions_buf = NULL;
+  state->positions_buf_size = 0;
 
   state->label = q->type == WP_QUERY_LABEL ? 1 : 0;
   if(state->label) t.field_s = 0;
@@ -195,20 +336,31 @@ static wp_error* term_init_search_state(wp_query* q, wp_segment* seg) {
 
   t.word_s = stringmap_string_to_int(sh, sp, q->word);
 
-  uint32_t offset;
+  offset_t offset;
   posting_list_header* plh = termhash_get_val(th, t);
 
   DEBUG("posting list header for %s:%s (-> %u:%u) is %p", q->field, q->word, t.field_s, t.word_s, plh);
   if(plh == NULL) offset = OFFSET_NONE;
   else offset = plh->next_offset;
 
-  if(plh) DEBUG("posting list header has count=%u next_offset=%u", plh->count, plh->next_offset);
+  if(plh) DEBUG("posting list header has count=%u next_offset=%" PRIu64, plh->count, plh->next_offset);
+
+  state->count = plh == NULL ? 0 : plh->count;
+
+  state->skip_offset = (plh == NULL || state->label) ? OFFSET_NONE : plh->skip_offset;
+  state->options = (plh == NULL || state->label) ? WP_FIELD_POSITIONS : plh->options;
+  state->dense = (plh != NULL) && !state->label && plh->dense;
 
-  if(offset == OFFSET_NONE) state->done = 1; // no entry in term hash
+  if(state->label || state->dense) {
+    state->label_s = t.word_s;
+    state->dense_offset = state->dense ? offset : OFFSET_NONE;
+    state->done = 0;
+    RELAY_ERROR(term_read_at_most(state, seg, MAX_LOGICAL_DOCID));
+  }
+  else if(offset == OFFSET_NONE) state->done = 1; // no entry in term hash
   else {
     state->done = 0;
-    if(state->label) RELAY_ERROR(wp_segment_read_label(seg, offset, &state->posting));
-    else RELAY_ERROR(wp_segment_read_posting(seg, offset, &state->posting, 1));
+    RELAY_ERROR(term_read_posting(state, seg, offset));
   }
 
   RELAY_ERROR(init_children(q, seg));
@@ -218,54 +370,184 @@ static wp_error* term_init_search_state(wp_query* q, wp_segment* seg) {
 
 static wp_error* term_release_search_state(wp_query* q) {
   term_search_state* state = q->search_data;
-  if(!state->done) free(state->posting.positions);
+  free(state->positions_buf);
   free(state);
   RELAY_ERROR(release_children(q));
   return NO_ERROR;
 }
 
+// how many docs we expect q to match in this segment, for planning
+// conjunctions. exact for terms and labels (modulo deleted docs), since the
+// posting list header keeps a count; a rough bound for everything else.
+// requires q's search state to have been initialized.
+static uint64_t estimated_count(wp_query* q, wp_segment* seg) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  uint64_t count = 0;
+
+  switch(q->type) {
+  case WP_QUERY_TERM:
+  case WP_QUERY_LABEL:
+    count = ((term_search_state*)q->search_data)->count;
+    break;
+  case WP_QUERY_CONJ:
+  case WP_QUERY_PHRASE:
+    if(q->children != NULL) count = UINT64_MAX;
+    for(wp_query* child = q->children; child != NULL; child = child->next) {
+      uint64_t child_count = estimated_count(child, seg);
+      if(child_count < count) count = child_count;
+    }
+    break;
+  case WP_QUERY_DISJ:
+    for(wp_query* child = q->children; child != NULL; child = child->next) count += estimated_count(child, seg);
+    if(count > si->num_docs) count = si->num_docs;
+    break;
+  case WP_QUERY_NEG: {
+    uint64_t child_count = estimated_count(q->children, seg);
+    count = child_count >= si->num_docs ? 0 : si->num_docs - child_count;
+    break;
+  }
+  case WP_QUERY_EVERY:
+    count = si->num_docs;
+    break;
+  }
+
+  return count;
+}
+
+// whether q can't match anything in this segment. unlike estimated_count,
+// this is never a guess, so labels, which can gain docs while a query is
+// running, don't count. requires q's search state to have been initialized.
+static int trivially_empty(wp_query* q, wp_segment* seg) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+
+  switch(q->type) {
+  case WP_QUERY_TERM: return ((term_search_state*)q->search_data)->count == 0;
+  case WP_QUERY_EMPTY:
+  case WP_QUERY_CONJ:
+  case WP_QUERY_PHRASE: return ((conj_search_state*)q->search_data)->empty;
+  case WP_QUERY_DISJ: return ((disj_search_state*)q->search_data)->empty;
+  case WP_QUERY_NEG: return (si->num_docs == 0) || (q->children->type == WP_QUERY_EVERY);
+  case WP_QUERY_EVERY: return si->num_docs == 0;
+  default: return 0;
+  }
+}
+
+// sorts q's children by estimated count. ties keep their order in the query.
+static conj_search_state* conj_search_state_new(wp_query* q, wp_segment* seg) {
+  conj_search_state* state = malloc(sizeof(conj_search_state));
+  state->empty = q->children == NULL;
+  state->children = malloc(sizeof(wp_query*) * (q->num_children > 0 ? q->num_children : 1));
+  state->idx = malloc(sizeof(uint16_t) * (q->num_children > 0 ? q->num_children : 1));
+  uint64_t* counts = malloc(sizeof(uint64_t) * (q->num_children > 0 ? q->num_children : 1));
+
+  uint16_t n = 0;
+  for(wp_query* child = q->children; child != NULL; child = child->next, n++) {
+    if(trivially_empty(child, seg)) state->empty = 1;
+    uint64_t count = estimated_count(child, seg);
+    uint16_t j = n;
+    for(; (j > 0) && (counts[j - 1] > count); j--) {
+      state->children[j] = state->children[j - 1];
+      state->idx[j] = state->idx[j - 1];
+      counts[j] = counts[j - 1];
+    }
+    state->children[j] = child;
+    state->idx[j] = n;
+    counts[j] = count;
+  }
+
+  // past this, probing with advance() lets a child skip what it doesn't need
+  // to read, which beats reading its docids in order
+  uint64_t max_merged_count = WP_INTERSECT_GALLOP_RATIO * ((n > 0) && (counts[0] > 0) ? counts[0] : 1);
+  state->num_merged = 0;
+  while((state->num_merged < n) && (counts[state->num_merged] < max_merged_count)) state->num_merged++;
+  state->blocks = NULL;
+
+#ifdef DEBUGOUTPUT
+  for(uint16_t i = 0; i < n; i++) {
+    char buf[1024];
+    wp_query_to_s(state->children[i], 1024, buf);
+    DEBUG("child %u is %s (#%u in the query) with estimated count %" PRIu64, i, buf, state->idx[i], counts[i]);
+  }
+#endif
+
+  free(counts);
+  return state;
+}
+
+static void conj_search_state_free(conj_search_state* state) {
+  free(state->blocks);
+  free(state->children);
+  free(state->idx);
+  free(state);
+}
+
 static wp_error* conj_init_search_state(wp_query* q, wp_segment* s) {
-  q->search_data = NULL; // no state needed
+  q->search_data = NULL;
   RELAY_ERROR(init_children(q, s));
+  q->search_data = conj_search_state_new(q, s);
   return NO_ERROR;
 }
 
 static wp_error* conj_release_search_state(wp_query* q) {
+  conj_search_state_free(q->search_data);
   RELAY_ERROR(release_children(q));
   return NO_ERROR;
 }
 
 static wp_error* disj_init_search_state(wp_query* q, wp_segment* s) {
   disj_search_state* state = q->search_data = malloc(sizeof(disj_search_state));
-  state->states = NULL;
-  state->results = NULL;
-  state->last_docid = DOCID_NONE;
+  uint16_t n = q->num_children > 0 ? q->num_children : 1;
+  state->children = malloc(sizeof(wp_query*) * n);
+  state->results = malloc(sizeof(search_result) * n);
+  state->blocks = NULL;
+  state->heads = malloc(sizeof(docid_t) * n);
+  state->heap = malloc(sizeof(uint16_t) * n);
+  state->pending = malloc(sizeof(uint16_t) * n);
+  state->heap_size = 0;
+  state->num_pending = 0;
+  state->empty = 1;
   RELAY_ERROR(init_children(q, s));
+
+  // every child starts out pending, except those that can't match, which
+  // are done before they start
+  uint16_t i = 0;
+  for(wp_query* child = q->children; child != NULL; child = child->next, i++) {
+    state->children[i] = child;
+    if(!trivially_empty(child, s)) {
+      state->pending[state->num_pending++] = i;
+      state->empty = 0;
+    }
+  }
+
   return NO_ERROR;
 }
 
 static wp_error* disj_release_search_state(wp_query* q) {
   disj_search_state* state = (disj_search_state*)q->search_data;
-  if(state->states) {
-    // free any remaining search results in the buffer
-    for(uint16_t i = 0; i < q->num_children; i++) {
-      if(state->states[i] == DISJ_SEARCH_STATE_FILLED) wp_search_result_free(&state->results[i]);
-    }
-    free(state->states);
-    free(state->results);
+  if(state->blocks == NULL) {
+    for(uint16_t k = 0; k < state->heap_size; k++) wp_search_result_free(&state->results[state->heap[k]]);
   }
+  free(state->children);
+  free(state->results);
+  free(state->blocks);
+  free(state->heads);
+  free(state->heap);
+  free(state->pending);
   free(state);
   RELAY_ERROR(release_children(q));
   return NO_ERROR;
 }
 
 static wp_error* phrase_init_search_state(wp_query* q, wp_segment* s) {
-  q->search_data = NULL; // no state needed
+  q->search_data = NULL;
   RELAY_ERROR(init_children(q, s));
+  RELAY_ERROR(wp_search_request_positions(q));
+  q->search_data = conj_search_state_new(q, s);
   return NO_ERROR;
 }
 
 static wp_error* phrase_release_search_state(wp_query* q) {
+  conj_search_state_free(q->search_data);
   RELAY_ERROR(release_children(q));
   return NO_ERROR;
 }
@@ -279,6 +561,7 @@ static wp_error* neg_init_search_state(wp_query* q, wp_segment* seg) {
   neg_search_state* state = q->search_data = malloc(sizeof(neg_search_state));
 
   state->cur = si->num_docs + 1;
+  state->block = NULL;
   search_result result;
   int done;
   RELAY_ERROR(query_next_doc(q->children, seg, &result, &done));
@@ -294,6 +577,7 @@ static wp_error* neg_init_search_state(wp_query* q, wp_segment* seg) {
 
 static wp_error* neg_release_search_state(wp_query* q) {
   RELAY_ERROR(wp_search_release_search_state(q->children));
+  free(((neg_search_state*)q->search_data)->block);
   free(q->search_data);
   return NO_ERROR;
 }
@@ -314,6 +598,16 @@ static wp_error* every_release_search_state(wp_query* q) {
 
 /********** search functions **********/
 
+// moves a term's stream on to its next posting, if any, without building a
+// result
+RAISING_STATIC(term_step(term_search_state* state, wp_segment* s)) {
+  if(!state->started) state->started = 1; // start
+  else if(state->label || state->dense) RELAY_ERROR(term_read_at_most(state, s, state->posting.doc_id - 1));
+  else if(state->posting.next_offset == OFFSET_NONE) state->done = 1; // end of stream
+  else RELAY_ERROR(term_read_posting(state, s, state->posting.next_offset));
+  return NO_ERROR;
+}
+
 static wp_error* term_next_doc(wp_query* q, wp_segment* s, search_result* result, int* done) {
   term_search_state* state = (term_search_state*)q->search_data;
 
@@ -323,27 +617,27 @@ static wp_error* term_next_doc(wp_query* q, wp_segment* s, search_result* result
     return NO_ERROR;
   }
 
-  *done = 0;
-  if(!state->started) { // start
-    state->started = 1;
-    RELAY_ERROR(search_result_init(result, q->field, q->word, &state->posting));
-  }
-  else { // advance
-    free(state->posting.positions);
-    if(state->posting.next_offset == OFFSET_NONE) { // end of stream
-      *done = state->done = 1;
-    }
-    else {
-      if(state->label) RELAY_ERROR(wp_segment_read_label(s, state->posting.next_offset, &state->posting));
-      else RELAY_ERROR(wp_segment_read_posting(s, state->posting.next_offset, &state->posting, 1));
-      RELAY_ERROR(search_result_init(result, q->field, q->word, &state->posting));
-    }
-  }
+  RELAY_ERROR(term_step(state, s));
+  *done = state->done;
+  if(!state->done) RELAY_ERROR(term_search_result_init(q, s, result));
   DEBUG("[%s:'%s'] after: doc id %u, done is %d, started is %d", q->field, q->word, (state->started && !state->done && result) ? result->doc_id : 0, *done, state->started);
 
   return NO_ERROR;
 }
 
+static wp_error* term_next_block(wp_query* q, wp_segment* s, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) {
+  term_search_state* state = (term_search_state*)q->search_data;
+
+  *num_docids = 0;
+  while((*num_docids < max_num_docids) && !state->done) {
+    RELAY_ERROR(term_step(state, s));
+    if(!state->done) docids[(*num_docids)++] = state->posting.doc_id;
+  }
+  *done = state->done;
+
+  return NO_ERROR;
+}
+
 static wp_error* term_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id, search_result* result, int* found, int* done) {
   term_search_state* state = (term_search_state*)q->search_data;
   DEBUG("[%s:'%s'] seeking through postings for doc %u", q->field, q->word, doc_id);
@@ -354,16 +648,32 @@ static wp_error* term_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id,
     return NO_ERROR;
   }
 
+  // labels and dense terms can be probed for the doc directly
+  if((state->label || state->dense) && (state->posting.doc_id > doc_id)) RELAY_ERROR(term_read_at_most(state, s, doc_id));
+
+  // first, follow the skip chain as far as we can without passing doc_id.
+  // skip records pointing at or above the current posting are stale (we got
+  // past them via next_doc) and are simply dropped.
+  while((state->posting.doc_id > doc_id) && (state->skip_offset != OFFSET_NONE)) {
+    block_header bh;
+    RELAY_ERROR(wp_segment_read_skip(s, state->skip_offset, &bh));
+    if(bh.max_docid < doc_id) break; // would jump past the doc; walk the rest
+
+    state->skip_offset = bh.next_offset;
+    if(bh.max_docid < state->posting.doc_id) {
+      DEBUG("jumping from doc_id %u to doc_id %u at %" PRIu64, state->posting.doc_id, bh.max_docid, bh.block_start);
+      RELAY_ERROR(term_read_posting(state, s, bh.block_start));
+    }
+  }
+
   while(state->posting.doc_id > doc_id) {
-    free(state->posting.positions);
     DEBUG("skipping doc_id %u", state->posting.doc_id);
     if(state->posting.next_offset == OFFSET_NONE) {
       state->done = 1;
       break;
     }
 
-    if(state->label) RELAY_ERROR(wp_segment_read_label(s, state->posting.next_offset, &state->posting));
-    else RELAY_ERROR(wp_segment_read_posting(s, state->posting.next_offset, &state->posting, 1));
+    RELAY_ERROR(term_read_posting(state, s, state->posting.next_offset));
     //DEBUG("advanced posting to %p", state->posting);
   }
 
@@ -376,96 +686,110 @@ static wp_error* term_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id,
     *done = 0;
     DEBUG("[%s:'%s'] posting advanced to that of doc %u", q->field, q->word, state->posting.doc_id);
     *found = (doc_id == state->posting.doc_id ? 1 : 0);
-    if(*found) RELAY_ERROR(search_result_init(result, q->field, q->word, &state->posting));
+    if(*found && (result != NULL)) RELAY_ERROR(term_search_result_init(q, s, result));
   }
 
   return NO_ERROR;
 }
 
-// this advances all children *until* it finds a child that doesn't have the
-// doc. at that point it stops. so it will return found=0 if any single child
-// doesn't have the doc, and done=1 if any single child is done.
+// this advances all children, rarest first, *until* it finds a child that
+// doesn't have the doc. at that point it stops. so it will return found=0 if
+// any single child doesn't have the doc, and done=1 if any single child is
+// done. child_results are filled in in the order of q's children, unless
+// child_results is NULL.
 //
 // this is used by both phrasal and conjunctive queries.
 static wp_error* advance_all_children(wp_query* q, wp_segment* seg, docid_t search_doc, search_result* child_results, int* found, int* done) {
+  conj_search_state* state = (conj_search_state*)q->search_data;
   int num_children_searched = 0;
   *found = 1;
 
   DEBUG("advancing all children to doc %u with early termination", search_doc);
 
-  for(wp_query* child = q->children; child != NULL; child = child->next) {
-    RELAY_ERROR(query_advance_to_doc(child, seg, search_doc, &child_results[num_children_searched], found, done));
+  for(uint16_t i = 0; i < q->num_children; i++) {
+    RELAY_ERROR(query_advance_to_doc(state->children[i], seg, search_doc, child_results == NULL ? NULL : &child_results[state->idx[i]], found, done));
     num_children_searched++;
     if(!*found) break;
   }
 
-  if(!*found) for(int i = 0; i < num_children_searched - 1; i++) wp_search_result_free(&child_results[i]);
+  if(!*found && (child_results != NULL)) for(int i = 0; i < num_children_searched - 1; i++) wp_search_result_free(&child_results[state->idx[i]]);
 
   return NO_ERROR;
 }
 
-static wp_error* disj_next_doc(wp_query* q, wp_segment* seg, search_result* result, int* done) {
-  if(q->children == NULL) {
-    *done = 1;
-    return NO_ERROR;
+// whether heap entry a belongs above heap entry b. ties go to the earlier
+// child, so results don't depend on the order things happened to be pushed.
+static int disj_heap_above(disj_search_state* state, uint16_t a, uint16_t b) {
+  docid_t doc_a = state->heads[a], doc_b = state->heads[b];
+  return (doc_a > doc_b) || ((doc_a == doc_b) && (a < b));
+}
+
+static void disj_heap_push(disj_search_state* state, uint16_t child_idx) {
+  uint16_t k = state->heap_size++;
+  while(k > 0) {
+    uint16_t parent = (uint16_t)((k - 1) / 2);
+    if(!disj_heap_above(state, child_idx, state->heap[parent])) break;
+    state->heap[k] = state->heap[parent];
+    k = parent;
   }
+  state->heap[k] = child_idx;
+}
 
-  // allocate search state if necessary
-  disj_search_state* state = (disj_search_state*)q->search_data;
-  if(state->states == NULL) {
-    state->states = malloc(sizeof(uint8_t) * q->num_children);
-    state->results = malloc(sizeof(search_result) * q->num_children);
-    memset(state->states, DISJ_SEARCH_STATE_EMPTY, sizeof(uint8_t) * q->num_children);
+static uint16_t disj_heap_pop(disj_search_state* state) {
+  uint16_t top = state->heap[0];
+  uint16_t last = state->heap[--state->heap_size];
+  uint16_t k = 0;
+  while(1) {
+    uint32_t child = 2 * (uint32_t)k + 1;
+    if(child >= state->heap_size) break;
+    if((child + 1 < state->heap_size) && disj_heap_above(state, state->heap[child + 1], state->heap[child])) child++;
+    if(!disj_heap_above(state, state->heap[child], last)) break;
+    state->heap[k] = state->heap[child];
+    k = (uint16_t)child;
   }
+  if(state->heap_size > 0) state->heap[k] = last;
+  return top;
+}
 
-  // fill all the results we can into the buffer by calling next_doc on all
-  // non-done children
-  uint16_t i = 0;
-  for(wp_query* child = q->children; child != NULL; child = child->next) {
-    if(state->states[i] == DISJ_SEARCH_STATE_EMPTY) {
-      int thisdone = 0;
-      DEBUG("recursing on child %d", i);
-      RELAY_ERROR(query_next_doc(child, seg, &(state->results[i]), &thisdone));
-      if(thisdone == 1) state->states[i] = DISJ_SEARCH_STATE_DONE;
-      else state->states[i] = DISJ_SEARCH_STATE_FILLED;
-      DEBUG("after recurse, state %d is marked %d", i, state->states[i]);
-    }
-    i++;
-  }
-
-  // now find the largest
-  uint16_t max_doc_idx = 0;
-  docid_t max_docid = 0;
-
-  *done = 1;
-  i = 0;
-  for(wp_query* child = q->children; child != NULL; child = child->next) {
-    DEBUG("child %d is marked as %d", i, state->states[i]);
-    if(state->states[i] == DISJ_SEARCH_STATE_FILLED) {
-      if((*done == 1) || (state->results[i].doc_id > max_docid)) {
-        if(state->results[i].doc_id == state->last_docid) { // discard dupes
-          DEBUG("child %d has old result %u; voiding", i, state->last_docid);
-          wp_search_result_free(&state->results[i]);
-          state->states[i] = DISJ_SEARCH_STATE_EMPTY;
-        }
-        else {
-          *done = 0;
-          max_docid = state->results[i].doc_id;
-          max_doc_idx = i;
-        }
-      }
+// moves all pending children along to their next doc
+RAISING_STATIC(disj_refill(disj_search_state* state, wp_segment* seg)) {
+  for(uint16_t k = 0; k < state->num_pending; k++) {
+    uint16_t i = state->pending[k];
+    int child_done;
+    DEBUG("recursing on child %u", i);
+    RELAY_ERROR(query_next_doc(state->children[i], seg, &state->results[i], &child_done));
+    if(!child_done) {
+      state->heads[i] = state->results[i].doc_id;
+      disj_heap_push(state, i);
     }
-    i++;
+  }
+  state->num_pending = 0;
+  return NO_ERROR;
+}
+
+static wp_error* disj_next_doc(wp_query* q, wp_segment* seg, search_result* result, int* done) {
+  disj_search_state* state = (disj_search_state*)q->search_data;
+  RELAY_ERROR(disj_refill(state, seg));
+
+  if(state->heap_size == 0) {
+    *done = 1;
+    return NO_ERROR;
   }
 
-  // finally, copy the result
-  if(*done == 0) {
-    DEBUG("returning doc %d at index %d", max_docid, max_doc_idx);
-    memcpy(result, &state->results[max_doc_idx], sizeof(search_result));
-    state->states[max_doc_idx] = DISJ_SEARCH_STATE_EMPTY;
-    state->last_docid = result->doc_id;
+  // the top child gives us the result. every other child that has the same
+  // doc is used up along with it.
+  *done = 0;
+  uint16_t i = disj_heap_pop(state);
+  memcpy(result, &state->results[i], sizeof(search_result));
+  state->pending[state->num_pending++] = i;
+  while((state->heap_size > 0) && (state->results[state->heap[0]].doc_id == result->doc_id)) {
+    uint16_t j = disj_heap_pop(state);
+    DEBUG("child %u also has doc %u", j, result->doc_id);
+    wp_search_result_free(&state->results[j]);
+    state->pending[state->num_pending++] = j;
   }
 
+  DEBUG("returning doc %u from child %u", result->doc_id, i);
   return NO_ERROR;
 }
 
@@ -474,9 +798,9 @@ static wp_error* conj_next_doc(wp_query* q, wp_segment* seg, search_result* resu
   int found = 0;
   *done = 0;
 
-  // start with the first child's first doc
-  // TODO: find smallest postings list and use that instead
-  wp_query* master = q->children;
+  // walk the rarest child's docs
+  conj_search_state* state = (conj_search_state*)q->search_data;
+  wp_query* master = state->empty ? NULL : state->children[0];
   if(master == NULL) *done = 1;
 
   while(!found && !*done) {
@@ -486,6 +810,7 @@ static wp_error* conj_next_doc(wp_query* q, wp_segment* seg, search_result* resu
       search_doc = result->doc_id;
       wp_search_result_free(result); // sigh
       RELAY_ERROR(conj_advance_to_doc(q, seg, search_doc, result, &found, done));
+      if(found) *done = 0; // a child may have nothing after this doc, but this doc counts
     }
     DEBUG("after search, found is %d and done is %d", found, *done);
   }
@@ -494,6 +819,17 @@ static wp_error* conj_next_doc(wp_query* q, wp_segment* seg, search_result* resu
 }
 
 static wp_error* conj_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id, search_result* result, int* found, int* done) {
+  if(((conj_search_state*)q->search_data)->empty) {
+    *found = 0;
+    *done = 1;
+    return NO_ERROR;
+  }
+
+  if(result == NULL) {
+    RELAY_ERROR(advance_all_children(q, s, doc_id, NULL, found, done));
+    return NO_ERROR;
+  }
+
   search_result* child_results = malloc(sizeof(search_result) * q->num_children);
   RELAY_ERROR(advance_all_children(q, s, doc_id, child_results, found, done));
 
@@ -506,46 +842,170 @@ static wp_error* conj_advance_to_doc(wp_query* q, wp_segment* s, docid_t doc_id,
   return NO_ERROR;
 }
 
+// cuts candidates down to those that child has, reading as much of its
+// stream as it takes to get past the last of them (but no further, as the
+// rest is for the next lot of candidates). sets exhausted if the child has
+// nothing left.
+RAISING_STATIC(conj_intersect_child(wp_query* child, wp_segment* seg, docid_block* block, docid_t* candidates, uint32_t* num_candidates, int* exhausted)) {
+  uint32_t n = *num_candidates, num_kept = 0, c = 0;
+  int more = 1;
+
+  while((c < n) && more) {
+    if(block->pos >= block->size) {
+      if(block->done) break;
+      RELAY_ERROR(docid_block_start(child, seg, block, &more));
+      continue;
+    }
+
+    const docid_t* docids = block->docids + block->pos;
+    uint32_t size = block->size - block->pos;
+    uint32_t k = wp_docids_gallop(docids, size, candidates[n - 1] - 1); // docids[k] is below every candidate
+
+    // candidates before c were checked against the child's earlier docids
+    num_kept += wp_intersect_docids(candidates + c, n - c, docids, k, candidates + num_kept);
+    block->pos += k;
+    if(k < size) break;
+    c += wp_docids_gallop(candidates + c, n - c, docids[k - 1] - 1);
+  }
+
+  *num_candidates = num_kept;
+  *exhausted = (block->pos >= block->size) && block->done;
+  return NO_ERROR;
+}
+
+// the rarest child gives us a block of candidates, which we intersect with
+// the next few children's docids and then probe the remaining children for.
+// the rarest child itself is never advanced, since it has already read past
+// the candidates.
+static wp_error* conj_next_block(wp_query* q, wp_segment* seg, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) {
+  conj_search_state* state = (conj_search_state*)q->search_data;
+  docid_t candidates[SEARCH_BLOCK_SIZE];
+
+  if(state->blocks == NULL) {
+    state->blocks = calloc(state->num_merged > 0 ? state->num_merged : 1, sizeof(docid_block));
+  }
+
+  *num_docids = 0;
+  *done = state->empty;
+  while((*num_docids < max_num_docids) && !*done) {
+    uint32_t want = max_num_docids - *num_docids;
+    if(want > SEARCH_BLOCK_SIZE) want = SEARCH_BLOCK_SIZE;
+
+    uint32_t num_candidates;
+    RELAY_ERROR(query_next_block(state->children[0], seg, want, candidates, &num_candidates, done));
+    for(uint16_t j = 1; (j < state->num_merged) && (num_candidates > 0); j++) {
+      int exhausted = 0;
+      RELAY_ERROR(conj_intersect_child(state->children[j], seg, &state->blocks[j], candidates, &num_candidates, &exhausted));
+      if(exhausted) *done = 1; // nothing after these candidates can match
+    }
+
+    for(uint32_t i = 0; i < num_candidates; i++) {
+      int found = 1, child_done = 0;
+      for(uint16_t j = state->num_merged; (j < q->num_children) && found; j++) {
+        RELAY_ERROR(query_advance_to_doc(state->children[j], seg, candidates[i], NULL, &found, &child_done));
+      }
+      if(found) docids[(*num_docids)++] = candidates[i];
+      else if(child_done) { // nothing more can match
+        *done = 1;
+        break;
+      }
+    }
+  }
+
+  return NO_ERROR;
+}
+
+// only children that might be at or above doc_id have to be advanced: the
+// pending ones, and those whose next result is at or above it. the rest have
+// already shown they don't have it.
 static wp_error* disj_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc_id, search_result* result, int* found, int* done) {
-  search_result child_result;
-  int child_found;
+  disj_search_state* state = (disj_search_state*)q->search_data;
 
   DEBUG("advancing all to %d", doc_id);
 
   *found = 0;
-  *done = 0;
-  uint16_t i = 0;
-  for(wp_query* child = q->children; child != NULL; child = child->next) {
-    int child_done;
-    RELAY_ERROR(query_advance_to_doc(child, seg, doc_id, &child_result, &child_found, &child_done));
-    DEBUG("child %u reports found %d and done %d", i, child_found, child_done);
-    *done = *done && child_done; // we're only done if ALL children are done
-    if(child_found && !*found) {
+  while((state->heap_size > 0) && (state->results[state->heap[0]].doc_id >= doc_id)) {
+    uint16_t i = disj_heap_pop(state);
+    if((state->results[i].doc_id == doc_id) && !*found && (result != NULL)) { // already there
       *found = 1;
-      *result = child_result;
+      *result = state->results[i];
     }
+    else {
+      if(state->results[i].doc_id == doc_id) *found = 1;
+      wp_search_result_free(&state->results[i]);
+    }
+    state->pending[state->num_pending++] = i;
+  }
 
-    i += 1;
-    // TODO XXXXXXXXXX does this leak memory when multiple children all return results?
+  uint16_t num_pending = 0;
+  for(uint16_t k = 0; k < state->num_pending; k++) {
+    uint16_t i = state->pending[k];
+    search_result child_result;
+    int child_found, child_done;
+    RELAY_ERROR(query_advance_to_doc(state->children[i], seg, doc_id, result == NULL ? NULL : &child_result, &child_found, &child_done));
+    DEBUG("child %u reports found %d and done %d", i, child_found, child_done);
+    if(child_found && !*found && (result != NULL)) *result = child_result;
+    else if(child_found && (result != NULL)) wp_search_result_free(&child_result);
+    if(child_found) *found = 1;
+    if(child_found || !child_done) state->pending[num_pending++] = i;
   }
+  state->num_pending = num_pending;
+
+  *done = (state->heap_size == 0) && (state->num_pending == 0);
 
 #ifdef DEBUGOUTPUT
   if(*found) DEBUG("successfully found doc %u", doc_id);
   else DEBUG("did not find doc %u", doc_id);
 #endif
 
-  // now release any buffered results if they're > doc_id
+  return NO_ERROR;
+}
+
+// a union of the children's blocks: the child with the largest next docid is
+// on top of the heap, and every child that has that doc moves past it.
+static wp_error* disj_next_block(wp_query* q, wp_segment* seg, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) {
   disj_search_state* state = (disj_search_state*)q->search_data;
-  if(state->states != NULL) {
-    uint16_t i = 0;
-    for(wp_query* child = q->children; child != NULL; child = child->next) {
-      if((state->states[i] == DISJ_SEARCH_STATE_FILLED) && (state->results[i].doc_id > doc_id)) {
-        wp_search_result_free(&state->results[i]);
-        state->states[i] = DISJ_SEARCH_STATE_EMPTY;
+  int more = 0;
+
+  // start every child's block off. those still pending are the ones that
+  // can match anything. those in the heap have already been read a result
+  // ahead (if someone called next_doc on us first, e.g. a negation getting
+  // started), and that result's doc becomes the start of their block.
+  if(state->blocks == NULL) {
+    state->blocks = malloc(sizeof(docid_block) * (q->num_children > 0 ? q->num_children : 1));
+    for(uint16_t k = 0; k < state->heap_size; k++) {
+      uint16_t i = state->heap[k];
+      state->blocks[i].docids[0] = state->results[i].doc_id;
+      state->blocks[i].size = 1;
+      state->blocks[i].pos = 0;
+      state->blocks[i].done = 0;
+      wp_search_result_free(&state->results[i]);
+    }
+    for(uint16_t k = 0; k < state->num_pending; k++) {
+      uint16_t i = state->pending[k];
+      RELAY_ERROR(docid_block_start(state->children[i], seg, &state->blocks[i], &more));
+      if(more) {
+        state->heads[i] = state->blocks[i].docids[0];
+        disj_heap_push(state, i);
+      }
+    }
+    state->num_pending = 0;
+  }
+
+  *num_docids = 0;
+  while((*num_docids < max_num_docids) && (state->heap_size > 0)) {
+    docid_t doc_id = state->heads[state->heap[0]];
+    docids[(*num_docids)++] = doc_id;
+    while((state->heap_size > 0) && (state->heads[state->heap[0]] == doc_id)) {
+      uint16_t i = disj_heap_pop(state);
+      RELAY_ERROR(docid_block_next(state->children[i], seg, &state->blocks[i], &more));
+      if(more) {
+        state->heads[i] = state->blocks[i].docids[state->blocks[i].pos];
+        disj_heap_push(state, i);
       }
-      i++;
     }
   }
+  *done = state->heap_size == 0;
 
   return NO_ERROR;
 }
@@ -563,9 +1023,9 @@ static wp_error* phrase_next_doc(wp_query* q, wp_segment* seg, search_result* re
   int found = 0;
   *done = 0;
 
-  // start with the first child's first doc
-  // TODO: find smallest postings list and use that instead
-  wp_query* master = q->children;
+  // walk the rarest child's docs
+  conj_search_state* state = (conj_search_state*)q->search_data;
+  wp_query* master = state->empty ? NULL : state->children[0];
   if(master == NULL) *done = 1;
 
   while(!found && !*done) {
@@ -575,6 +1035,7 @@ static wp_error* phrase_next_doc(wp_query* q, wp_segment* seg, search_result* re
       search_doc = result->doc_id;
       wp_search_result_free(result); // sigh
       RELAY_ERROR(phrase_advance_to_doc(q, seg, search_doc, result, &found, done));
+      if(found) *done = 0; // a child may have nothing after this doc, but this doc counts
     }
     DEBUG("after search, found is %d and done is %d", found, *done);
   }
@@ -589,6 +1050,12 @@ static wp_error* phrase_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc
   DEBUG("called on %s", query_s);
 #endif
 
+  if(((conj_search_state*)q->search_data)->empty) {
+    *found = 0;
+    *done = 1;
+    return NO_ERROR;
+  }
+
   search_result* child_results = malloc(sizeof(search_result) * q->num_children);
 
   DEBUG("will be searching for doc %u", doc_id);
@@ -615,6 +1082,17 @@ static wp_error* phrase_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc
     // we'll base everything off of this guy
     doc_match* first_dm = &child_results[0].doc_matches[0];
 
+    // terms from fields indexed without positions can't match phrases
+    for(int i = 0; i < q->num_children; i++) {
+      if(child_results[i].doc_matches[0].positions == NULL) {
+        DEBUG("term %d has no positions; can't match a phrase", i);
+        for(int j = 0; j < q->num_children; j++) wp_search_result_free(&child_results[j]);
+        free(child_results);
+        *found = 0;
+        return NO_ERROR;
+      }
+    }
+
     // allocate enough space to hold the maximum number of positions
     pos_t* phrase_positions = malloc(sizeof(pos_t) * first_dm->num_positions);
     int num_positions_found = 0;
@@ -648,7 +1126,8 @@ static wp_error* phrase_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc
       if(found_in_this_position) phrase_positions[num_positions_found++] = position; // got a match!
     }
 
-    if(num_positions_found > 0) {
+    if((num_positions_found > 0) && (result == NULL)) free(phrase_positions);
+    else if(num_positions_found > 0) {
       // fill in the result
       result->doc_id = doc_id;
       result->num_doc_matches = 1;
@@ -669,6 +1148,23 @@ static wp_error* phrase_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc
   return NO_ERROR;
 }
 
+// phrases need their children's positions, so there's nothing to be gained
+// by reading them a block at a time
+static wp_error* phrase_next_block(wp_query* q, wp_segment* seg, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) {
+  *num_docids = 0;
+  *done = 0;
+  while((*num_docids < max_num_docids) && !*done) {
+    search_result result;
+    RELAY_ERROR(phrase_next_doc(q, seg, &result, done));
+    if(!*done) {
+      docids[(*num_docids)++] = result.doc_id;
+      wp_search_result_free(&result);
+    }
+  }
+
+  return NO_ERROR;
+}
+
 static wp_error* neg_next_doc(wp_query* q, wp_segment* seg, search_result* result, int* done) {
   neg_search_state* state = (neg_search_state*)q->search_data;
 
@@ -724,10 +1220,14 @@ static wp_error* neg_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc_id
 
   // seek through child stream until we find a docid it contains that's <= doc_id
   while(state->next > doc_id) { // need to advance child stream
+    search_result child_result;
     int child_done;
-    RELAY_ERROR(query_next_doc(q->children, seg, result, &child_done));
+    RELAY_ERROR(query_next_doc(q->children, seg, &child_result, &child_done));
     if(child_done) state->next = DOCID_NONE; // will break the loop too
-    else state->next = result->doc_id;
+    else {
+      state->next = child_result.doc_id;
+      wp_search_result_free(&child_result);
+    }
   }
 
   DEBUG("in search for %u, intermediate state is cur %u and next %u", doc_id, state->cur, state->next);
@@ -737,9 +1237,11 @@ static wp_error* neg_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc_id
   if(state->next == doc_id) *found = 0; // opposite day
   else {
     *found = 1;
-    result->doc_id = doc_id;
-    result->num_doc_matches = 0;
-    result->doc_matches = NULL;
+    if(result != NULL) {
+      result->doc_id = doc_id;
+      result->num_doc_matches = 0;
+      result->doc_matches = NULL;
+    }
   }
 
   *done = state->cur == DOCID_NONE ? 1 : 0;
@@ -773,21 +1275,63 @@ static wp_error* every_advance_to_doc(wp_query* q, wp_segment* seg, docid_t doc_
 
   DEBUG("called with cur %u", *state_doc_id);
 
-  if(*state_doc_id == DOCID_NONE) {
+  // we're done once we're past doc 1, but we can still be asked for doc 1
+  // itself (e.g. right after next() returned it)
+  if(doc_id == DOCID_NONE) {
     *found = 0;
   }
   else {
     *state_doc_id = doc_id - 1; // just after that doc
     *found = 1; // we find everyhing
-    result->doc_id = doc_id;
-    result->num_doc_matches = 0;
-    result->doc_matches = NULL;
+    if(result != NULL) {
+      result->doc_id = doc_id;
+      result->num_doc_matches = 0;
+      result->doc_matches = NULL;
+    }
   }
 
   *done = (*state_doc_id == DOCID_NONE ? 1 : 0);
   return NO_ERROR;
 }
 
+// every doc below cur that isn't in the child's stream. the child is read a
+// block at a time.
+static wp_error* neg_next_block(wp_query* q, wp_segment* seg, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) {
+  neg_search_state* state = (neg_search_state*)q->search_data;
+  int more = 0;
+
+  if(state->block == NULL) { // state->next is the child's current doc, as if at the end of a block
+    state->block = malloc(sizeof(docid_block));
+    state->block->size = 1;
+    state->block->pos = 0;
+    state->block->done = state->next == DOCID_NONE;
+  }
+
+  *num_docids = 0;
+  while((*num_docids < max_num_docids) && (state->cur > DOCID_NONE)) {
+    state->cur--;
+    while((state->cur > DOCID_NONE) && (state->next > state->cur)) {
+      RELAY_ERROR(docid_block_next(q->children, seg, state->block, &more));
+      state->next = more ? state->block->docids[state->block->pos] : DOCID_NONE;
+    }
+    if((state->cur > DOCID_NONE) && (state->cur != state->next)) docids[(*num_docids)++] = state->cur;
+  }
+  *done = state->cur == DOCID_NONE;
+
+  return NO_ERROR;
+}
+
+static wp_error* every_next_block(wp_query* q, wp_segment* seg, uint32_t max_num_docids, docid_t* docids, uint32_t* num_docids, int* done) {
+  (void)seg;
+  docid_t* state_doc_id = (docid_t*)q->search_data;
+
+  *num_docids = 0;
+  while((*num_docids < max_num_docids) && (*state_doc_id != DOCID_NONE)) docids[(*num_docids)++] = (*state_doc_id)--;
+  *done = *state_doc_id == DOCID_NONE;
+
+  return NO_ERROR;
+}
+
 wp_error* wp_search_run_query_on_segment(struct wp_query* q, struct wp_segment* s, uint32_t max_num_results, uint32_t* num_results, search_result* results) {
   int done;
   *num_results = 0;
@@ -802,6 +1346,10 @@ wp_error* wp_search_run_query_on_segment(struct wp_query* q, struct wp_segment*
     DEBUG("got %d results so far (max is %d)", *num_results, max_num_results);
     RELAY_ERROR(query_next_doc(q, s, &results[*num_results], &done));
     if(done) break;
+    if(wp_segment_is_deleted(s, results[*num_results].doc_id)) {
+      wp_search_result_free(&results[*num_results]);
+      continue;
+    }
     DEBUG("got result %u (%u doc matches)", results[*num_results].doc_id, results[*num_results].num_doc_matches);
     (*num_results)++;
     DEBUG("num results now %d", *num_results);
@@ -810,3 +1358,18 @@ wp_error* wp_search_run_query_on_segment(struct wp_query* q, struct wp_segment*
   return NO_ERROR;
 }
 
+
+wp_error* wp_search_run_query_on_segment_docids(struct wp_query* q, struct wp_segment* s, uint32_t max_num_results, uint32_t* num_results, docid_t* results) {
+  int done = 0;
+  *num_results = 0;
+
+  while((*num_results < max_num_results) && !done) {
+    uint32_t start = *num_results, num_docids;
+    RELAY_ERROR(query_next_block(q, s, max_num_results - start, &results[start], &num_docids, &done));
+    for(uint32_t i = start; i < start + num_docids; i++) {
+      if(!wp_segment_is_deleted(s, results[i])) results[(*num_results)++] = results[i];
+    }
+  }
+
+  return NO_ERROR;
+}
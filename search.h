@@ -32,6 +32,10 @@
 #include "query.h"
 #include "error.h"
 
+// how many docids operators read from their children at a time, when only
+// docids are wanted
+#define SEARCH_BLOCK_SIZE 128
+
 // a match of a particular fielded phrase on a particular document
 typedef struct doc_match {
   const char* field;
@@ -57,10 +61,17 @@ struct wp_error;
 // to wp_search_run_query_on_segment.
 wp_error* wp_search_init_search_state(struct wp_query* q, struct wp_segment* s) RAISES_ERROR;
 
+// ask for term positions in the results of a query whose search state has
+// been initialized. by default, positions are only decoded where the query
+// itself needs them (i.e. for phrases), and term matches in results have no
+// positions.
+wp_error* wp_search_request_positions(struct wp_query* q) RAISES_ERROR;
+
 // release any query search state. this must follow any call to wp_search_run_query_on_segment.
 wp_error* wp_search_release_search_state(struct wp_query* q) RAISES_ERROR;
 
 // run a query on a segment, filling at most max_num_results slots in results.
+// deleted documents are never returned.
 // this is the main entry point into the actual search logic, and is called by
 // index.c in various ways. this must be preceded by an init_search_state and
 // followed by a release_search_state.
@@ -69,6 +80,11 @@ wp_error* wp_search_release_search_state(struct wp_query* q) RAISES_ERROR;
 // results when you're done with them.
 wp_error* wp_search_run_query_on_segment(struct wp_query* q, struct wp_segment* s, uint32_t max_num_results, uint32_t* num_results, search_result* results) RAISES_ERROR;
 
+// like wp_search_run_query_on_segment, but only fills in docids, which lets
+// the search run a block of docs at a time without building any results.
+// don't mix the two on the same search state.
+wp_error* wp_search_run_query_on_segment_docids(struct wp_query* q, struct wp_segment* s, uint32_t max_num_results, uint32_t* num_results, docid_t* results) RAISES_ERROR;
+
 // if you got non-zero num_results from wp_search_run_query_on_segment, call
 // this on each result when you're done with it.
 void wp_search_result_free(search_result* result);
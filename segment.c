@@ -1,17 +1,27 @@
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "whistlepig.h"
 
 #define POSTINGS_REGION_TYPE_IMMUTABLE_VBE 1
-#define POSTINGS_REGION_TYPE_MUTABLE_NO_POSITIONS 2 // bigger, mutable
+#define POSTINGS_REGION_TYPE_MUTABLE_NO_POSITIONS 2 // linked-list labels; no longer used
+#define POSTINGS_REGION_TYPE_SEALED_VBE 3 // smaller, read-only. see wp_segment_seal()
+#define POSTINGS_REGION_TYPE_POSITIONS_VBE 4 // positions only
+#define POSTINGS_REGION_TYPE_LABEL_BITMAPS 5 // label bitmaps; see wp_segment_add_label()
 
-#define SEGMENT_VERSION 4
+#define SEGMENT_VERSION 18
 
-#define wp_segment_label_posting_at(posting_region, offset) ((label_posting*)(posting_region->postings + offset))
 
-static posting_list_header blank_plh = { .count = 0, .next_offset = OFFSET_NONE };
-static term dead_term = { .field_s = 0, .word_s = 0 };
+static posting_list_header blank_plh = { .count = 0, .next_offset = OFFSET_NONE, .skip_offset = OFFSET_NONE, .chunk_head = OFFSET_NONE, .chunk_tail = OFFSET_NONE };
+
+static void label_blocks_reclaim(postings_region* pr);
 
 wp_error* wp_segment_grab_readlock(wp_segment* seg) {
   segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
@@ -19,9 +29,19 @@ wp_error* wp_segment_grab_readlock(wp_segment* seg) {
   return NO_ERROR;
 }
 
+// with the write lock, no search can be reading the label blocks in the
+// pending log, so we free them
 wp_error* wp_segment_grab_writelock(wp_segment* seg) {
   segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
   RELAY_ERROR(wp_lock_grab(&si->lock, WP_LOCK_WRITELOCK));
+
+  wp_error* e = mmap_obj_reload(&seg->labels);
+  if(e != NO_ERROR) {
+    RELAY_ERROR(wp_lock_release(&si->lock));
+    RELAY_ERROR(e);
+  }
+  label_blocks_reclaim(MMAP_OBJ(seg->labels, postings_region));
+
   return NO_ERROR;
 }
 
@@ -48,18 +68,25 @@ wp_error* wp_segment_count_term(wp_segment* seg, const char* field, const char*
   return NO_ERROR;
 }
 
-static void postings_region_init(postings_region* pr, uint32_t initial_size, uint32_t postings_type_and_flags) {
+static void postings_region_init(postings_region* pr, offset_t initial_size, uint32_t postings_type_and_flags) {
   pr->postings_type_and_flags = postings_type_and_flags;
   pr->num_postings = 0;
   pr->postings_head = 1; // skip one byte, which is reserved as OFFSET_NONE
   pr->postings_tail = initial_size;
 }
 
+static void labels_region_init(postings_region* pr);
+static wp_error* recover_seal(wp_segment* seg) RAISES_ERROR;
+
 RAISING_STATIC(segment_info_init(segment_info* si, uint32_t segment_version)) {
   si->segment_version = segment_version;
   si->num_docs = 0;
+  si->generation = 0;
+  si->seal_committed = 0;
+  si->num_field_options = 0;
 
   RELAY_ERROR(wp_lock_setup(&si->lock));
+  RELAY_ERROR(wp_lock_setup(&si->label_lock));
   return NO_ERROR;
 }
 
@@ -74,8 +101,31 @@ RAISING_STATIC(postings_region_validate(postings_region* pr, uint32_t postings_t
 }
 
 #define INITIAL_POSTINGS_SIZE 2048
+#define INITIAL_DOC_LABELS_SLOTS 256
+#define INITIAL_TOMBSTONE_SLOTS 1024
 #define FN_SIZE 1024
 
+// the postings and positions regions are rewritten when the segment is
+// sealed, and the postings region is the only one that changes type over the
+// life of a segment, so we accept either
+RAISING_STATIC(load_postings_regions(wp_segment* segment)) {
+  char fn[FN_SIZE];
+  segment_info* si = MMAP_OBJ(segment->seginfo, segment_info);
+
+  snprintf(fn, 128, "%s." WP_SEGMENT_POSTING_REGION_PATH_SUFFIX, segment->pathname_base);
+  RELAY_ERROR(mmap_obj_load(&segment->postings, "wp/postings", fn));
+  postings_region* pr = MMAP_OBJ(segment->postings, postings_region);
+  if(pr->postings_type_and_flags != POSTINGS_REGION_TYPE_SEALED_VBE) RELAY_ERROR(postings_region_validate(pr, POSTINGS_REGION_TYPE_IMMUTABLE_VBE));
+
+  snprintf(fn, 128, "%s." WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX, segment->pathname_base);
+  RELAY_ERROR(mmap_obj_load(&segment->positions, "wp/positions", fn));
+  RELAY_ERROR(postings_region_validate(MMAP_OBJ(segment->positions, postings_region), POSTINGS_REGION_TYPE_POSITIONS_VBE));
+
+  segment->generation = si->generation;
+
+  return NO_ERROR;
+}
+
 wp_error* wp_segment_load(wp_segment* segment, const char* pathname_base) {
   char fn[FN_SIZE];
 
@@ -83,6 +133,8 @@ wp_error* wp_segment_load(wp_segment* segment, const char* pathname_base) {
   snprintf(fn, 128, "%s.si", pathname_base);
   RELAY_ERROR(mmap_obj_load(&segment->seginfo, "wp/seginfo", fn));
   RELAY_ERROR(segment_info_validate(MMAP_OBJ(segment->seginfo, segment_info), SEGMENT_VERSION));
+  segment->pathname_base = strdup(pathname_base);
+  segment->shared_labels = 0;
 
   // open the string pool
   snprintf(fn, 128, "%s.sp", pathname_base);
@@ -96,15 +148,24 @@ wp_error* wp_segment_load(wp_segment* segment, const char* pathname_base) {
   snprintf(fn, 128, "%s.th", pathname_base);
   RELAY_ERROR(mmap_obj_load(&segment->termhash, "wp/termhash", fn));
 
-  // open the postings region
-  snprintf(fn, 128, "%s." WP_SEGMENT_POSTING_REGION_PATH_SUFFIX, pathname_base);
-  RELAY_ERROR(mmap_obj_load(&segment->postings, "wp/postings", fn));
-  RELAY_ERROR(postings_region_validate(MMAP_OBJ(segment->postings, postings_region), POSTINGS_REGION_TYPE_IMMUTABLE_VBE));
-
   // open the labels postings region
   snprintf(fn, 128, "%s.lb", pathname_base);
   RELAY_ERROR(mmap_obj_load(&segment->labels, "wp/labels", fn));
-  RELAY_ERROR(postings_region_validate(MMAP_OBJ(segment->labels, postings_region), POSTINGS_REGION_TYPE_MUTABLE_NO_POSITIONS));
+  RELAY_ERROR(postings_region_validate(MMAP_OBJ(segment->labels, postings_region), POSTINGS_REGION_TYPE_LABEL_BITMAPS));
+
+  // open the postings and positions regions, once any seal we died in the
+  // middle of has been dealt with. that takes the write lock, which needs the
+  // labels region.
+  RELAY_ERROR(recover_seal(segment));
+  RELAY_ERROR(load_postings_regions(segment));
+
+  // open the forward label store
+  snprintf(fn, 128, "%s." WP_SEGMENT_DOC_LABELS_PATH_SUFFIX, pathname_base);
+  RELAY_ERROR(mmap_obj_load(&segment->doc_labels, "wp/doclabels", fn));
+
+  // open the tombstones
+  snprintf(fn, 128, "%s." WP_SEGMENT_TOMBSTONES_PATH_SUFFIX, pathname_base);
+  RELAY_ERROR(mmap_obj_load(&segment->tombstones, "wp/tombstones", fn));
 
   return NO_ERROR;
 }
@@ -114,8 +175,23 @@ wp_error* wp_segment_reload(wp_segment* segment) {
   RELAY_ERROR(mmap_obj_reload(&segment->stringpool));
   RELAY_ERROR(mmap_obj_reload(&segment->stringmap));
   RELAY_ERROR(mmap_obj_reload(&segment->termhash));
-  RELAY_ERROR(mmap_obj_reload(&segment->postings));
+
+  // if someone else has rewritten the postings regions, the files we have
+  // open are no longer the right ones
+  segment_info* si = MMAP_OBJ(segment->seginfo, segment_info);
+  if(si->generation != segment->generation) {
+    DEBUG("postings region generation changed from %u to %u; reopening", segment->generation, si->generation);
+    RELAY_ERROR(mmap_obj_unload(&segment->postings));
+    RELAY_ERROR(mmap_obj_unload(&segment->positions));
+    RELAY_ERROR(load_postings_regions(segment));
+  }
+  else {
+    RELAY_ERROR(mmap_obj_reload(&segment->postings));
+    RELAY_ERROR(mmap_obj_reload(&segment->positions));
+  }
   RELAY_ERROR(mmap_obj_reload(&segment->labels));
+  RELAY_ERROR(mmap_obj_reload(&segment->doc_labels));
+  RELAY_ERROR(mmap_obj_reload(&segment->tombstones));
 
   return NO_ERROR;
 }
@@ -127,6 +203,9 @@ wp_error* wp_segment_create(wp_segment* segment, const char* pathname_base) {
   snprintf(fn, 128, "%s.si", pathname_base);
   RELAY_ERROR(mmap_obj_create(&segment->seginfo, "wp/seginfo", fn, sizeof(segment_info)));
   RELAY_ERROR(segment_info_init(MMAP_OBJ(segment->seginfo, segment_info), SEGMENT_VERSION));
+  segment->pathname_base = strdup(pathname_base);
+  segment->generation = 0;
+  segment->shared_labels = 0;
 
   // create the string pool
   snprintf(fn, 128, "%s.sp", pathname_base);
@@ -148,10 +227,31 @@ wp_error* wp_segment_create(wp_segment* segment, const char* pathname_base) {
   RELAY_ERROR(mmap_obj_create(&segment->postings, "wp/postings", fn, sizeof(postings_region) + INITIAL_POSTINGS_SIZE));
   postings_region_init(MMAP_OBJ(segment->postings, postings_region), INITIAL_POSTINGS_SIZE, POSTINGS_REGION_TYPE_IMMUTABLE_VBE);
 
+  // create the positions region
+  snprintf(fn, 128, "%s." WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX, pathname_base);
+  RELAY_ERROR(mmap_obj_create(&segment->positions, "wp/positions", fn, sizeof(postings_region) + INITIAL_POSTINGS_SIZE));
+  postings_region_init(MMAP_OBJ(segment->positions, postings_region), INITIAL_POSTINGS_SIZE, POSTINGS_REGION_TYPE_POSITIONS_VBE);
+
   // create the labels postings region
   snprintf(fn, 128, "%s.lb", pathname_base);
   RELAY_ERROR(mmap_obj_create(&segment->labels, "wp/labels", fn, sizeof(postings_region) + INITIAL_POSTINGS_SIZE));
-  postings_region_init(MMAP_OBJ(segment->labels, postings_region), INITIAL_POSTINGS_SIZE, POSTINGS_REGION_TYPE_MUTABLE_NO_POSITIONS);
+  postings_region_init(MMAP_OBJ(segment->labels, postings_region), INITIAL_POSTINGS_SIZE, POSTINGS_REGION_TYPE_LABEL_BITMAPS);
+  labels_region_init(MMAP_OBJ(segment->labels, postings_region));
+
+  // create the forward label store
+  snprintf(fn, 128, "%s." WP_SEGMENT_DOC_LABELS_PATH_SUFFIX, pathname_base);
+  RELAY_ERROR(mmap_obj_create(&segment->doc_labels, "wp/doclabels", fn, sizeof(doc_labels) + INITIAL_DOC_LABELS_SLOTS * sizeof(offset_t)));
+  doc_labels* dl = MMAP_OBJ(segment->doc_labels, doc_labels);
+  dl->num_slots = INITIAL_DOC_LABELS_SLOTS;
+  for(uint32_t i = 0; i < dl->num_slots; i++) dl->offsets[i] = OFFSET_NONE;
+
+  // create the tombstones
+  snprintf(fn, 128, "%s." WP_SEGMENT_TOMBSTONES_PATH_SUFFIX, pathname_base);
+  RELAY_ERROR(mmap_obj_create(&segment->tombstones, "wp/tombstones", fn, sizeof(tombstones) + INITIAL_TOMBSTONE_SLOTS / 8));
+  tombstones* ts = MMAP_OBJ(segment->tombstones, tombstones);
+  ts->num_slots = INITIAL_TOMBSTONE_SLOTS;
+  ts->num_deleted = 0;
+  memset(ts->bits, 0, INITIAL_TOMBSTONE_SLOTS / 8);
 
   return NO_ERROR;
 }
@@ -171,6 +271,12 @@ wp_error* wp_segment_delete(const char* pathname_base) {
   unlink(fn);
   snprintf(fn, 128, "%s." WP_SEGMENT_POSTING_REGION_PATH_SUFFIX, pathname_base);
   unlink(fn);
+  snprintf(fn, 128, "%s." WP_SEGMENT_POSTING_REGION_PATH_SUFFIX ".sealing", pathname_base);
+  unlink(fn);
+  snprintf(fn, 128, "%s." WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX, pathname_base);
+  unlink(fn);
+  snprintf(fn, 128, "%s." WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX ".sealing", pathname_base);
+  unlink(fn);
   snprintf(fn, 128, "%s.sp", pathname_base);
   unlink(fn);
   snprintf(fn, 128, "%s.sh", pathname_base);
@@ -179,6 +285,12 @@ wp_error* wp_segment_delete(const char* pathname_base) {
   unlink(fn);
   snprintf(fn, 128, "%s.lb", pathname_base);
   unlink(fn);
+  snprintf(fn, 128, "%s." WP_SEGMENT_DOC_LABELS_PATH_SUFFIX, pathname_base);
+  unlink(fn);
+  snprintf(fn, 128, "%s." WP_SEGMENT_TOMBSTONES_PATH_SUFFIX, pathname_base);
+  unlink(fn);
+  snprintf(fn, 128, "%s." WP_SEGMENT_SEALED_VALS_PATH_SUFFIX ".sealing", pathname_base);
+  unlink(fn);
 
   return NO_ERROR;
 }
@@ -188,82 +300,93 @@ wp_error* wp_segment_unload(wp_segment* s) {
   RELAY_ERROR(mmap_obj_unload(&s->stringmap));
   RELAY_ERROR(mmap_obj_unload(&s->termhash));
   RELAY_ERROR(mmap_obj_unload(&s->postings));
+  RELAY_ERROR(mmap_obj_unload(&s->positions));
   RELAY_ERROR(mmap_obj_unload(&s->labels));
+  RELAY_ERROR(mmap_obj_unload(&s->doc_labels));
+  RELAY_ERROR(mmap_obj_unload(&s->tombstones));
+  free(s->pathname_base);
+  s->pathname_base = NULL;
   return NO_ERROR;
 }
 
-RAISING_STATIC(bump_stringmap(wp_segment* s, int* success)) {
+// the bump_* functions make sure there's room for num_new more entries (or
+// bytes, for the stringpool), growing things as necessary. they set success
+// to 0 if things can't grow any further.
+RAISING_STATIC(bump_stringmap(wp_segment* s, uint32_t num_new, int* success)) {
   stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
 
   *success = 1;
-  if(stringmap_needs_bump(sh)) {
+  while(stringmap_needs_bump(sh) || (sh->n_occupied + num_new > sh->upper_bound)) {
     DEBUG("bumping stringmap size");
     uint32_t next_size = stringmap_next_size(sh);
     if(next_size <= stringmap_size(sh)) {
       DEBUG("stringmap can't be bumped no more!");
       *success = 0;
+      break;
     }
-    else {
-      RELAY_ERROR(mmap_obj_resize(&s->stringmap, next_size));
-      RELAY_ERROR(stringmap_bump_size(MMAP_OBJ(s->stringmap, stringmap), MMAP_OBJ(s->stringpool, stringpool)));
-    }
+    RELAY_ERROR(mmap_obj_resize(&s->stringmap, next_size));
+    sh = MMAP_OBJ(s->stringmap, stringmap);
+    RELAY_ERROR(stringmap_bump_size(sh, MMAP_OBJ(s->stringpool, stringpool)));
   }
 
   return NO_ERROR;
 }
 
-RAISING_STATIC(bump_stringpool(wp_segment* s, int* success)) {
+RAISING_STATIC(bump_stringpool(wp_segment* s, uint32_t num_new, int* success)) {
   stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
 
   *success = 1;
-  if(stringpool_needs_bump(sp)) {
+  while(stringpool_needs_bump(sp) || (sp->next + num_new >= sp->size)) {
     DEBUG("bumping stringpool size");
     uint32_t next_size = stringpool_next_size(sp);
     if(next_size <= stringpool_size(sp)) {
       DEBUG("stringpool can't be bumped no more!");
       *success = 0;
+      break;
     }
-    else {
-      RELAY_ERROR(mmap_obj_resize(&s->stringpool, next_size));
-      stringpool_bump_size(MMAP_OBJ(s->stringpool, stringpool));
-    }
+    RELAY_ERROR(mmap_obj_resize(&s->stringpool, next_size));
+    sp = MMAP_OBJ(s->stringpool, stringpool);
+    stringpool_bump_size(sp);
   }
 
   return NO_ERROR;
 }
 
-RAISING_STATIC(bump_termhash(wp_segment* s, int* success)) {
+RAISING_STATIC(bump_termhash(wp_segment* s, uint32_t num_new, int* success)) {
   termhash* th = MMAP_OBJ(s->termhash, termhash);
 
   *success = 1;
-  if(termhash_needs_bump(th)) {
+  while(termhash_needs_bump(th) || (th->n_occupied + num_new > th->upper_bound)) {
     DEBUG("bumping termhash size");
     uint32_t next_size = termhash_next_size(th);
     if(next_size <= termhash_size(th)) {
       DEBUG("termhash can't be bumped no more!");
       *success = 0;
+      break;
     }
-    else {
-      RELAY_ERROR(mmap_obj_resize(&s->termhash, next_size));
-      RELAY_ERROR(termhash_bump_size(MMAP_OBJ(s->termhash, termhash)));
-      *success = 1;
-    }
+    RELAY_ERROR(mmap_obj_resize(&s->termhash, next_size));
+    th = MMAP_OBJ(s->termhash, termhash);
+    RELAY_ERROR(termhash_bump_size(th));
   }
 
   return NO_ERROR;
 }
 
-RAISING_STATIC(postings_region_ensure_fit(mmap_obj* mmopr, uint32_t postings_bytes, int* success)) {
+// the most we'll let a region's tail get to, so that the whole file, headers
+// included, stays within MAX_POSTINGS_REGION_SIZE
+#define MAX_POSTINGS_REGION_TAIL (MAX_POSTINGS_REGION_SIZE - sizeof(mmap_obj_header) - sizeof(postings_region))
+
+RAISING_STATIC(postings_region_ensure_fit(mmap_obj* mmopr, offset_t postings_bytes, int* success)) {
   postings_region* pr = MMAP_OBJ_PTR(mmopr, postings_region);
-  uint32_t new_head = pr->postings_head + postings_bytes;
+  offset_t new_head = pr->postings_head + postings_bytes;
 
-  DEBUG("ensuring fit for %u postings bytes", postings_bytes);
+  DEBUG("ensuring fit for %" PRIu64 " postings bytes", postings_bytes);
 
-  uint32_t new_tail = pr->postings_tail;
+  offset_t new_tail = pr->postings_tail;
   while(new_tail <= new_head) new_tail = new_tail * 2;
 
-  if(new_tail > MAX_POSTINGS_REGION_SIZE - sizeof(mmap_obj_header)) new_tail = MAX_POSTINGS_REGION_SIZE - sizeof(mmap_obj_header);
-  DEBUG("new tail will be %u, current is %u, max is %u", new_tail, pr->postings_tail, MAX_POSTINGS_REGION_SIZE);
+  if(new_tail > MAX_POSTINGS_REGION_TAIL) new_tail = MAX_POSTINGS_REGION_TAIL;
+  DEBUG("new tail will be %" PRIu64 ", current is %" PRIu64 ", max is %" PRIu64, new_tail, pr->postings_tail, MAX_POSTINGS_REGION_TAIL);
 
   if(new_tail <= new_head) { // can't increase enough
     *success = 0;
@@ -271,8 +394,8 @@ RAISING_STATIC(postings_region_ensure_fit(mmap_obj* mmopr, uint32_t postings_byt
   }
 
   if(new_tail != pr->postings_tail) { // need to resize
-    DEBUG("request for %u postings bytes, old tail is %u, new tail will be %u, max is %u\n", postings_bytes, pr->postings_tail, new_tail, MAX_POSTINGS_REGION_SIZE);
-    RELAY_ERROR(mmap_obj_resize(mmopr, new_tail));
+    DEBUG("request for %" PRIu64 " postings bytes, old tail is %" PRIu64 ", new tail will be %" PRIu64, postings_bytes, pr->postings_tail, new_tail);
+    RELAY_ERROR(mmap_obj_resize(mmopr, sizeof(postings_region) + new_tail));
     pr = MMAP_OBJ_PTR(mmopr, postings_region); // may have changed!
     pr->postings_tail = new_tail;
   }
@@ -281,46 +404,151 @@ RAISING_STATIC(postings_region_ensure_fit(mmap_obj* mmopr, uint32_t postings_byt
   return NO_ERROR;
 }
 
-// TODO make this function take the number of stringpool entries, the number of
-// terms, etc rather than just being a heuristic for everything except for the
-// postings list
-wp_error* wp_segment_ensure_fit(wp_segment* seg, uint32_t postings_bytes, uint32_t label_bytes, int* success) {
-  RELAY_ERROR(postings_region_ensure_fit(&seg->postings, postings_bytes, success));
+wp_error* wp_segment_ensure_fit(wp_segment* seg, segment_growth* growth, int* success) {
+  RELAY_ERROR(postings_region_ensure_fit(&seg->postings, growth->postings_bytes, success));
+  if(!*success) return NO_ERROR;
+
+  RELAY_ERROR(postings_region_ensure_fit(&seg->positions, growth->positions_bytes, success));
   if(!*success) return NO_ERROR;
 
-  RELAY_ERROR(postings_region_ensure_fit(&seg->labels, label_bytes, success));
+  RELAY_ERROR(postings_region_ensure_fit(&seg->labels, growth->label_bytes, success));
   if(!*success) return NO_ERROR;
 
-  RELAY_ERROR(bump_stringmap(seg, success));
+  RELAY_ERROR(bump_stringmap(seg, growth->num_strings, success));
   if(!*success) return NO_ERROR;
 
-  RELAY_ERROR(bump_stringpool(seg, success));
+  RELAY_ERROR(bump_stringpool(seg, growth->string_bytes, success));
   if(!*success) return NO_ERROR;
 
-  RELAY_ERROR(bump_termhash(seg, success));
+  RELAY_ERROR(bump_termhash(seg, growth->num_terms, success));
   if(!*success) return NO_ERROR;
 
-  DEBUG("fit of %u postings bytes ensured", postings_bytes);
+  DEBUG("fit of %" PRIu64 " postings bytes and %" PRIu64 " positions bytes ensured", growth->postings_bytes, growth->positions_bytes);
 
   return NO_ERROR;
 }
 
-static uint32_t size_of(uint32_t num_positions, pos_t positions[]) {
-  (void)positions;
-  uint32_t position_size = (uint32_t)sizeof(pos_t) * num_positions;
-  uint32_t size = (uint32_t)sizeof(posting) - (uint32_t)sizeof(pos_t*) + position_size;
+// the most a single vbe-encoded value can take up. offsets are 64 bits and
+// take up to MAX_VBE64_SIZE; everything else is 32 bits.
+#define MAX_VBE_SIZE 5
+#define MAX_VBE64_SIZE 10
+
+static inline uint32_t sizeof_multibyte(uint64_t val) {
+  uint32_t size = 1;
+  while(val > 0x7f) {
+    val >>= 7;
+    size++;
+  }
+  return size;
+}
+
+// the most a posting in a live term's chunk can take up, plus a skip record
+// if it's due one
+static uint32_t posting_bytes(posting_list_header* plh) {
+  uint32_t bytes = 2 * MAX_VBE_SIZE + 2 * MAX_VBE64_SIZE;
+  if(((plh->count + 1) % POSTINGS_SKIP_INTERVAL) == 0) bytes += (uint32_t)sizeof(block_header);
+  return bytes;
+}
+
+// exactly what a posting will take up if it's written at offset, plus a skip
+// record if it's due one
+static uint32_t live_posting_bytes(wp_segment* seg, posting_list_header* plh, docid_t doc_id, offset_t offset, uint32_t num_positions, pos_t* positions) {
+  uint32_t bytes = sizeof_multibyte(doc_id) + sizeof_multibyte(offset - plh->next_offset);
+
+  if(plh->options == WP_FIELD_POSITIONS) {
+    uint32_t positions_size = 0;
+    for(uint32_t i = 0; i < num_positions; i++) positions_size += sizeof_multibyte(positions[i] - (i == 0 ? 0 : positions[i - 1]));
+    bytes += sizeof_multibyte(MMAP_OBJ(seg->positions, postings_region)->postings_head) + sizeof_multibyte(positions_size);
+  }
+  else if(plh->options == WP_FIELD_FREQS) bytes += sizeof_multibyte(num_positions);
+
+  if(((plh->count + 1) % POSTINGS_SKIP_INTERVAL) == 0) bytes += (uint32_t)sizeof(block_header);
+  return bytes;
+}
+
+// the size of the next chunk for a term, with room for at least bytes. a
+// term's first few postings get exactly the room they need.
+static uint32_t chunk_size(posting_list_header* plh, uint32_t bytes) {
+  if(plh->count < POSTINGS_UNCHUNKED) return bytes;
 
+  uint32_t size = POSTINGS_MIN_CHUNK_SIZE;
+  while((size < POSTINGS_MAX_CHUNK_SIZE) && (size < plh->count * 4)) size *= 2;
+  if(size < bytes) size = bytes;
   return size;
 }
 
-wp_error* wp_segment_sizeof_posarray(wp_segment* seg, uint32_t num_positions, pos_t* positions, uint32_t* size) {
-  (void)seg;
-  *size = size_of(num_positions, positions);
+static int chunk_has_room(posting_list_header* plh, uint32_t bytes) {
+  return (plh->chunk_head != OFFSET_NONE) && (plh->chunk_tail - plh->chunk_head >= bytes);
+}
+
+// this is exact, except that a new string that appears more than once
+// amongst the postings being added will be counted more than once, and that
+// we allow for the largest posting the term could get. options are what the
+// term gets if it's new.
+RAISING_STATIC(sizeof_posting(wp_segment* seg, const char* field, const char* word, uint32_t options, uint32_t num_positions, pos_t* positions, segment_growth* growth)) {
+  stringmap* sh = MMAP_OBJ(seg->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(seg->stringpool, stringpool);
+  termhash* th = MMAP_OBJ(seg->termhash, termhash);
+  posting_list_header* plh = NULL;
+
+  term t;
+  t.field_s = stringmap_string_to_int(sh, sp, field);
+  t.word_s = stringmap_string_to_int(sh, sp, word);
+
+  if(t.field_s == (uint32_t)-1) {
+    growth->num_strings++;
+    growth->string_bytes += (uint32_t)strlen(field) + 1;
+  }
+  if(t.word_s == (uint32_t)-1) {
+    growth->num_strings++;
+    growth->string_bytes += (uint32_t)strlen(word) + 1;
+  }
+  if((t.field_s != (uint32_t)-1) && (t.word_s != (uint32_t)-1)) plh = termhash_get_val(th, t);
+
+  posting_list_header new_plh;
+  if(plh == NULL) {
+    growth->num_terms++;
+    new_plh = blank_plh;
+    new_plh.options = (uint8_t)options;
+    plh = &new_plh;
+  }
+
+  uint32_t bytes = posting_bytes(plh);
+  if(!chunk_has_room(plh, bytes)) growth->postings_bytes += chunk_size(plh, bytes);
+
+  if(plh->options == WP_FIELD_POSITIONS) {
+    for(uint32_t i = 0; i < num_positions; i++) growth->positions_bytes += sizeof_multibyte(positions[i] - (i == 0 ? 0 : positions[i - 1]));
+  }
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_sizeof_posting(wp_segment* seg, const char* field, const char* word, uint32_t num_positions, pos_t* positions, segment_growth* growth) {
+  RELAY_ERROR(sizeof_posting(seg, field, word, wp_segment_field_options(seg, field), num_positions, positions, growth));
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_sizeof_key(wp_segment* seg, const char* key, segment_growth* growth) {
+  stringmap* sh = MMAP_OBJ(seg->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(seg->stringpool, stringpool);
+  termhash* th = MMAP_OBJ(seg->termhash, termhash);
+
+  term t;
+  t.field_s = WP_KEY_FIELD;
+  t.word_s = stringmap_string_to_int(sh, sp, key);
+
+  if(t.word_s == (uint32_t)-1) {
+    growth->num_strings++;
+    growth->string_bytes += (uint32_t)strlen(key) + 1;
+    growth->num_terms++;
+  }
+  else if(termhash_get_val(th, t) == NULL) growth->num_terms++;
+
   return NO_ERROR;
 }
 
 #define VALUE_BITMASK 0x7f
-RAISING_STATIC(write_multibyte(uint8_t* location, uint32_t val, uint32_t* size)) {
+RAISING_STATIC(write_multibyte(uint8_t* location, uint64_t val, uint32_t* size)) {
   //printf("xx writing %u to position %p as:\n", val, location);
   uint8_t* start = location;
 
@@ -339,21 +567,150 @@ RAISING_STATIC(write_multibyte(uint8_t* location, uint32_t val, uint32_t* size))
   return NO_ERROR;
 }
 
-RAISING_STATIC(read_multibyte(uint8_t* location, uint32_t* val, uint32_t* size)) {
-  uint8_t* start = location;
+// this is called for every doc id, offset and position we read, so it can't
+// fail, and it handles the common single-byte case up front. returns the
+// number of bytes read.
+static inline uint32_t read_multibyte(const uint8_t* location, uint32_t* val) {
+  if(!(*location & 0x80)) {
+    *val = *location;
+    return 1;
+  }
+
+  const uint8_t* start = location;
   uint32_t shift = 0;
 
   *val = 0;
   while(*location & 0x80) {
     //printf("yy read continue byte %d -> %d at %p\n", *location, *location & ~0x80, location);
-    *val |= (*location & ~0x80) << shift;
+    *val |= (uint32_t)(*location & ~0x80) << shift;
     shift += 7;
     location++;
   }
-  *val |= *location << shift;
+  *val |= (uint32_t)*location << shift;
   //printf("yy read final byte %d at %p\n", *location, location);
-  *size = (uint32_t)(location + 1 - start);
-  //printf("yy total %d bytes, val = %d\n\n", *size, *val);
+  return (uint32_t)(location + 1 - start);
+}
+
+// the same, for offsets
+static inline uint32_t read_multibyte64(const uint8_t* location, uint64_t* val) {
+  if(!(*location & 0x80)) {
+    *val = *location;
+    return 1;
+  }
+
+  const uint8_t* start = location;
+  uint32_t shift = 0;
+
+  *val = 0;
+  while(*location & 0x80) {
+    *val |= (uint64_t)(*location & ~0x80) << shift;
+    shift += 7;
+    location++;
+  }
+  *val |= (uint64_t)*location << shift;
+  return (uint32_t)(location + 1 - start);
+}
+
+/* bulk decoding of runs of values, e.g. the position deltas of a posting.
+
+   most values in a run fit into a single byte. so we look at 16 bytes at a
+   time (32 with avx2), and if none of them have the continuation bit set, we
+   widen them all at once. otherwise we take the single-byte values before the
+   first multi-byte one, decode that one by hand, and try again.
+
+   decodes all the values in [location, end), which must hold complete
+   values, into vals, which must have room for (end - location) of them.
+   returns the number of values decoded.
+*/
+static uint32_t read_multibyte_run(const uint8_t* location, const uint8_t* end, uint32_t* vals) {
+  uint32_t i = 0;
+
+#if defined(__AVX2__)
+  while(end - location >= 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)location);
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(bytes);
+    if(mask == 0) {
+      for(int j = 0; j < 4; j++) {
+        __m128i eight = _mm_loadl_epi64((const __m128i*)(location + 8 * j));
+        _mm256_storeu_si256((__m256i*)&vals[i + 8 * j], _mm256_cvtepu8_epi32(eight));
+      }
+      i += 32;
+      location += 32;
+    }
+    else {
+      uint32_t k = (uint32_t)__builtin_ctz(mask);
+      for(uint32_t j = 0; j < k; j++) vals[i++] = location[j];
+      location += k;
+      location += read_multibyte(location, &vals[i++]);
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  while(end - location >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)location);
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(bytes);
+    if(mask == 0) {
+      __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      _mm_storeu_si128((__m128i*)&vals[i], _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128((__m128i*)&vals[i + 4], _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128((__m128i*)&vals[i + 8], _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128((__m128i*)&vals[i + 12], _mm_unpackhi_epi16(hi, zero));
+      i += 16;
+      location += 16;
+    }
+    else {
+      uint32_t k = (uint32_t)__builtin_ctz(mask);
+      for(uint32_t j = 0; j < k; j++) vals[i++] = location[j];
+      location += k;
+      location += read_multibyte(location, &vals[i++]);
+    }
+  }
+#endif
+
+  // scalar fallback, and the tail of the run
+  while(location < end) location += read_multibyte(location, &vals[i++]);
+
+  return i;
+}
+
+/* positions
+
+   positions live in their own region, apart from the doc ids, so that
+   walking through a posting list doesn't drag them through the cache. each
+   posting records where its positions start in the positions region and how
+   many bytes they take up; the positions themselves are just the deltas,
+   vbe-encoded. since every position takes at least one byte, the size is
+   also an upper bound on the number of positions.
+*/
+
+RAISING_STATIC(write_positions(wp_segment* seg, posting* po, pos_t positions[])) {
+  postings_region* ps = MMAP_OBJ(seg->positions, postings_region);
+  uint32_t size;
+
+  po->positions_offset = ps->postings_head;
+  for(uint32_t i = 0; i < po->num_positions; i++) {
+    RELAY_ERROR(write_multibyte(&ps->postings[ps->postings_head], positions[i] - (i == 0 ? 0 : positions[i - 1]), &size));
+    ps->postings_head += size;
+  }
+  po->positions_size = (uint32_t)(ps->postings_head - po->positions_offset);
+
+  return NO_ERROR;
+}
+
+// decodes the positions of po into positions, which must have room for
+// po->positions_size entries
+RAISING_STATIC(read_positions(postings_region* ps, posting* po, pos_t* positions)) {
+  if((po->positions_offset >= ps->postings_head) || (po->positions_size > ps->postings_head - po->positions_offset))
+    RAISE_ERROR("invalid positions at %" PRIu64 " (%u bytes; head is %" PRIu64 ")", po->positions_offset, po->positions_size, ps->postings_head);
+
+  const uint8_t* start = &ps->postings[po->positions_offset];
+  po->num_positions = read_multibyte_run(start, start + po->positions_size, positions);
+  for(uint32_t i = 1; i < po->num_positions; i++) positions[i] += positions[i - 1];
+  po->positions = positions;
+
   return NO_ERROR;
 }
 
@@ -367,111 +724,283 @@ RAISING_STATIC(read_multibyte(uint8_t* location, uint32_t* val, uint32_t* size))
    next_offset is guaranteed to be less than the current offset, we subtract
    next from current.
 
-   positions are written as deltas.
+   then, depending on the term's options, come the offset and size of the
+   positions in the positions region (WP_FIELD_POSITIONS), the number of
+   positions (WP_FIELD_FREQS), or nothing at all (WP_FIELD_DOCS_ONLY).
 */
 
-RAISING_STATIC(write_posting(wp_segment* seg, posting* po, pos_t positions[])) {
+// writes the posting to the term's current chunk, which must have room for it
+RAISING_STATIC(write_posting(wp_segment* seg, posting_list_header* plh, posting* po, pos_t positions[])) {
   postings_region* pr = MMAP_OBJ(seg->postings, postings_region);
 
   uint32_t size;
-  uint32_t offset = pr->postings_head;
+  offset_t offset = plh->chunk_head;
+  offset_t head = offset;
 
-  if(po->next_offset >= pr->postings_head) RAISE_ERROR("next_offset %u >= postings_head %u", po->next_offset, pr->postings_head);
+  if(po->next_offset >= offset) RAISE_ERROR("next_offset %" PRIu64 " >= offset %" PRIu64, po->next_offset, offset);
   if(po->num_positions == 0) RAISE_ERROR("num_positions == 0");
 
-  uint32_t doc_id = po->doc_id << 1;
-  if(po->num_positions == 1) doc_id |= 1; // marker for single postings
-  RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], doc_id, &size));
-  pr->postings_head += size;
-  //printf("wrote %u-byte doc_id %u (np1 == %d)\n", size, doc_id, po->num_positions == 1 ? 1 : 0);
+  if(plh->options == WP_FIELD_POSITIONS) RELAY_ERROR(write_positions(seg, po, positions));
+  else po->positions_offset = po->positions_size = 0;
 
-  RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], offset - po->next_offset, &size));
-  pr->postings_head += size;
+  RELAY_ERROR(write_multibyte(&pr->postings[head], po->doc_id, &size));
+  head += size;
+  //printf("wrote %u-byte doc_id %u\n", size, po->doc_id);
+
+  RELAY_ERROR(write_multibyte(&pr->postings[head], offset - po->next_offset, &size));
+  head += size;
   //printf("wrote %u-byte offset %u\n", size, offset - po->next_offset);
 
-  if(po->num_positions > 1) {
-    RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], po->num_positions, &size));
-    pr->postings_head += size;
-    //printf("wrote %u-byte num positions %u\n", size, po->num_positions);
-  }
+  if(plh->options == WP_FIELD_POSITIONS) {
+    RELAY_ERROR(write_multibyte(&pr->postings[head], po->positions_offset, &size));
+    head += size;
 
-  for(uint32_t i = 0; i < po->num_positions; i++) {
-    RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], positions[i] - (i == 0 ? 0 : positions[i - 1]), &size));
-    pr->postings_head += size;
-    //printf("wrote %u-byte positions %u\n", size, positions[i] - (i == 0 ? 0 : positions[i - 1]));
+    RELAY_ERROR(write_multibyte(&pr->postings[head], po->positions_size, &size));
+    head += size;
+  }
+  else if(plh->options == WP_FIELD_FREQS) {
+    RELAY_ERROR(write_multibyte(&pr->postings[head], po->num_positions, &size));
+    head += size;
   }
 
-  //printf("done writing posting\n\n");
-
-  //printf(">>> done writing posting %d %d %d to %p\n\n", (prev_docid == 0 ? po->doc_id : prev_docid - po->doc_id), offset - po->next_offset, po->num_positions, &pr->postings[pl->postings_head]);
+  if(head > plh->chunk_tail) RAISE_ERROR("posting overflowed its chunk (%" PRIu64 " > %" PRIu64 ")", head, plh->chunk_tail);
+  plh->chunk_head = head;
   pr->num_postings++;
 
   return NO_ERROR;
 }
 
-/* if include_positions is true, will malloc the positions array for you, and
- * you must free it when done (assuming num_positions > 0)!
- */
-
-wp_error* wp_segment_read_posting(wp_segment* s, uint32_t offset, posting* po, int include_positions) {
+RAISING_STATIC(read_live_posting(postings_region* pr, offset_t offset, uint32_t options, posting* po)) {
   uint32_t size;
-  uint32_t orig_offset = offset;
-  postings_region* pr = MMAP_OBJ(s->postings, postings_region);
+  offset_t orig_offset = offset;
 
   //DEBUG("reading posting from offset %u -> %p (pr %p base %p)", offset, &pr->postings[offset], pr, &pr->postings);
 
-  RELAY_ERROR(read_multibyte(&pr->postings[offset], &po->doc_id, &size));
-  int is_single_posting = po->doc_id & 1;
-  po->doc_id = po->doc_id >> 1;
+  size = read_multibyte(&pr->postings[offset], &po->doc_id);
   //DEBUG("read doc_id %u (%u bytes)", po->doc_id, size);
   offset += size;
 
-  RELAY_ERROR(read_multibyte(&pr->postings[offset], &po->next_offset, &size));
+  size = read_multibyte64(&pr->postings[offset], &po->next_offset);
   //DEBUG("read next_offset %u -> %u (%u bytes)", po->next_offset, orig_offset - po->next_offset, size);
-  if((po->next_offset == 0) || (po->next_offset > orig_offset)) RAISE_ERROR("read invalid next_offset %u (must be > 0 and < %u)", po->next_offset, orig_offset);
+  if((po->next_offset == 0) || (po->next_offset > orig_offset)) RAISE_ERROR("read invalid next_offset %" PRIu64 " (must be > 0 and < %" PRIu64 ")", po->next_offset, orig_offset);
   po->next_offset = orig_offset - po->next_offset;
   offset += size;
 
-  if(include_positions) {
-    if(is_single_posting) po->num_positions = 1;
-    else {
-      RELAY_ERROR(read_multibyte(&pr->postings[offset], &po->num_positions, &size));
-      //DEBUG("read num_positions: %u (%u bytes)", po->num_positions, size);
-      offset += size;
-    }
+  if(options == WP_FIELD_POSITIONS) {
+    offset += read_multibyte64(&pr->postings[offset], &po->positions_offset);
+    read_multibyte(&pr->postings[offset], &po->positions_size);
+  }
+  else {
+    po->positions_offset = po->positions_size = 0;
+    if(options == WP_FIELD_FREQS) read_multibyte(&pr->postings[offset], &po->num_positions);
+  }
+
+  return NO_ERROR;
+}
+
+/* sealed postings
+
+   once a segment is full, nothing is ever added to its postings region again,
+   so wp_segment_seal() rewrites it with each posting list stored contiguously
+   and in reading order. that lets us finally write doc_id deltas, and drop the
+   next_offsets entirely. the positions region is rewritten the same way, so
+   each posting's positions follow those of the previous posting in the list.
+
+   each posting starts with delta, the previous doc_id minus this one. a delta
+   of 0 marks a restart posting, which is followed by the full doc_id and the
+   offset of its positions. the first posting in a list and every
+   POSTINGS_SKIP_INTERVAL-th one after that are restart postings, so that skip
+   records can point at them. then comes the size of the positions. as in the
+   live region, WP_FIELD_FREQS postings have the number of positions instead
+   of their offset and size, and WP_FIELD_DOCS_ONLY postings have neither.
+
+   a restart posting for doc 0 (i.e. two zero bytes) ends the list. the list's
+   skip records follow it, contiguously and chained in reading order.
+
+   terms that are in a large fraction of the docs are sealed as bitmaps
+   instead; see seal_dense_posting_list().
+*/
 
-    po->positions = malloc(po->num_positions * sizeof(pos_t));
+RAISING_STATIC(write_sealed_posting(postings_region* pr, docid_t prev_doc_id, uint32_t options, posting* po)) {
+  uint32_t size;
 
-    for(uint32_t i = 0; i < po->num_positions; i++) {
-      RELAY_ERROR(read_multibyte(&pr->postings[offset], &po->positions[i], &size));
-      offset += size;
-      po->positions[i] += (i == 0 ? 0 : po->positions[i - 1]);
-      //DEBUG("read position %u (%u bytes)", po->positions[i], size);
+  if(prev_doc_id == DOCID_NONE) { // restart
+    RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], 0, &size));
+    pr->postings_head += size;
+    RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], po->doc_id, &size));
+    pr->postings_head += size;
+    if(options == WP_FIELD_POSITIONS) {
+      RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], po->positions_offset, &size));
+      pr->postings_head += size;
     }
   }
+  else {
+    if(po->doc_id >= prev_doc_id) RAISE_ERROR("doc_id %u out of order (previous was %u)", po->doc_id, prev_doc_id);
+    RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], prev_doc_id - po->doc_id, &size));
+    pr->postings_head += size;
+  }
+
+  if(options != WP_FIELD_DOCS_ONLY) {
+    RELAY_ERROR(write_multibyte(&pr->postings[pr->postings_head], options == WP_FIELD_POSITIONS ? po->positions_size : po->num_positions, &size));
+    pr->postings_head += size;
+  }
+
+  pr->num_postings++;
+
+  return NO_ERROR;
+}
+
+RAISING_STATIC(read_sealed_posting(postings_region* pr, offset_t offset, uint32_t options, posting* po)) {
+  uint32_t delta;
+  offset_t orig_offset = offset;
+
+  if(offset >= pr->postings_head) RAISE_ERROR("invalid posting offset %" PRIu64 " (head is %" PRIu64 ")", offset, pr->postings_head);
+
+  offset += read_multibyte(&pr->postings[offset], &delta);
+
+  if(delta == 0) { // restart posting; the full doc_id and positions offset follow
+    offset += read_multibyte(&pr->postings[offset], &po->doc_id);
+    if(po->doc_id == DOCID_NONE) RAISE_ERROR("read past the end of a posting list at offset %" PRIu64, orig_offset);
+    if(options == WP_FIELD_POSITIONS) offset += read_multibyte64(&pr->postings[offset], &po->positions_offset);
+    else po->positions_offset = po->positions_size = 0;
+  }
+  else {
+    if(delta >= po->doc_id) RAISE_ERROR("read invalid doc_id delta %u from doc %u at offset %" PRIu64, delta, po->doc_id, orig_offset);
+    po->doc_id -= delta;
+    po->positions_offset += po->positions_size;
+  }
+
+  if(options == WP_FIELD_POSITIONS) offset += read_multibyte(&pr->postings[offset], &po->positions_size);
+  else if(options == WP_FIELD_FREQS) offset += read_multibyte(&pr->postings[offset], &po->num_positions);
+
+  if((pr->postings[offset] == 0) && (pr->postings[offset + 1] == 0)) po->next_offset = OFFSET_NONE;
+  else po->next_offset = offset;
+
+  return NO_ERROR;
+}
+
+/* if include_positions is true, will malloc the positions array for you, and
+ * you must free it when done!
+ */
+
+wp_error* wp_segment_read_posting(wp_segment* s, offset_t offset, uint32_t options, posting* po, int include_positions) {
+  postings_region* pr = MMAP_OBJ(s->postings, postings_region);
+
+  if(pr->postings_type_and_flags == POSTINGS_REGION_TYPE_SEALED_VBE) RELAY_ERROR(read_sealed_posting(pr, offset, options, po));
+  else RELAY_ERROR(read_live_posting(pr, offset, options, po));
+
+  if(options == WP_FIELD_FREQS) po->positions = NULL; // num_positions is already set
+  else if(include_positions && (options == WP_FIELD_POSITIONS)) {
+    pos_t* positions = malloc(po->positions_size * sizeof(pos_t));
+    RELAY_ERROR(read_positions(MMAP_OBJ(s->positions, postings_region), po, positions));
+  }
   else {
     po->num_positions = 0;
     po->positions = NULL;
   }
-  //DEBUG("total record took %u bytes", offset - orig_offset);
-  //printf("*** read posting %u %u %u from %u\n", po->doc_id, po->next_offset, po->num_positions, orig_offset);
 
   return NO_ERROR;
 }
 
-wp_error* wp_segment_add_posting(wp_segment* s, const char* field, const char* word, docid_t doc_id, uint32_t num_positions, pos_t positions[]) {
+wp_error* wp_segment_read_positions(wp_segment* s, posting* po, pos_t** buf, uint32_t* buf_size) {
+  if(po->positions_size > *buf_size) {
+    uint32_t new_size = *buf_size * 2;
+    if(new_size < po->positions_size) new_size = po->positions_size;
+    *buf = realloc(*buf, new_size * sizeof(pos_t));
+    if(*buf == NULL) RAISE_ERROR("oom");
+    *buf_size = new_size;
+  }
+
+  RELAY_ERROR(read_positions(MMAP_OBJ(s->positions, postings_region), po, *buf));
+
+  return NO_ERROR;
+}
+
+/* chunks
+
+   in the live postings region, postings aren't simply appended to the region
+   as they come in. instead each term gets a chunk of its own, and its
+   postings and skip records are appended to that, so that walking a posting
+   list mostly moves through a few nearby chunks rather than hopping all over
+   the region. when a term's chunk is full, it gets a new one from the head of
+   the region, sized according to how many postings the term has so far.
+
+   most terms only ever get a posting or two, so a term's first
+   POSTINGS_UNCHUNKED postings are written straight onto the head of the
+   region, taking up no more than they need, and only then does it get a
+   chunk.
+
+   since new chunks always come from the head of the region, next_offsets
+   still always point backwards. the unused end of a term's last chunk is
+   simply lost when the segment is sealed.
+*/
+
+RAISING_STATIC(ensure_chunk_fit(wp_segment* seg, posting_list_header* plh, uint32_t bytes)) {
+  postings_region* pr = MMAP_OBJ(seg->postings, postings_region);
+
+  if(chunk_has_room(plh, bytes)) return NO_ERROR;
+
+  uint32_t size = chunk_size(plh, bytes);
+
+  // near the end of the region, settle for less. wp_segment_ensure_fit() has
+  // made sure there's room for at least this posting.
+  offset_t space = pr->postings_tail - pr->postings_head;
+  if(size > space) size = (uint32_t)space;
+  if(size < bytes) RAISE_ERROR("no room for a %u-byte chunk (%" PRIu64 " bytes left)", bytes, space);
+
+  plh->chunk_head = pr->postings_head;
+  plh->chunk_tail = pr->postings_head + size;
+  pr->postings_head += size;
+  DEBUG("new %u-byte chunk at %" PRIu64 " for a term with %u postings", size, plh->chunk_head, plh->count);
+
+  return NO_ERROR;
+}
+
+/* skip records are written every POSTINGS_SKIP_INTERVAL postings of a term,
+   right after the posting they point to. since they point backwards, like
+   next_offset, and are only ever prepended to the term's skip chain, readers
+   can follow them without any extra synchronization.
+*/
+
+RAISING_STATIC(write_skip(wp_segment* seg, posting_list_header* plh, docid_t doc_id, offset_t posting_offset)) {
+  postings_region* pr = MMAP_OBJ(seg->postings, postings_region);
+
+  offset_t offset = plh->chunk_head;
+  if(offset + sizeof(block_header) > plh->chunk_tail) RAISE_ERROR("skip record overflowed its chunk");
+  // postings are byte-aligned, so skip records can be anywhere
+  block_header bh = { .max_docid = doc_id, .next_offset = plh->skip_offset, .block_start = posting_offset };
+  memcpy(&pr->postings[offset], &bh, sizeof(block_header));
+  plh->chunk_head += sizeof(block_header);
+
+  plh->skip_offset = offset;
+  DEBUG("wrote skip record at %" PRIu64 " for doc %u at %" PRIu64 "; next skip record is %" PRIu64, offset, doc_id, posting_offset, bh.next_offset);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_read_skip(wp_segment* s, offset_t offset, block_header* bh) {
+  postings_region* pr = MMAP_OBJ(s->postings, postings_region);
+
+  if(offset >= pr->postings_head) RAISE_ERROR("invalid skip record offset %" PRIu64 " (head is %" PRIu64 ")", offset, pr->postings_head);
+  memcpy(bh, &pr->postings[offset], sizeof(block_header));
+
+  return NO_ERROR;
+}
+
+// options are what the term gets if it's new
+RAISING_STATIC(add_posting(wp_segment* s, const char* field, const char* word, uint32_t options, docid_t doc_id, uint32_t num_positions, pos_t positions[])) {
   // TODO move this logic up to ensure_fit()
   int success;
 
   if(doc_id == 0) RAISE_ERROR("can't add a label to doc 0");
+  if(wp_segment_is_sealed(s)) RAISE_ERROR("can't add postings to a sealed segment");
 
-  RELAY_ERROR(bump_stringmap(s, &success));
-  RELAY_ERROR(bump_stringpool(s, &success));
-  RELAY_ERROR(bump_termhash(s, &success));
+  RELAY_ERROR(bump_stringmap(s, 0, &success));
+  RELAY_ERROR(bump_stringpool(s, 0, &success));
+  RELAY_ERROR(bump_termhash(s, 0, &success));
 
   DEBUG("adding posting for %s:%s and doc %u with %u positions", field, word, doc_id, num_positions);
 
-  postings_region* pr = MMAP_OBJ(s->postings, postings_region);
   stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
   termhash* th = MMAP_OBJ(s->termhash, termhash);
   stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
@@ -486,165 +1015,1155 @@ wp_error* wp_segment_add_posting(wp_segment* s, const char* field, const char* w
   // find the offset of the next posting
   posting_list_header* plh = termhash_get_val(th, t);
   if(plh == NULL) {
-    RELAY_ERROR(termhash_put_val(th, t, &blank_plh));
+    posting_list_header new_plh = blank_plh;
+    new_plh.options = (uint8_t)options;
+    RELAY_ERROR(termhash_put_val(th, t, &new_plh));
     plh = termhash_get_val(th, t);
   }
   DEBUG("posting list header for %s:%s is at %p", field, word, plh);
 
   posting po;
-  uint32_t next_offset = plh->next_offset;
+  offset_t next_offset = plh->next_offset;
 
   if(next_offset != OFFSET_NONE) { // TODO remove this check for speed once happy [PERFORMANCE]
-    RELAY_ERROR(wp_segment_read_posting(s, next_offset, &po, 0));
+    RELAY_ERROR(wp_segment_read_posting(s, next_offset, plh->options, &po, 0));
     if(po.doc_id >= doc_id) RAISE_ERROR("cannot add a doc_id out of sorted order");
   }
 
+  // make sure the term's chunk has room for the posting, and for a skip
+  // record if this posting gets one. a posting in a new chunk is further
+  // from the last one, so it may take up more.
+  uint32_t bytes = live_posting_bytes(s, plh, doc_id, plh->chunk_head, num_positions, positions);
+  if(!chunk_has_room(plh, bytes)) bytes = live_posting_bytes(s, plh, doc_id, MMAP_OBJ(s->postings, postings_region)->postings_head, num_positions, positions);
+  RELAY_ERROR(ensure_chunk_fit(s, plh, bytes));
+
   // write the entry to the postings region
-  uint32_t entry_offset = pr->postings_head;
-  DEBUG("writing posting at offset %u. next offset is %u.", entry_offset, next_offset);
+  offset_t entry_offset = plh->chunk_head;
+  DEBUG("writing posting at offset %" PRIu64 ". next offset is %" PRIu64 ".", entry_offset, next_offset);
 
   po.doc_id = doc_id;
   po.next_offset = next_offset;
   po.num_positions = num_positions;
-  RELAY_ERROR(write_posting(s, &po, positions)); // prev_docid is 0 for th
-  DEBUG("posting list head now at %u", pr->postings_head);
+  RELAY_ERROR(write_posting(s, plh, &po, positions));
+  DEBUG("chunk head now at %" PRIu64, plh->chunk_head);
 
   // really finally, update the tail pointer so that readers can access this posting
   plh->count++;
   plh->next_offset = entry_offset;
-  DEBUG("posting list header for %s:%s now reads count=%u offset=%u", field, word, plh->count, plh->next_offset);
+  DEBUG("posting list header for %s:%s now reads count=%u offset=%" PRIu64, field, word, plh->count, plh->next_offset);
+
+  if((plh->count % POSTINGS_SKIP_INTERVAL) == 0) RELAY_ERROR(write_skip(s, plh, doc_id, entry_offset));
 
   return NO_ERROR;
 }
 
-/*
- * currently, labels are implemented as a separate postings space and separate
- * postings structure, but with the same term hash (the offsets just are
- * relative to the different space).
- *
- * we use the sentinel field value 0 to demarcate a label. since no strings have
- * have stringmap value 0, this is safe.
- *
- * we also maintain a free list of unused label postings. since all label
- * postings are the same size, we can do this to reuse them and avoid losing
- * space in this area; since label postings can be changed frequently, this is
- * desirable. we use the sentinel postings value field=0 word=0 to keep track
- * of this list.
- *
-*/
-wp_error* wp_segment_read_label(wp_segment* s, uint32_t offset, posting* po) {
-  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
-
-  label_posting* lp = wp_segment_label_posting_at(pr, offset);
-  po->doc_id = lp->doc_id;
-  po->next_offset = lp->next_offset;
-  po->num_positions = 0;
-  po->positions = NULL;
-
+wp_error* wp_segment_add_posting(wp_segment* s, const char* field, const char* word, docid_t doc_id, uint32_t num_positions, pos_t positions[]) {
+  RELAY_ERROR(add_posting(s, field, word, wp_segment_field_options(s, field), doc_id, num_positions, positions));
   return NO_ERROR;
 }
 
-wp_error* wp_segment_add_label(wp_segment* s, const char* label, docid_t doc_id) {
-  // TODO move this logic up to ensure_fit()
-  int success;
+#define BITMAP_TEST(bitmap, i) ((bitmap)[(i) >> 6] & ((uint64_t)1 << ((i) & 63)))
+#define BITMAP_SET(bitmap, i) ((bitmap)[(i) >> 6] |= ((uint64_t)1 << ((i) & 63)))
+#define BITMAP_CLEAR(bitmap, i) ((bitmap)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
+/* dense sealed postings
+
+   a term that's in a large fraction of a segment's docs (see
+   POSTINGS_DENSE_FRACTION) is sealed as a bitmap with a bit for every docid
+   instead. after the bitmap comes, for each of its words, the number of
+   postings in the words before it, so that a doc's rank (its place in the
+   list in ascending docid order) is a single popcount away. then come the
+   per-posting values, by rank: for WP_FIELD_POSITIONS, where each doc's
+   positions start relative to positions_base, plus one more entry for where
+   the last one ends; for WP_FIELD_FREQS, each doc's frequency; and for
+   WP_FIELD_DOCS_ONLY, nothing. the positions are written in ascending docid
+   order.
+*/
 
-  if(doc_id == 0) RAISE_ERROR("can't add a label to doc 0");
+typedef struct dense_postings {
+  uint32_t num_words;
+  offset_t positions_base;
+  uint64_t bits[];
+} dense_postings;
 
-  RELAY_ERROR(bump_stringmap(s, &success));
-  RELAY_ERROR(bump_stringpool(s, &success));
-  RELAY_ERROR(bump_termhash(s, &success));
+#define DENSE_RANKS(dp) ((uint32_t*)&(dp)->bits[(dp)->num_words])
+#define DENSE_VALUES(dp) (DENSE_RANKS(dp) + (dp)->num_words)
 
-  DEBUG("adding label '%s' to doc %u", label, doc_id);
+static uint32_t dense_num_values(uint32_t options, uint32_t count) {
+  if(options == WP_FIELD_POSITIONS) return count + 1;
+  if(options == WP_FIELD_FREQS) return count;
+  return 0;
+}
 
-  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
-  stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
-  termhash* th = MMAP_OBJ(s->termhash, termhash);
-  stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
+RAISING_STATIC(seal_dense_posting_list(wp_segment* seg, mmap_obj* sealed, mmap_obj* sealed_positions, posting_list_header* plh, posting_list_header* sealed_plh)) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  postings_region* ps = MMAP_OBJ(seg->positions, postings_region);
+  postings_region* sps = MMAP_OBJ_PTR(sealed_positions, postings_region);
+  uint32_t num_words = si->num_docs / 64 + 1;
+  uint32_t num_values = dense_num_values(plh->options, plh->count);
+  offset_t positions_bytes = 0;
+  int success;
 
-  // construct the term object. term objects for labels have the special
-  // sentinel field value 0
-  term t;
-  t.field_s = 0; // label sentinel value
-  RELAY_ERROR(stringmap_add(sh, sp, label, &t.word_s)); // get word key
+  // gather up the postings, which come in descending order
+  posting* postings = malloc(sizeof(posting) * plh->count);
+  uint32_t n = 0;
+  offset_t offset = plh->next_offset;
+  while(offset != OFFSET_NONE) {
+    if(n == plh->count) RAISE_ERROR("posting list header says %u postings but found more", plh->count);
+    RELAY_ERROR(wp_segment_read_posting(seg, offset, plh->options, &postings[n], 0));
+    positions_bytes += postings[n].positions_size;
+    offset = postings[n].next_offset;
+    n++;
+  }
+  if(n != plh->count) RAISE_ERROR("posting list header says %u postings but found %u", plh->count, n);
+  if(positions_bytes > UINT32_MAX) RAISE_ERROR("too many positions (%" PRIu64 " bytes) for a dense posting list", positions_bytes);
+
+  // the bitmap goes on an 8-byte boundary
+  offset_t bytes = sizeof(dense_postings) + num_words * (sizeof(uint64_t) + sizeof(uint32_t)) + num_values * sizeof(uint32_t);
+  RELAY_ERROR(postings_region_ensure_fit(sealed, bytes + 7, &success));
+  if(!success) RAISE_ERROR("out of space while sealing postings region");
+  RELAY_ERROR(postings_region_ensure_fit(sealed_positions, positions_bytes, &success));
+  if(!success) RAISE_ERROR("out of space while sealing positions region");
+  postings_region* spr = MMAP_OBJ_PTR(sealed, postings_region);
+  sps = MMAP_OBJ_PTR(sealed_positions, postings_region);
+
+  *sealed_plh = blank_plh;
+  sealed_plh->count = plh->count;
+  sealed_plh->options = plh->options;
+  sealed_plh->dense = 1;
+  sealed_plh->next_offset = (spr->postings_head + 7) & ~(offset_t)7;
+
+  dense_postings* dp = (dense_postings*)&spr->postings[sealed_plh->next_offset];
+  memset(dp, 0, bytes);
+  dp->num_words = num_words;
+  dp->positions_base = sps->postings_head;
+  uint32_t* values = DENSE_VALUES(dp);
+
+  for(uint32_t r = 0; r < n; r++) {
+    posting* po = &postings[n - 1 - r];
+    BITMAP_SET(dp->bits, po->doc_id);
+    if(plh->options == WP_FIELD_POSITIONS) {
+      values[r] = (uint32_t)(sps->postings_head - dp->positions_base);
+      memcpy(&sps->postings[sps->postings_head], &ps->postings[po->positions_offset], po->positions_size);
+      sps->postings_head += po->positions_size;
+    }
+    else if(plh->options == WP_FIELD_FREQS) values[r] = po->num_positions;
+  }
+  if(plh->options == WP_FIELD_POSITIONS) values[n] = (uint32_t)positions_bytes;
 
-  // find the previous and next label postings, between which we'll insert this
-  // posting
-  posting_list_header* plh = termhash_get_val(th, t);
-  if(plh == NULL) {
-    RELAY_ERROR(termhash_put_val(th, t, &blank_plh));
-    plh = termhash_get_val(th, t);
+  uint32_t* ranks = DENSE_RANKS(dp);
+  uint32_t rank = 0;
+  for(uint32_t i = 0; i < num_words; i++) {
+    ranks[i] = rank;
+    rank += (uint32_t)__builtin_popcountll(dp->bits[i]);
   }
 
-  uint32_t next_offset = plh->next_offset;
-  docid_t last_docid = DOCID_NONE;
-  uint32_t prev_offset = OFFSET_NONE;
+  spr->postings_head = sealed_plh->next_offset + bytes;
+  spr->num_postings += n;
+  free(postings);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_read_dense_posting(wp_segment* s, offset_t offset, uint32_t options, docid_t doc_id, posting* po) {
+  postings_region* pr = MMAP_OBJ(s->postings, postings_region);
+
+  po->doc_id = DOCID_NONE;
+  po->next_offset = OFFSET_NONE;
+  po->num_positions = 0;
+  po->positions = NULL;
+  po->positions_offset = po->positions_size = 0;
+
+  if(offset >= pr->postings_head) RAISE_ERROR("invalid dense posting list offset %" PRIu64 " (head is %" PRIu64 ")", offset, pr->postings_head);
+  if(doc_id == DOCID_NONE) return NO_ERROR;
+
+  // find the largest set bit at or below doc_id
+  dense_postings* dp = (dense_postings*)&pr->postings[offset];
+  uint32_t word = doc_id >> 6;
+  uint64_t mask;
+  if(word >= dp->num_words) {
+    word = dp->num_words - 1;
+    mask = dp->bits[word];
+  }
+  else mask = dp->bits[word] & ((doc_id & 63) == 63 ? ~(uint64_t)0 : (((uint64_t)1 << ((doc_id & 63) + 1)) - 1));
 
-  DEBUG("start offset is %u (none is %u)", next_offset, OFFSET_NONE);
+  while(mask == 0) {
+    if(word == 0) return NO_ERROR;
+    mask = dp->bits[--word];
+  }
 
-  while(next_offset != OFFSET_NONE) {
-    label_posting* lp = wp_segment_label_posting_at(pr, next_offset);
+  // mask holds every set bit in the word up to and including this one
+  po->doc_id = word * 64 + 63 - (uint32_t)__builtin_clzll(mask);
+  uint32_t rank = DENSE_RANKS(dp)[word] + (uint32_t)__builtin_popcountll(mask) - 1;
+  uint32_t* values = DENSE_VALUES(dp);
 
-    if((last_docid != DOCID_NONE) && (lp->doc_id >= last_docid))
-      RAISE_ERROR("whistlepig index corruption! lp %u has docid %u but last docid at lp %u was %u", next_offset, lp->doc_id, prev_offset, last_docid);
-    else
-      last_docid = lp->doc_id;
+  if(options == WP_FIELD_POSITIONS) {
+    po->positions_offset = dp->positions_base + values[rank];
+    po->positions_size = values[rank + 1] - values[rank];
+  }
+  else if(options == WP_FIELD_FREQS) po->num_positions = values[rank];
 
-    DEBUG("got doc id %u next_offset %u at offset %u (looking for doc id %u)", lp->doc_id, lp->next_offset, next_offset, doc_id);
-    if(lp->doc_id == doc_id) {
-      DEBUG("already have label '%s' for doc %u; returning", label, doc_id);
-      return NO_ERROR;
+  return NO_ERROR;
+}
+
+RAISING_STATIC(seal_posting_list(wp_segment* seg, mmap_obj* sealed, mmap_obj* sealed_positions, posting_list_header* plh, posting_list_header* sealed_plh)) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  if((uint64_t)plh->count * POSTINGS_DENSE_FRACTION >= si->num_docs) {
+    RELAY_ERROR(seal_dense_posting_list(seg, sealed, sealed_positions, plh, sealed_plh));
+    return NO_ERROR;
+  }
+
+  block_header* skips = malloc(sizeof(block_header) * ((plh->count / POSTINGS_SKIP_INTERVAL) + 1));
+  uint32_t num_skips = 0;
+  uint32_t num_postings = 0;
+  docid_t prev_doc_id = DOCID_NONE;
+  offset_t offset = plh->next_offset;
+  postings_region* ps = MMAP_OBJ(seg->positions, postings_region);
+  postings_region* spr;
+  postings_region* sps;
+  int success;
+
+  *sealed_plh = blank_plh;
+  sealed_plh->count = plh->count;
+  sealed_plh->options = plh->options;
+
+  while(offset != OFFSET_NONE) {
+    posting po;
+    RELAY_ERROR(wp_segment_read_posting(seg, offset, plh->options, &po, 0));
+
+    // restart + doc_id + positions offset + positions size
+    RELAY_ERROR(postings_region_ensure_fit(sealed, 3 * MAX_VBE_SIZE + MAX_VBE64_SIZE, &success));
+    if(!success) RAISE_ERROR("out of space while sealing postings region");
+    RELAY_ERROR(postings_region_ensure_fit(sealed_positions, po.positions_size, &success));
+    if(!success) RAISE_ERROR("out of space while sealing positions region");
+    spr = MMAP_OBJ_PTR(sealed, postings_region);
+    sps = MMAP_OBJ_PTR(sealed_positions, postings_region);
+
+    // the positions themselves don't change; they just move
+    if(plh->options == WP_FIELD_POSITIONS) {
+      memcpy(&sps->postings[sps->postings_head], &ps->postings[po.positions_offset], po.positions_size);
+      po.positions_offset = sps->postings_head;
+      sps->postings_head += po.positions_size;
     }
-    else if(lp->doc_id < doc_id) break;
-    prev_offset = next_offset;
-    next_offset = lp->next_offset;
+
+    if((num_postings % POSTINGS_SKIP_INTERVAL) == 0) {
+      if(num_postings == 0) sealed_plh->next_offset = spr->postings_head;
+      else {
+        skips[num_skips].max_docid = po.doc_id;
+        skips[num_skips].block_start = spr->postings_head;
+        num_skips++;
+      }
+      prev_doc_id = DOCID_NONE; // force a restart
+    }
+
+    RELAY_ERROR(write_sealed_posting(spr, prev_doc_id, plh->options, &po));
+    prev_doc_id = po.doc_id;
+    offset = po.next_offset;
+    num_postings++;
   }
 
-  // find a space for the posting by first checking for a free postings in the
-  // dead list. the dead list is the list stored under the sentinel term with
-  // field 0 and word 0.
-  posting_list_header* dead_plh = termhash_get_val(th, dead_term);
-  if(dead_plh == NULL) {
-    RELAY_ERROR(termhash_put_val(th, dead_term, &blank_plh));
-    dead_plh = termhash_get_val(th, t);
+  if(num_postings != plh->count) RAISE_ERROR("posting list header says %u postings but found %u", plh->count, num_postings);
+
+  // terminate the list, and write the skip records right after it
+  RELAY_ERROR(postings_region_ensure_fit(sealed, 2 + (uint32_t)sizeof(block_header) * num_skips, &success));
+  if(!success) RAISE_ERROR("out of space while sealing postings region");
+  spr = MMAP_OBJ_PTR(sealed, postings_region);
+
+  spr->postings[spr->postings_head++] = 0;
+  spr->postings[spr->postings_head++] = 0;
+
+  for(uint32_t i = 0; i < num_skips; i++) {
+    if(i == 0) sealed_plh->skip_offset = spr->postings_head;
+    skips[i].next_offset = (i + 1 < num_skips) ? spr->postings_head + sizeof(block_header) : OFFSET_NONE;
+    memcpy(&spr->postings[spr->postings_head], &skips[i], sizeof(block_header));
+    spr->postings_head += sizeof(block_header);
   }
 
-  uint32_t entry_offset;
-  uint32_t dead_offset = dead_plh->next_offset;
+  free(skips);
+  return NO_ERROR;
+}
+
+// create a region to build a sealed version of old into, sized to start with
+// as big as old is now. it'll be grown if necessary and truncated at the end.
+RAISING_STATIC(create_sealing_region(mmap_obj* o, mmap_obj* old, const char* magic, const char* fn, uint32_t postings_type_and_flags)) {
+  postings_region* pr = MMAP_OBJ_PTR(old, postings_region);
+
+  unlink(fn); // in case a previous attempt died halfway through
+  offset_t initial_size = pr->postings_head > INITIAL_POSTINGS_SIZE ? pr->postings_head : INITIAL_POSTINGS_SIZE;
+  RELAY_ERROR(mmap_obj_create(o, magic, fn, sizeof(postings_region) + initial_size));
+  postings_region_init(MMAP_OBJ_PTR(o, postings_region), initial_size, postings_type_and_flags);
+
+  return NO_ERROR;
+}
+
+// trim the slack from a sealed region, and get it onto the disk
+RAISING_STATIC(finish_sealed_region(mmap_obj* o)) {
+  postings_region* pr = MMAP_OBJ_PTR(o, postings_region);
+
+  pr->postings_tail = pr->postings_head;
+  RELAY_ERROR(mmap_obj_resize(o, sizeof(postings_region) + pr->postings_head));
+  RELAY_ERROR(mmap_obj_sync(o));
+  RELAY_ERROR(mmap_obj_unload(o));
+
+  return NO_ERROR;
+}
 
-  if(dead_offset == OFFSET_NONE) { // make a new posting
-    entry_offset = pr->postings_head;
+// is this termhash entry an actual term, rather than a label or a key?
+static int is_term(term t) {
+  return (t.field_s != 0) && (t.field_s != WP_KEY_FIELD);
+}
+
+static void sealing_pathname(char* fn, const char* pathname_base, const char* suffix) {
+  snprintf(fn, FN_SIZE, "%s.%s.sealing", pathname_base, suffix);
+}
+
+// makes new files and renames in the segment's directory stick
+RAISING_STATIC(sync_dir(const char* pathname_base)) {
+  char dir[FN_SIZE];
+  const char* slash = strrchr(pathname_base, '/');
+
+  if(slash == NULL) snprintf(dir, FN_SIZE, ".");
+  else snprintf(dir, FN_SIZE, "%.*s", (int)(slash - pathname_base) + 1, pathname_base);
+
+  int fd = open(dir, O_RDONLY);
+  if(fd == -1) RAISE_SYSERROR("cannot open the directory of %s", pathname_base);
+  int ret = fsync(fd);
+  close(fd);
+  if(ret == -1) RAISE_SYSERROR("fsync of the directory of %s", pathname_base);
+
+  return NO_ERROR;
+}
+
+/* sealing has to survive dying at any point, since the old postings can't
+   be read with the new term hash values, or the other way around.
+
+   the new postings and positions regions and the new term hash values are
+   built in .sealing files next to the old ones, and synced to disk. setting
+   seal_committed in the segment info, and syncing that, is the commit
+   point. finish_seal() then moves everything into place, and can be run
+   again from the start if we die partway through it. on load, a committed
+   seal is finished, and the .sealing files of one that didn't get that far
+   are thrown away. */
+
+// moves a committed seal's files into place
+RAISING_STATIC(finish_seal(wp_segment* seg)) {
+  char fn[FN_SIZE], sealing_fn[FN_SIZE];
+  const char* suffixes[] = { WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX, WP_SEGMENT_POSTING_REGION_PATH_SUFFIX };
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  termhash* th = MMAP_OBJ(seg->termhash, termhash);
+  term* keys = TERMHASH_KEYS(th);
+  posting_list_header* vals = TERMHASH_VALS(th);
+  mmap_obj sealed_vals;
+
+  // the regions may have been moved already
+  for(int i = 0; i < 2; i++) {
+    snprintf(fn, 128, "%s.%s", seg->pathname_base, suffixes[i]);
+    sealing_pathname(sealing_fn, seg->pathname_base, suffixes[i]);
+    if((rename(sealing_fn, fn) == -1) && (errno != ENOENT)) RAISE_SYSERROR("rename");
   }
-  else { // we'll use this one; remove it from the linked list
-    DEBUG("offset from dead list is %u, using it for the new posting!", dead_offset);
-    entry_offset = dead_plh->next_offset;
-    dead_plh->next_offset = wp_segment_label_posting_at(pr, dead_offset)->next_offset;
-    dead_plh->count--;
+  RELAY_ERROR(sync_dir(seg->pathname_base));
+
+  // labels live in their own region and keys have no postings, so their
+  // values stay as they are
+  sealing_pathname(sealing_fn, seg->pathname_base, WP_SEGMENT_SEALED_VALS_PATH_SUFFIX);
+  RELAY_ERROR(mmap_obj_load(&sealed_vals, "wp/sealvals", sealing_fn));
+  if(sealed_vals.content->size != sizeof(posting_list_header) * th->n_buckets) RAISE_ERROR("sealed term values are for a different term hash");
+  posting_list_header* new_vals = MMAP_OBJ(sealed_vals, posting_list_header);
+  for(uint32_t i = 0; i < th->n_buckets; i++) {
+    if(termhash_slot_used(th, i) && is_term(keys[i])) vals[i] = new_vals[i];
   }
+  RELAY_ERROR(mmap_obj_unload(&sealed_vals));
+  RELAY_ERROR(mmap_obj_sync(&seg->termhash));
+
+  // let everyone else know they need to reopen the regions
+  si->generation++;
+  si->seal_committed = 0;
+  RELAY_ERROR(mmap_obj_sync(&seg->seginfo));
+  unlink(sealing_fn);
+
+  return NO_ERROR;
+}
 
-  // finally, write the entry to the label postings region
-  DEBUG("label entry will be at offset %u, prev offset is %u and next offset is %u", entry_offset, prev_offset, next_offset);
-  label_posting* po = wp_segment_label_posting_at(pr, entry_offset);
-  po->doc_id = doc_id;
-  po->next_offset = next_offset;
+// finishes or throws away a seal that we died in the middle of
+RAISING_STATIC(recover_seal(wp_segment* seg)) {
+  char fn[FN_SIZE];
+  const char* suffixes[] = { WP_SEGMENT_POSTING_REGION_PATH_SUFFIX, WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX, WP_SEGMENT_SEALED_VALS_PATH_SUFFIX };
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  struct stat fstat;
 
-  pr->postings_head += (uint32_t)sizeof(label_posting);
-  DEBUG("label posting list head now at %u", pr->postings_head);
+  // the postings region is the first thing a seal writes
+  sealing_pathname(fn, seg->pathname_base, WP_SEGMENT_POSTING_REGION_PATH_SUFFIX);
+  if(!si->seal_committed && (stat(fn, &fstat) == -1)) return NO_ERROR;
 
-  // really finally, update either the previous offset or the tail pointer
-  // for this label so that readers can access this posting
-  plh->count++;
-  if(prev_offset == OFFSET_NONE) plh->next_offset = entry_offset;
-  else wp_segment_label_posting_at(pr, prev_offset)->next_offset = entry_offset;
+  // someone else may be sealing it right now, in which case we wait for them
+  RELAY_ERROR(wp_segment_grab_writelock(seg));
+  wp_error* e = NO_ERROR;
+  if(si->seal_committed) {
+    DEBUG("finishing the seal of %s", seg->pathname_base);
+    e = finish_seal(seg);
+  }
+  else {
+    DEBUG("throwing away a partial seal of %s", seg->pathname_base);
+    for(int i = 0; i < 3; i++) {
+      sealing_pathname(fn, seg->pathname_base, suffixes[i]);
+      unlink(fn);
+    }
+  }
+  RELAY_ERROR(wp_segment_release_lock(seg));
+  RELAY_ERROR(e);
 
   return NO_ERROR;
 }
 
-wp_error* wp_segment_remove_label(wp_segment* s, const char* label, docid_t doc_id) {
-  // TODO move this logic to ensure_fit
+wp_error* wp_segment_seal(wp_segment* seg) {
+  char sealed_fn[FN_SIZE], sealed_positions_fn[FN_SIZE], sealed_vals_fn[FN_SIZE];
+  mmap_obj sealed, sealed_positions, sealed_vals;
+
+  if(wp_segment_is_sealed(seg)) return NO_ERROR;
+
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  postings_region* pr = MMAP_OBJ(seg->postings, postings_region);
+  termhash* th = MMAP_OBJ(seg->termhash, termhash);
+  term* keys = TERMHASH_KEYS(th);
+  posting_list_header* vals = TERMHASH_VALS(th);
+
+  DEBUG("sealing segment %s with %" PRIu64 " postings in %" PRIu64 " bytes", seg->pathname_base, pr->num_postings, pr->postings_head);
+
+  // write the new regions next to the old ones
+  sealing_pathname(sealed_fn, seg->pathname_base, WP_SEGMENT_POSTING_REGION_PATH_SUFFIX);
+  sealing_pathname(sealed_positions_fn, seg->pathname_base, WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX);
+  RELAY_ERROR(create_sealing_region(&sealed, &seg->postings, "wp/postings", sealed_fn, POSTINGS_REGION_TYPE_SEALED_VBE));
+  RELAY_ERROR(create_sealing_region(&sealed_positions, &seg->positions, "wp/positions", sealed_positions_fn, POSTINGS_REGION_TYPE_POSITIONS_VBE));
+
+  // and the new posting list headers, so that nothing changes until the
+  // seal is committed
+  sealing_pathname(sealed_vals_fn, seg->pathname_base, WP_SEGMENT_SEALED_VALS_PATH_SUFFIX);
+  unlink(sealed_vals_fn);
+  RELAY_ERROR(mmap_obj_create(&sealed_vals, "wp/sealvals", sealed_vals_fn, sizeof(posting_list_header) * th->n_buckets));
+  posting_list_header* new_vals = MMAP_OBJ(sealed_vals, posting_list_header);
+  for(uint32_t i = 0; i < th->n_buckets; i++) {
+    if(termhash_slot_used(th, i) && is_term(keys[i])) RELAY_ERROR(seal_posting_list(seg, &sealed, &sealed_positions, &vals[i], &new_vals[i]));
+  }
+
+  postings_region* spr = MMAP_OBJ(sealed, postings_region);
+  if(spr->num_postings != pr->num_postings) RAISE_ERROR("sealed %" PRIu64 " postings but expected %" PRIu64, spr->num_postings, pr->num_postings);
+
+  RELAY_ERROR(finish_sealed_region(&sealed_positions));
+  RELAY_ERROR(finish_sealed_region(&sealed));
+  RELAY_ERROR(mmap_obj_sync(&sealed_vals));
+  RELAY_ERROR(mmap_obj_unload(&sealed_vals));
+  RELAY_ERROR(sync_dir(seg->pathname_base));
+
+  // commit
+  si->seal_committed = 1;
+  RELAY_ERROR(mmap_obj_sync(&seg->seginfo));
+
+  RELAY_ERROR(finish_seal(seg));
+  RELAY_ERROR(mmap_obj_unload(&seg->positions));
+  RELAY_ERROR(mmap_obj_unload(&seg->postings));
+  RELAY_ERROR(load_postings_regions(seg));
+  DEBUG("sealed segment %s; postings region now %" PRIu64 " bytes", seg->pathname_base, MMAP_OBJ(seg->postings, postings_region)->postings_head);
+
+  return NO_ERROR;
+}
+
+int wp_segment_is_sealed(wp_segment* seg) {
+  postings_region* pr = MMAP_OBJ(seg->postings, postings_region);
+  return pr->postings_type_and_flags == POSTINGS_REGION_TYPE_SEALED_VBE;
+}
+
+uint32_t wp_segment_generation(wp_segment* seg) {
+  return seg->generation;
+}
+
+/*
+ * labels are stored in their own region, but share the term hash with
+ * everything else (the offsets are just relative to the different region).
+ * we use the sentinel field value 0 to demarcate a label. since no strings
+ * have stringmap value 0, this is safe.
+ *
+ * a label can be on a large fraction of the docs in a segment, and can be
+ * added to and removed from docs at any time, so rather than a posting list,
+ * each label has a compressed bitmap of its docids. this is split up by the
+ * high 16 bits of the docids into containers, which hold the low 16 bits
+ * either as a sorted array (while there are at most LABEL_ARRAY_MAX_SIZE of
+ * them) or as a plain bitmap. the label's plh points at a directory of these
+ * containers, sorted by key. adding, removing and looking up a docid is a
+ * binary search in the directory and then in (or a probe of) one container.
+ *
+ * the directories and containers are allocated out of the labels region in
+ * blocks whose sizes are powers of two. freed blocks go onto a free list for
+ * their size, and the heads of these lists live at the start of the region.
+ *
+ * changes are copy-on-write, so that searches can keep reading labels while
+ * they change (see wp_segment_grab_label_lock). a change writes new copies of
+ * the blocks it touches and then publishes them with a single store of the
+ * offset that points at them: the plh's for a directory, or the doc_labels
+ * slot for a doc's label ids. a search sees either the old version or the new
+ * one, never a mix. if searches are running alongside the change, the old
+ * blocks go into a pending log, and only go onto the free lists once no
+ * search can still be looking at them, i.e. the next time anything gets the
+ * segment's write lock. otherwise they're freed right away.
+*/
+
+#define LABEL_CONTAINER_ARRAY 1
+#define LABEL_CONTAINER_BITMAP 2
+
+#define LABEL_BITMAP_BYTES (65536 / 8)
+
+#define LABEL_MIN_BLOCK_SIZE 16
+#define LABEL_NUM_BLOCK_SIZES 17 // 16 bytes up to 1mb, enough for a directory of every possible container
+#define LABEL_BLOCK_SIZE(size_class) ((offset_t)LABEL_MIN_BLOCK_SIZE << (size_class))
+
+// the free lists sit at the start of the region, after the OFFSET_NONE byte,
+// followed by the offset of the pending log. we keep everything 8-byte
+// aligned.
+#define LABEL_FREE_LISTS_OFFSET 8
+#define LABEL_PENDING_LOG_OFFSET (LABEL_FREE_LISTS_OFFSET + LABEL_NUM_BLOCK_SIZES * sizeof(offset_t))
+#define wp_segment_label_free_lists(pr) ((offset_t*)(pr->postings + LABEL_FREE_LISTS_OFFSET))
+#define wp_segment_label_pending_log(pr) (*(offset_t*)(pr->postings + LABEL_PENDING_LOG_OFFSET))
+#define wp_segment_label_block_at(pr, offset) ((void*)(pr->postings + offset))
+
+// blocks that have been replaced, but that searches might still be reading.
+// each entry is a block's offset, shifted up past its size class. the log is
+// a chain of fixed-size blocks, newest first.
+typedef struct label_pending_log {
+  offset_t next;
+  uint32_t count;
+  uint64_t entries[];
+} label_pending_log;
+
+#define LABEL_PENDING_LOG_SIZE_CLASS 8 // 4kb
+#define LABEL_PENDING_LOG_CAPACITY ((LABEL_BLOCK_SIZE(LABEL_PENDING_LOG_SIZE_CLASS) - sizeof(label_pending_log)) / sizeof(uint64_t))
+
+#define LABEL_PENDING_ENTRY(offset, size_class) (((uint64_t)(offset) << 5) | (size_class))
+#define LABEL_PENDING_OFFSET(entry) ((offset_t)((entry) >> 5))
+#define LABEL_PENDING_SIZE_CLASS(entry) ((uint8_t)((entry) & 31))
+
+static void labels_region_init(postings_region* pr) {
+  offset_t* free_lists = wp_segment_label_free_lists(pr);
+  for(int i = 0; i < LABEL_NUM_BLOCK_SIZES; i++) free_lists[i] = OFFSET_NONE;
+  wp_segment_label_pending_log(pr) = OFFSET_NONE;
+  pr->postings_head = LABEL_PENDING_LOG_OFFSET + sizeof(offset_t);
+}
+
+// the smallest size class that fits bytes
+static uint8_t label_size_class(offset_t bytes) {
+  uint8_t size_class = 0;
+  while(LABEL_BLOCK_SIZE(size_class) < bytes) size_class++;
+  return size_class;
+}
+
+RAISING_STATIC(label_block_alloc(wp_segment* s, uint8_t size_class, offset_t* offset)) {
+  if(size_class >= LABEL_NUM_BLOCK_SIZES) RAISE_ERROR("label block of size class %u is too big", size_class);
+
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  offset_t* free_lists = wp_segment_label_free_lists(pr);
+
+  if(free_lists[size_class] != OFFSET_NONE) { // reuse a freed block
+    *offset = free_lists[size_class];
+    free_lists[size_class] = *(offset_t*)wp_segment_label_block_at(pr, *offset);
+    DEBUG("reusing label block at %" PRIu64 " of size %" PRIu64, *offset, LABEL_BLOCK_SIZE(size_class));
+    return NO_ERROR;
+  }
+
   int success;
-  RELAY_ERROR(bump_termhash(s, &success)); // we might add an entry for the dead list
+  RELAY_ERROR(postings_region_ensure_fit(&s->labels, LABEL_BLOCK_SIZE(size_class), &success));
+  if(!success) RAISE_ERROR("no room for more labels in this segment");
+
+  pr = MMAP_OBJ(s->labels, postings_region); // may have changed!
+  *offset = pr->postings_head;
+  pr->postings_head += LABEL_BLOCK_SIZE(size_class);
+  DEBUG("allocated label block at %" PRIu64 " of size %" PRIu64, *offset, LABEL_BLOCK_SIZE(size_class));
+
+  return NO_ERROR;
+}
+
+// only for blocks that no search can be reading
+static void label_block_free(postings_region* pr, uint8_t size_class, offset_t offset) {
+  offset_t* free_lists = wp_segment_label_free_lists(pr);
+  *(offset_t*)wp_segment_label_block_at(pr, offset) = free_lists[size_class];
+  free_lists[size_class] = offset;
+}
+
+// get rid of a block that has just been unpublished. if searches might
+// still be reading it, it goes into the pending log, which (unlike the free
+// lists) leaves the block itself untouched.
+RAISING_STATIC(label_block_retire(wp_segment* s, uint8_t size_class, offset_t offset)) {
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  if(!s->shared_labels) {
+    label_block_free(pr, size_class, offset);
+    return NO_ERROR;
+  }
+
+  offset_t log_offset = wp_segment_label_pending_log(pr);
+  label_pending_log* log = (log_offset == OFFSET_NONE) ? NULL : wp_segment_label_block_at(pr, log_offset);
+  if((log == NULL) || (log->count == LABEL_PENDING_LOG_CAPACITY)) { // start a new log block
+    offset_t new_offset = OFFSET_NONE;
+    RELAY_ERROR(label_block_alloc(s, LABEL_PENDING_LOG_SIZE_CLASS, &new_offset));
+    pr = MMAP_OBJ(s->labels, postings_region);
+    log = wp_segment_label_block_at(pr, new_offset);
+    log->next = log_offset;
+    log->count = 0;
+    wp_segment_label_pending_log(pr) = new_offset;
+  }
+
+  log->entries[log->count++] = LABEL_PENDING_ENTRY(offset, size_class);
+  return NO_ERROR;
+}
+
+// move everything in the pending log, and the log itself, onto the free
+// lists. you must hold the segment's write lock.
+static void label_blocks_reclaim(postings_region* pr) {
+  offset_t log_offset = wp_segment_label_pending_log(pr);
+  while(log_offset != OFFSET_NONE) {
+    label_pending_log* log = wp_segment_label_block_at(pr, log_offset);
+    offset_t next = log->next;
+    DEBUG("reclaiming %u label blocks", log->count);
+    for(uint32_t i = 0; i < log->count; i++) label_block_free(pr, LABEL_PENDING_SIZE_CLASS(log->entries[i]), LABEL_PENDING_OFFSET(log->entries[i]));
+    label_block_free(pr, LABEL_PENDING_LOG_SIZE_CLASS, log_offset);
+    log_offset = next;
+  }
+  wp_segment_label_pending_log(pr) = OFFSET_NONE;
+}
+
+// the index of the first container with a key >= key
+static uint32_t label_directory_search(label_directory* dir, uint16_t key) {
+  uint32_t low = 0, high = dir->num_containers;
+  while(low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if(dir->containers[mid].key < key) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+// the index of the first array entry >= val
+static uint32_t label_array_search(uint16_t* array, uint32_t count, uint16_t val) {
+  uint32_t low = 0, high = count;
+  while(low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if(array[mid] < val) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+// find the largest value in a container that's <= val. returns 0 if there
+// isn't one.
+static int label_container_at_most(postings_region* pr, label_container* c, uint32_t val, uint16_t* found) {
+  if(c->type == LABEL_CONTAINER_ARRAY) {
+    uint16_t* array = wp_segment_label_block_at(pr, c->offset);
+    uint32_t i = label_array_search(array, c->count, (uint16_t)val);
+    if((i < c->count) && (array[i] == val)) {
+      *found = array[i];
+      return 1;
+    }
+    if(i == 0) return 0;
+    *found = array[i - 1];
+    return 1;
+  }
+  else {
+    uint64_t* bitmap = wp_segment_label_block_at(pr, c->offset);
+    int32_t word = (int32_t)(val >> 6);
+    uint64_t mask = bitmap[word] & ((val & 63) == 63 ? ~(uint64_t)0 : (((uint64_t)1 << ((val & 63) + 1)) - 1));
+    while(mask == 0) {
+      if(--word < 0) return 0;
+      mask = bitmap[word];
+    }
+    *found = (uint16_t)((uint32_t)word * 64 + 63 - (uint32_t)__builtin_clzll(mask));
+    return 1;
+  }
+}
+
+#define LABEL_KEY(doc_id) ((uint16_t)((doc_id) >> 16))
+#define LABEL_VAL(doc_id) ((uint16_t)((doc_id) & 0xffff))
+
+// copy a label's container for key into c. returns 0 if there isn't one.
+static int label_container_find(postings_region* pr, posting_list_header* plh, uint16_t key, label_container* c) {
+  if(plh->next_offset == OFFSET_NONE) return 0;
+
+  label_directory* dir = wp_segment_label_block_at(pr, plh->next_offset);
+  uint32_t idx = label_directory_search(dir, key);
+  if((idx == dir->num_containers) || (dir->containers[idx].key != key)) return 0;
+
+  *c = dir->containers[idx];
+  return 1;
+}
+
+// write a new block for container c, whose type and count are already set,
+// holding old's values plus (or minus) the n docids in delta. delta is in
+// ascending order, and only has docids that aren't (or are) in old. old may
+// be NULL when adding.
+RAISING_STATIC(label_container_write(wp_segment* s, label_container* c, label_container* old, uint32_t n, docid_t* delta, int add)) {
+  c->size_class = label_size_class(c->type == LABEL_CONTAINER_BITMAP ? LABEL_BITMAP_BYTES : c->count * sizeof(uint16_t));
+  RELAY_ERROR(label_block_alloc(s, c->size_class, &c->offset));
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+
+  if(c->type == LABEL_CONTAINER_BITMAP) {
+    uint64_t* bitmap = wp_segment_label_block_at(pr, c->offset);
+    if((old != NULL) && (old->type == LABEL_CONTAINER_BITMAP)) memcpy(bitmap, wp_segment_label_block_at(pr, old->offset), LABEL_BITMAP_BYTES);
+    else {
+      memset(bitmap, 0, LABEL_BITMAP_BYTES);
+      if(old != NULL) {
+        uint16_t* old_array = wp_segment_label_block_at(pr, old->offset);
+        for(uint32_t i = 0; i < old->count; i++) BITMAP_SET(bitmap, old_array[i]);
+      }
+    }
+
+    for(uint32_t i = 0; i < n; i++) {
+      if(add) BITMAP_SET(bitmap, LABEL_VAL(delta[i]));
+      else BITMAP_CLEAR(bitmap, LABEL_VAL(delta[i]));
+    }
+    return NO_ERROR;
+  }
+
+  uint16_t* array = wp_segment_label_block_at(pr, c->offset);
+  uint32_t w = 0, d = 0;
+  if((old != NULL) && (old->type == LABEL_CONTAINER_BITMAP)) { // only when removing
+    uint64_t* old_bitmap = wp_segment_label_block_at(pr, old->offset);
+    for(uint32_t word = 0; word < 65536 / 64; word++) {
+      for(uint64_t bits = old_bitmap[word]; bits != 0; bits &= bits - 1) {
+        uint16_t val = (uint16_t)(word * 64 + (uint32_t)__builtin_ctzll(bits));
+        while((d < n) && (LABEL_VAL(delta[d]) < val)) d++;
+        if((d < n) && (LABEL_VAL(delta[d]) == val)) continue;
+        array[w++] = val;
+      }
+    }
+    return NO_ERROR;
+  }
+
+  // merge (or filter) the old array
+  uint16_t* old_array = (old == NULL) ? NULL : wp_segment_label_block_at(pr, old->offset);
+  uint32_t old_count = (old == NULL) ? 0 : old->count;
+  for(uint32_t i = 0; i < old_count; i++) {
+    uint16_t val = old_array[i];
+    while((d < n) && (LABEL_VAL(delta[d]) < val)) {
+      if(add) array[w++] = LABEL_VAL(delta[d]);
+      d++;
+    }
+    if(!add && (d < n) && (LABEL_VAL(delta[d]) == val)) continue;
+    array[w++] = val;
+  }
+  if(add) while(d < n) array[w++] = LABEL_VAL(delta[d++]);
+
+  return NO_ERROR;
+}
+
+// publish a new version of a label's directory, with the container for c's
+// key replaced by c, or dropped if c is NULL. the old directory and container
+// go into the pending log.
+RAISING_STATIC(label_directory_replace(wp_segment* s, posting_list_header* plh, uint16_t key, label_container* c)) {
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  offset_t old_offset = plh->next_offset;
+  uint32_t num_old = 0, idx = 0, present = 0;
+  if(old_offset != OFFSET_NONE) {
+    label_directory* dir = wp_segment_label_block_at(pr, old_offset);
+    num_old = dir->num_containers;
+    idx = label_directory_search(dir, key);
+    present = (idx < num_old) && (dir->containers[idx].key == key);
+  }
+
+  uint32_t num_new = num_old - present + (c != NULL);
+  offset_t new_offset = OFFSET_NONE;
+  if(num_new > 0) {
+    uint8_t size_class = label_size_class(sizeof(label_directory) + num_new * sizeof(label_container));
+    RELAY_ERROR(label_block_alloc(s, size_class, &new_offset));
+    pr = MMAP_OBJ(s->labels, postings_region);
+
+    label_directory* new_dir = wp_segment_label_block_at(pr, new_offset);
+    new_dir->num_containers = num_new;
+    new_dir->size_class = size_class;
+    if(old_offset != OFFSET_NONE) {
+      label_directory* dir = wp_segment_label_block_at(pr, old_offset);
+      memcpy(new_dir->containers, dir->containers, idx * sizeof(label_container));
+      memcpy(&new_dir->containers[idx + (c != NULL)], &dir->containers[idx + present], (num_old - idx - present) * sizeof(label_container));
+    }
+    if(c != NULL) new_dir->containers[idx] = *c;
+  }
+
+  // everything the new version points at has been written, so it can go live
+  __atomic_store_n(&plh->next_offset, new_offset, __ATOMIC_RELEASE);
+
+  if(old_offset != OFFSET_NONE) {
+    label_directory* dir = wp_segment_label_block_at(pr, old_offset);
+    uint8_t size_class = dir->size_class;
+    if(present) {
+      label_container old = dir->containers[idx];
+      RELAY_ERROR(label_block_retire(s, old.size_class, old.offset));
+    }
+    RELAY_ERROR(label_block_retire(s, size_class, old_offset));
+  }
+
+  return NO_ERROR;
+}
+
+// add a run of n docids, in ascending order and all with the same key, to a
+// label. this is a single merge into a new copy of the run's container. the
+// docids that weren't there already are copied into added, and num_added is
+// set to how many of them there were.
+RAISING_STATIC(label_bitmap_add_run(wp_segment* s, posting_list_header* plh, uint32_t n, docid_t* doc_ids, uint32_t* num_added, docid_t* added)) {
+  uint16_t key = LABEL_KEY(doc_ids[0]);
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  label_container old;
+  int present = label_container_find(pr, plh, key, &old);
+
+  // first find the docids that aren't there already
+  *num_added = 0;
+  if(present && (old.type == LABEL_CONTAINER_BITMAP)) {
+    uint64_t* bitmap = wp_segment_label_block_at(pr, old.offset);
+    for(uint32_t i = 0; i < n; i++) {
+      if(BITMAP_TEST(bitmap, LABEL_VAL(doc_ids[i]))) continue;
+      if((*num_added > 0) && (added[*num_added - 1] == doc_ids[i])) continue; // repeated in the input
+      added[(*num_added)++] = doc_ids[i];
+    }
+  }
+  else {
+    uint16_t* array = present ? wp_segment_label_block_at(pr, old.offset) : NULL;
+    uint32_t count = present ? old.count : 0;
+    uint32_t j = 0;
+    for(uint32_t i = 0; i < n; i++) {
+      uint16_t val = LABEL_VAL(doc_ids[i]);
+      while((j < count) && (array[j] < val)) j++;
+      if((j < count) && (array[j] == val)) continue;
+      if((*num_added > 0) && (added[*num_added - 1] == doc_ids[i])) continue; // repeated in the input
+      added[(*num_added)++] = doc_ids[i];
+    }
+  }
+  if(*num_added == 0) return NO_ERROR;
+
+  label_container c;
+  c.key = key;
+  c.count = (present ? old.count : 0) + *num_added;
+  c.type = ((present && (old.type == LABEL_CONTAINER_BITMAP)) || (c.count > LABEL_ARRAY_MAX_SIZE)) ? LABEL_CONTAINER_BITMAP : LABEL_CONTAINER_ARRAY;
+  RELAY_ERROR(label_container_write(s, &c, present ? &old : NULL, *num_added, added, 1));
+  RELAY_ERROR(label_directory_replace(s, plh, key, &c));
+
+  return NO_ERROR;
+}
+
+// remove a run of n docids, in ascending order and all with the same key,
+// from a label. the docids that were there are copied into removed, and
+// num_removed is set to how many of them there were.
+RAISING_STATIC(label_bitmap_remove_run(wp_segment* s, posting_list_header* plh, uint32_t n, docid_t* doc_ids, uint32_t* num_removed, docid_t* removed)) {
+  uint16_t key = LABEL_KEY(doc_ids[0]);
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  label_container old;
+
+  *num_removed = 0;
+  if(!label_container_find(pr, plh, key, &old)) return NO_ERROR;
+
+  if(old.type == LABEL_CONTAINER_BITMAP) {
+    uint64_t* bitmap = wp_segment_label_block_at(pr, old.offset);
+    for(uint32_t i = 0; i < n; i++) {
+      if(!BITMAP_TEST(bitmap, LABEL_VAL(doc_ids[i]))) continue;
+      if((*num_removed > 0) && (removed[*num_removed - 1] == doc_ids[i])) continue; // repeated in the input
+      removed[(*num_removed)++] = doc_ids[i];
+    }
+  }
+  else {
+    uint16_t* array = wp_segment_label_block_at(pr, old.offset);
+    uint32_t i = 0;
+    for(uint32_t j = 0; j < old.count; j++) {
+      while((i < n) && (LABEL_VAL(doc_ids[i]) < array[j])) i++;
+      if((i < n) && (LABEL_VAL(doc_ids[i]) == array[j])) removed[(*num_removed)++] = ((docid_t)key << 16) | array[j];
+    }
+  }
+  if(*num_removed == 0) return NO_ERROR;
+
+  // drop the container once it's empty
+  if(*num_removed == old.count) {
+    RELAY_ERROR(label_directory_replace(s, plh, key, NULL));
+    return NO_ERROR;
+  }
+
+  // once a bitmap is well under the array limit, turn it back into an array.
+  // (not right at the limit, so that a docid going back and forth doesn't
+  // convert it every time.)
+  label_container c = old;
+  c.count -= *num_removed;
+  if(c.count <= LABEL_ARRAY_MAX_SIZE / 2) c.type = LABEL_CONTAINER_ARRAY;
+  RELAY_ERROR(label_container_write(s, &c, &old, *num_removed, removed, 0));
+  RELAY_ERROR(label_directory_replace(s, plh, key, &c));
+
+  return NO_ERROR;
+}
+
+/* the forward label store maps each doc to the ids of its labels, so that
+   the labels on a doc can be listed without probing every label. the ids
+   live in blocks in the labels region, in sorted order, and the doc_labels
+   table points to them. like the label bitmaps, a doc's block is replaced
+   rather than changed in place. */
+
+typedef struct doc_label_ids {
+  uint16_t count;
+  uint8_t size_class; // of the block holding this
+  uint32_t ids[];
+} doc_label_ids;
+
+// publish a new version of a doc's label ids, and retire the old one
+RAISING_STATIC(doc_labels_replace(wp_segment* s, docid_t doc_id, offset_t new_offset)) {
+  doc_labels* dl = MMAP_OBJ(s->doc_labels, doc_labels);
+  offset_t old_offset = dl->offsets[doc_id];
+  __atomic_store_n(&dl->offsets[doc_id], new_offset, __ATOMIC_RELEASE);
+
+  if(old_offset != OFFSET_NONE) {
+    doc_label_ids* dli = wp_segment_label_block_at(MMAP_OBJ(s->labels, postings_region), old_offset);
+    RELAY_ERROR(label_block_retire(s, dli->size_class, old_offset));
+  }
+
+  return NO_ERROR;
+}
+
+RAISING_STATIC(doc_labels_add(wp_segment* s, docid_t doc_id, uint32_t label_s)) {
+  doc_labels* dl = MMAP_OBJ(s->doc_labels, doc_labels);
+
+  if(doc_id >= dl->num_slots) { // make room in the table
+    uint32_t old_num_slots = dl->num_slots;
+    uint32_t num_slots = old_num_slots;
+    while(num_slots <= doc_id) num_slots *= 2;
+    DEBUG("growing forward label store from %u to %u docs", old_num_slots, num_slots);
+    RELAY_ERROR(mmap_obj_resize(&s->doc_labels, sizeof(doc_labels) + (uint64_t)num_slots * sizeof(offset_t)));
+    dl = MMAP_OBJ(s->doc_labels, doc_labels);
+    for(uint32_t i = old_num_slots; i < num_slots; i++) dl->offsets[i] = OFFSET_NONE;
+    __atomic_store_n(&dl->num_slots, num_slots, __ATOMIC_RELEASE);
+  }
+
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  uint32_t count = 0;
+  if(dl->offsets[doc_id] != OFFSET_NONE) {
+    count = ((doc_label_ids*)wp_segment_label_block_at(pr, dl->offsets[doc_id]))->count;
+    if(count == UINT16_MAX) RAISE_ERROR("doc %u has too many labels", doc_id);
+  }
+
+  offset_t new_offset;
+  uint8_t size_class = label_size_class(sizeof(doc_label_ids) + (count + 1) * sizeof(uint32_t));
+  RELAY_ERROR(label_block_alloc(s, size_class, &new_offset));
+  pr = MMAP_OBJ(s->labels, postings_region);
+
+  doc_label_ids* new_dli = wp_segment_label_block_at(pr, new_offset);
+  new_dli->count = (uint16_t)(count + 1);
+  new_dli->size_class = size_class;
+  uint32_t i = 0;
+  if(count > 0) {
+    doc_label_ids* dli = wp_segment_label_block_at(pr, dl->offsets[doc_id]);
+    for(; (i < count) && (dli->ids[i] < label_s); i++) new_dli->ids[i] = dli->ids[i];
+    memcpy(&new_dli->ids[i + 1], &dli->ids[i], (count - i) * sizeof(uint32_t));
+  }
+  new_dli->ids[i] = label_s;
+
+  RELAY_ERROR(doc_labels_replace(s, doc_id, new_offset));
+  return NO_ERROR;
+}
+
+RAISING_STATIC(doc_labels_remove(wp_segment* s, docid_t doc_id, uint32_t label_s)) {
+  doc_labels* dl = MMAP_OBJ(s->doc_labels, doc_labels);
+  if((doc_id >= dl->num_slots) || (dl->offsets[doc_id] == OFFSET_NONE)) return NO_ERROR;
 
   postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  doc_label_ids* dli = wp_segment_label_block_at(pr, dl->offsets[doc_id]);
+  uint32_t count = dli->count;
+
+  uint32_t i = 0;
+  while((i < count) && (dli->ids[i] != label_s)) i++;
+  if(i == count) return NO_ERROR;
+
+  offset_t new_offset = OFFSET_NONE;
+  if(count > 1) {
+    uint8_t size_class = label_size_class(sizeof(doc_label_ids) + (count - 1) * sizeof(uint32_t));
+    RELAY_ERROR(label_block_alloc(s, size_class, &new_offset));
+    pr = MMAP_OBJ(s->labels, postings_region);
+    dli = wp_segment_label_block_at(pr, dl->offsets[doc_id]);
+
+    doc_label_ids* new_dli = wp_segment_label_block_at(pr, new_offset);
+    new_dli->count = (uint16_t)(count - 1);
+    new_dli->size_class = size_class;
+    memcpy(new_dli->ids, dli->ids, i * sizeof(uint32_t));
+    memcpy(&new_dli->ids[i], &dli->ids[i + 1], (count - i - 1) * sizeof(uint32_t));
+  }
+
+  RELAY_ERROR(doc_labels_replace(s, doc_id, new_offset));
+  return NO_ERROR;
+}
+
+/* searches may be reading while a label writer changes things, so the
+   readers load the published offsets atomically, and then check whether the
+   writer (perhaps in another process) has grown the files past what they
+   have mapped. */
+
+wp_error* wp_segment_get_doc_labels(wp_segment* s, docid_t doc_id, uint32_t max_labels, uint32_t* num_labels, uint32_t* label_ids) {
+  *num_labels = 0;
+  if(doc_id >= __atomic_load_n(&MMAP_OBJ(s->doc_labels, doc_labels)->num_slots, __ATOMIC_ACQUIRE)) return NO_ERROR;
+  RELAY_ERROR(mmap_obj_reload(&s->doc_labels));
+
+  offset_t offset = __atomic_load_n(&MMAP_OBJ(s->doc_labels, doc_labels)->offsets[doc_id], __ATOMIC_ACQUIRE);
+  if(offset == OFFSET_NONE) return NO_ERROR;
+  RELAY_ERROR(mmap_obj_reload(&s->labels));
+
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  doc_label_ids* dli = wp_segment_label_block_at(pr, offset);
+  *num_labels = dli->count;
+  for(uint32_t i = 0; (i < dli->count) && (i < max_labels); i++) label_ids[i] = dli->ids[i];
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_read_label(wp_segment* s, uint32_t label_s, docid_t doc_id, posting* po) {
+  termhash* th = MMAP_OBJ(s->termhash, termhash);
+
+  po->doc_id = DOCID_NONE;
+  po->next_offset = OFFSET_NONE;
+  po->num_positions = 0;
+  po->positions = NULL;
+
+  if(doc_id == DOCID_NONE) return NO_ERROR;
+
+  term t;
+  t.field_s = 0; // label sentinel value
+  t.word_s = label_s;
+  posting_list_header* plh = termhash_get_val(th, t);
+  if(plh == NULL) return NO_ERROR;
+
+  offset_t dir_offset = __atomic_load_n(&plh->next_offset, __ATOMIC_ACQUIRE);
+  if(dir_offset == OFFSET_NONE) return NO_ERROR;
+  RELAY_ERROR(mmap_obj_reload(&s->labels));
+
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  label_directory* dir = wp_segment_label_block_at(pr, dir_offset);
+  uint16_t key = (uint16_t)(doc_id >> 16);
+  uint32_t val = doc_id & 0xffff;
+
+  // the container for this key, if there is one, and then the one before
+  // it. containers are never empty, so we don't need to look any further.
+  uint32_t idx = label_directory_search(dir, key);
+  if((idx == dir->num_containers) || (dir->containers[idx].key != key)) val = 0xffff; // any value in an earlier container will do
+  else idx++;
+
+  while(idx > 0) {
+    idx--;
+    label_container* c = &dir->containers[idx];
+    uint16_t found;
+    if(label_container_at_most(pr, c, val, &found)) {
+      po->doc_id = ((docid_t)c->key << 16) | found;
+      return NO_ERROR;
+    }
+    val = 0xffff;
+  }
+
+  return NO_ERROR;
+}
+
+// has this label ever been used in this segment?
+static int label_known(wp_segment* s, const char* label) {
+  term t;
+  t.field_s = 0; // label sentinel value
+  t.word_s = stringmap_string_to_int(MMAP_OBJ(s->stringmap, stringmap), MMAP_OBJ(s->stringpool, stringpool), label);
+  return (t.word_s != (uint32_t)-1) && (termhash_get_val(MMAP_OBJ(s->termhash, termhash), t) != NULL);
+}
+
+/* label writers take the label lock, which keeps them out of each other's
+   way, and then as weak a hold on the segment lock as they can get away
+   with. if nothing else holds it, they take the write lock, and use the
+   chance to reclaim the pending log. otherwise they take a read lock, and
+   searches carry on alongside them. the exception is a label that this
+   segment hasn't seen before, which needs new entries in the term hash, and
+   so the write lock. */
+
+wp_error* wp_segment_grab_label_lock(wp_segment* seg, const char* label) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  RELAY_ERROR(wp_lock_grab(&si->label_lock, WP_LOCK_WRITELOCK));
+
+  int acquired;
+  RELAY_ERROR(wp_lock_try(&si->lock, WP_LOCK_WRITELOCK, &acquired));
+  if(!acquired) {
+    RELAY_ERROR(wp_lock_grab(&si->lock, WP_LOCK_READLOCK));
+    RELAY_ERROR(wp_segment_reload(seg));
+    if(label_known(seg, label)) {
+      seg->shared_labels = 1;
+      return NO_ERROR;
+    }
+
+    DEBUG("label %s is new to this segment; waiting for the write lock", label);
+    RELAY_ERROR(wp_lock_release(&si->lock));
+    RELAY_ERROR(wp_lock_grab(&si->lock, WP_LOCK_WRITELOCK));
+  }
+
+  RELAY_ERROR(wp_segment_reload(seg));
+  label_blocks_reclaim(MMAP_OBJ(seg->labels, postings_region));
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_release_label_lock(wp_segment* seg) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+  seg->shared_labels = 0;
+  RELAY_ERROR(wp_lock_release(&si->lock));
+  RELAY_ERROR(wp_lock_release(&si->label_lock));
+  return NO_ERROR;
+}
+
+RAISING_STATIC(check_label_docids(uint32_t num_docs, docid_t* doc_ids)) {
+  for(uint32_t i = 0; i < num_docs; i++) {
+    if(doc_ids[i] == DOCID_NONE) RAISE_ERROR("can't add a label to doc 0");
+    if((i > 0) && (doc_ids[i] < doc_ids[i - 1])) RAISE_ERROR("doc ids must be in ascending order, but %u comes after %u", doc_ids[i], doc_ids[i - 1]);
+  }
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_add_label_to_docs(wp_segment* s, const char* label, uint32_t num_docs, docid_t* doc_ids) {
+  RELAY_ERROR(check_label_docids(num_docs, doc_ids));
+  if(num_docs == 0) return NO_ERROR;
+
+  DEBUG("adding label '%s' to %u docs", label, num_docs);
+
+  // only a new label touches the stringmap and term hash, which is why a
+  // label writer with just the read lock must already know the label
+  if(!label_known(s, label)) {
+    // TODO move this logic up to ensure_fit()
+    int success;
+    RELAY_ERROR(bump_stringmap(s, 0, &success));
+    RELAY_ERROR(bump_stringpool(s, 0, &success));
+    RELAY_ERROR(bump_termhash(s, 0, &success));
+  }
+
+  stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
+  termhash* th = MMAP_OBJ(s->termhash, termhash);
+  stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
+
+  // construct the term object. term objects for labels have the special
+  // sentinel field value 0
+  term t;
+  t.field_s = 0; // label sentinel value
+  RELAY_ERROR(stringmap_add(sh, sp, label, &t.word_s)); // get word key
+
+  posting_list_header* plh = termhash_get_val(th, t);
+  if(plh == NULL) {
+    RELAY_ERROR(termhash_put_val(th, t, &blank_plh));
+    plh = termhash_get_val(th, t);
+  }
+
+  // merge the docids in one container's worth at a time
+  docid_t* added = malloc(sizeof(docid_t) * num_docs);
+  wp_error* e = NO_ERROR;
+  for(uint32_t i = 0; (e == NO_ERROR) && (i < num_docs); ) {
+    uint32_t j = i + 1;
+    while((j < num_docs) && (LABEL_KEY(doc_ids[j]) == LABEL_KEY(doc_ids[i]))) j++;
+
+    uint32_t num_added = 0;
+    e = label_bitmap_add_run(s, plh, j - i, &doc_ids[i], &num_added, added);
+    if(e == NO_ERROR) plh->count += num_added;
+    for(uint32_t k = 0; (e == NO_ERROR) && (k < num_added); k++) e = doc_labels_add(s, added[k], t.word_s);
+    i = j;
+  }
+  free(added);
+  RELAY_ERROR(e);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_remove_label_from_docs(wp_segment* s, const char* label, uint32_t num_docs, docid_t* doc_ids) {
+  RELAY_ERROR(check_label_docids(num_docs, doc_ids));
+
   stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
   termhash* th = MMAP_OBJ(s->termhash, termhash);
   stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
@@ -655,86 +2174,533 @@ wp_error* wp_segment_remove_label(wp_segment* s, const char* label, docid_t doc_
   t.field_s = 0; // label sentinel value
   t.word_s = stringmap_string_to_int(sh, sp, label); // will be -1 if not there
 
-  // find the posting and the previous posting in the list, if any
-  docid_t last_docid = DOCID_NONE;
-  uint32_t prev_offset = OFFSET_NONE;
   posting_list_header* plh = termhash_get_val(th, t);
   if(plh == NULL) {
     DEBUG("no such label %s", label);
     return NO_ERROR;
   }
 
-  uint32_t offset = plh->next_offset;
-  label_posting* lp = NULL;
-  while(offset != OFFSET_NONE) {
-    lp = wp_segment_label_posting_at(pr, offset);
+  docid_t* removed = malloc(sizeof(docid_t) * num_docs);
+  wp_error* e = NO_ERROR;
+  for(uint32_t i = 0; (e == NO_ERROR) && (i < num_docs); ) {
+    uint32_t j = i + 1;
+    while((j < num_docs) && (LABEL_KEY(doc_ids[j]) == LABEL_KEY(doc_ids[i]))) j++;
+
+    uint32_t num_removed = 0;
+    e = label_bitmap_remove_run(s, plh, j - i, &doc_ids[i], &num_removed, removed);
+    if(e == NO_ERROR) plh->count -= num_removed;
+    for(uint32_t k = 0; (e == NO_ERROR) && (k < num_removed); k++) e = doc_labels_remove(s, removed[k], t.word_s);
+    i = j;
+  }
+  free(removed);
+  RELAY_ERROR(e);
 
-    if((last_docid != DOCID_NONE) && (lp->doc_id >= last_docid)) {
-      RAISE_ERROR("whistlepig index corruption! lp %u has docid %u but last docid at lp %u was %u", offset, lp->doc_id, prev_offset, last_docid);
-    }
-    else {
-      last_docid = lp->doc_id;
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_add_label(wp_segment* s, const char* label, docid_t doc_id) {
+  RELAY_ERROR(wp_segment_add_label_to_docs(s, label, 1, &doc_id));
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_remove_label(wp_segment* s, const char* label, docid_t doc_id) {
+  RELAY_ERROR(wp_segment_remove_label_from_docs(s, label, 1, &doc_id));
+  return NO_ERROR;
+}
+
+/* vacuuming rewrites the labels region from scratch: each label's directory
+   followed by its containers in docid order, then each doc's label ids, all
+   in the smallest blocks that fit them. freed and pending blocks are dropped
+   rather than copied, so the free lists and pending log come out empty.
+   blocks never get bigger, so the result is never bigger than the region it
+   replaces. */
+
+// the bytes sitting on the free lists, or in the pending log
+static offset_t label_free_bytes(postings_region* pr) {
+  offset_t* free_lists = wp_segment_label_free_lists(pr);
+  offset_t bytes = 0;
+  for(uint8_t i = 0; i < LABEL_NUM_BLOCK_SIZES; i++) {
+    for(offset_t offset = free_lists[i]; offset != OFFSET_NONE; offset = *(offset_t*)wp_segment_label_block_at(pr, offset)) bytes += LABEL_BLOCK_SIZE(i);
+  }
+
+  for(offset_t offset = wp_segment_label_pending_log(pr); offset != OFFSET_NONE; ) {
+    label_pending_log* log = wp_segment_label_block_at(pr, offset);
+    for(uint32_t i = 0; i < log->count; i++) bytes += LABEL_BLOCK_SIZE(LABEL_PENDING_SIZE_CLASS(log->entries[i]));
+    bytes += LABEL_BLOCK_SIZE(LABEL_PENDING_LOG_SIZE_CLASS);
+    offset = log->next;
+  }
+  return bytes;
+}
+
+// copy bytes from src into a new block at the head of a region being
+// vacuumed into, returning its offset
+static offset_t vacuum_copy_block(postings_region* to, const void* src, offset_t bytes, uint8_t size_class) {
+  offset_t offset = to->postings_head;
+  memcpy(wp_segment_label_block_at(to, offset), src, bytes);
+  to->postings_head += LABEL_BLOCK_SIZE(size_class);
+  return offset;
+}
+
+wp_error* wp_segment_vacuum_labels(wp_segment* s) {
+  postings_region* pr = MMAP_OBJ(s->labels, postings_region);
+  termhash* th = MMAP_OBJ(s->termhash, termhash);
+  term* keys = TERMHASH_KEYS(th);
+  posting_list_header* vals = TERMHASH_VALS(th);
+  doc_labels* dl = MMAP_OBJ(s->doc_labels, doc_labels);
+
+  DEBUG("vacuuming labels region of %s: %" PRIu64 " bytes, %" PRIu64 " of them free", s->pathname_base, pr->postings_head, label_free_bytes(pr));
+
+  // build the new region on the side, along with the new offsets for
+  // everything that points into it, so that nothing changes until the end
+  postings_region* vpr = calloc(1, sizeof(postings_region) + pr->postings_head);
+  if(vpr == NULL) RAISE_ERROR("oom: can't vacuum %" PRIu64 " bytes of labels", pr->postings_head);
+  postings_region_init(vpr, pr->postings_head, POSTINGS_REGION_TYPE_LABEL_BITMAPS);
+  labels_region_init(vpr);
+  vpr->num_postings = pr->num_postings;
+  offset_t* label_offsets = malloc(sizeof(offset_t) * th->n_buckets);
+  offset_t* doc_offsets = malloc(sizeof(offset_t) * dl->num_slots);
+
+  for(uint32_t i = 0; i < th->n_buckets; i++) {
+    if(!termhash_slot_used(th, i) || (keys[i].field_s != 0) || (vals[i].next_offset == OFFSET_NONE)) continue;
+
+    label_directory* dir = wp_segment_label_block_at(pr, vals[i].next_offset);
+    offset_t dir_bytes = sizeof(label_directory) + dir->num_containers * sizeof(label_container);
+    uint8_t dir_size_class = label_size_class(dir_bytes);
+    label_offsets[i] = vacuum_copy_block(vpr, dir, dir_bytes, dir_size_class);
+
+    label_directory* vdir = wp_segment_label_block_at(vpr, label_offsets[i]);
+    vdir->size_class = dir_size_class;
+    for(uint32_t j = 0; j < vdir->num_containers; j++) {
+      label_container* c = &vdir->containers[j];
+      offset_t bytes = c->type == LABEL_CONTAINER_BITMAP ? LABEL_BITMAP_BYTES : c->count * sizeof(uint16_t);
+      c->size_class = label_size_class(bytes);
+      c->offset = vacuum_copy_block(vpr, wp_segment_label_block_at(pr, c->offset), bytes, c->size_class);
     }
+  }
 
-    if(lp->doc_id < doc_id) offset = OFFSET_NONE; // nasty hack to induce failure
-    if(lp->doc_id <= doc_id) break;
-    prev_offset = offset;
-    offset = lp->next_offset;
+  for(uint32_t i = 0; i < dl->num_slots; i++) {
+    if(dl->offsets[i] == OFFSET_NONE) continue;
+
+    doc_label_ids* dli = wp_segment_label_block_at(pr, dl->offsets[i]);
+    offset_t bytes = sizeof(doc_label_ids) + dli->count * sizeof(uint32_t);
+    uint8_t size_class = label_size_class(bytes);
+    doc_offsets[i] = vacuum_copy_block(vpr, dli, bytes, size_class);
+    ((doc_label_ids*)wp_segment_label_block_at(vpr, doc_offsets[i]))->size_class = size_class;
   }
 
-  DEBUG("found label posting for doc %u at offset %u; prev_offset is %u", doc_id, offset, prev_offset);
+  // swap it in. the region shrinks to fit, and other processes will pick up
+  // the new size when they reload.
+  offset_t tail = vpr->postings_head > INITIAL_POSTINGS_SIZE ? vpr->postings_head : INITIAL_POSTINGS_SIZE;
+  vpr->postings_tail = tail;
+  DEBUG("labels region of %s vacuumed from %" PRIu64 " to %" PRIu64 " bytes", s->pathname_base, pr->postings_head, vpr->postings_head);
+  RELAY_ERROR(mmap_obj_resize(&s->labels, sizeof(postings_region) + tail));
+  memcpy(MMAP_OBJ(s->labels, postings_region), vpr, sizeof(postings_region) + vpr->postings_head);
 
-  if(offset == OFFSET_NONE) {
-    DEBUG("no label %s found for doc %u", label, doc_id);
-    return NO_ERROR;
+  for(uint32_t i = 0; i < th->n_buckets; i++) {
+    if(termhash_slot_used(th, i) && (keys[i].field_s == 0) && (vals[i].next_offset != OFFSET_NONE)) vals[i].next_offset = label_offsets[i];
+  }
+  for(uint32_t i = 0; i < dl->num_slots; i++) {
+    if(dl->offsets[i] != OFFSET_NONE) dl->offsets[i] = doc_offsets[i];
   }
 
-  // we've found the posting; now remove it from the list
-  if(prev_offset == OFFSET_NONE) plh->next_offset = lp->next_offset;
-  else wp_segment_label_posting_at(pr, prev_offset)->next_offset = lp->next_offset;
-  plh->count--;
+  free(doc_offsets);
+  free(label_offsets);
+  free(vpr);
 
-  // now add it to the dead list for later reclamation
-  posting_list_header* dead_plh = termhash_get_val(th, dead_term);
-  if(dead_plh == NULL) {
-    RELAY_ERROR(termhash_put_val(th, dead_term, &blank_plh));
-    dead_plh = termhash_get_val(th, t);
+  return NO_ERROR;
+}
+
+/* deletion just sets a bit in the tombstones bitmap, which searches check
+   before returning a doc. the bitmap only grows as far as the largest deleted
+   docid. */
+
+int wp_segment_is_deleted(wp_segment* s, docid_t doc_id) {
+  tombstones* ts = MMAP_OBJ(s->tombstones, tombstones);
+  return (doc_id < ts->num_slots) && BITMAP_TEST(ts->bits, doc_id);
+}
+
+uint64_t wp_segment_num_deleted(wp_segment* s) {
+  tombstones* ts = MMAP_OBJ(s->tombstones, tombstones);
+  return ts->num_deleted;
+}
+
+wp_error* wp_segment_delete_doc(wp_segment* s, docid_t doc_id) {
+  segment_info* si = MMAP_OBJ(s->seginfo, segment_info);
+  if((doc_id == DOCID_NONE) || (doc_id > si->num_docs)) RAISE_ERROR("can't delete nonexistent doc %u", doc_id);
+  if(wp_segment_is_deleted(s, doc_id)) return NO_ERROR;
+
+  tombstones* ts = MMAP_OBJ(s->tombstones, tombstones);
+  if(doc_id >= ts->num_slots) { // make room
+    uint32_t old_num_slots = ts->num_slots;
+    uint32_t num_slots = old_num_slots;
+    while(num_slots <= doc_id) num_slots *= 2;
+    DEBUG("growing tombstones from %u to %u docs", old_num_slots, num_slots);
+    RELAY_ERROR(mmap_obj_resize(&s->tombstones, sizeof(tombstones) + num_slots / 8));
+    ts = MMAP_OBJ(s->tombstones, tombstones);
+    memset((uint8_t*)ts->bits + old_num_slots / 8, 0, (num_slots - old_num_slots) / 8);
+    ts->num_slots = num_slots;
   }
 
-  DEBUG("adding dead label posting %u to head of deadlist with next_offset %u", offset, lp->next_offset);
+  // strip its labels first, so that they don't take up space or show up in
+  // label counts
+  uint32_t num_labels, label_id;
+  RELAY_ERROR(wp_segment_get_doc_labels(s, doc_id, 1, &num_labels, &label_id));
+  while(num_labels > 0) {
+    const char* label = stringmap_int_to_string(MMAP_OBJ(s->stringmap, stringmap), MMAP_OBJ(s->stringpool, stringpool), label_id);
+    RELAY_ERROR(wp_segment_remove_label(s, label, doc_id));
+    RELAY_ERROR(wp_segment_get_doc_labels(s, doc_id, 1, &num_labels, &label_id));
+  }
 
-  uint32_t dead_offset = dead_plh->next_offset;
-  lp->next_offset = dead_offset;
-  dead_plh->next_offset = offset;
+  ts = MMAP_OBJ(s->tombstones, tombstones);
+  BITMAP_SET(ts->bits, doc_id);
+  ts->num_deleted++;
 
   return NO_ERROR;
 }
 
+wp_error* wp_segment_set_key(wp_segment* s, const char* key, docid_t doc_id) {
+  segment_info* si = MMAP_OBJ(s->seginfo, segment_info);
+  if((doc_id == DOCID_NONE) || (doc_id > si->num_docs)) RAISE_ERROR("can't set key '%s' on nonexistent doc %u", key, doc_id);
+
+  stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
+  termhash* th = MMAP_OBJ(s->termhash, termhash);
+  stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
+
+  term t;
+  t.field_s = WP_KEY_FIELD;
+  RELAY_ERROR(stringmap_add(sh, sp, key, &t.word_s));
+
+  posting_list_header plh = blank_plh;
+  plh.next_offset = doc_id;
+  RELAY_ERROR(termhash_put_val(th, t, &plh));
+  DEBUG("set key '%s' to doc %u", key, doc_id);
+
+  return NO_ERROR;
+}
+
+docid_t wp_segment_lookup_key(wp_segment* s, const char* key) {
+  stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
+  termhash* th = MMAP_OBJ(s->termhash, termhash);
+  stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
+
+  term t;
+  t.field_s = WP_KEY_FIELD;
+  t.word_s = stringmap_string_to_int(sh, sp, key); // will be -1 if not there
+  if(t.word_s == (uint32_t)-1) return DOCID_NONE;
+
+  posting_list_header* plh = termhash_get_val(th, t);
+  return plh == NULL ? DOCID_NONE : (docid_t)plh->next_offset;
+}
+
 wp_error* wp_segment_grab_docid(wp_segment* segment, docid_t* doc_id) {
   segment_info* si = MMAP_OBJ(segment->seginfo, segment_info);
   *doc_id = ++si->num_docs;
   return NO_ERROR;
 }
 
+/* appending segments
+
+   to merge segments, each one's docs are copied in turn onto the end of a
+   new segment, renumbered to follow the docs already there. posting lists
+   are read newest first, so each term's postings are gathered up before
+   being added in docid order. the postings of deleted docs are left behind,
+   but their docids aren't reused, so the docs after them keep their places.
+
+   a sealed segment's postings never change, but its labels and deletions
+   can. so those are copied separately, by wp_segment_append_labels, once the
+   caller has made sure nothing else can change them. */
+
+typedef struct appended_posting {
+  docid_t doc_id;
+  uint32_t num_positions;
+  pos_t* positions;
+} appended_posting;
+
+// reads the postings of a term, except those of deleted docs, into ps, which
+// has room for plh->count of them, newest first. n is kept up to date as we
+// go, and buf is scratch space for positions, so that the caller can clean
+// up if we raise.
+RAISING_STATIC(read_postings_into(wp_segment* s, posting_list_header* plh, appended_posting* ps, uint32_t* n, pos_t** buf, uint32_t* buf_size)) {
+  posting po;
+
+  if(plh->next_offset == OFFSET_NONE) {
+    // no postings
+  }
+  else if(plh->dense) {
+    RELAY_ERROR(wp_segment_read_dense_posting(s, plh->next_offset, plh->options, MAX_LOGICAL_DOCID, &po));
+    while(po.doc_id != DOCID_NONE) {
+      if(!wp_segment_is_deleted(s, po.doc_id)) {
+        if(*n >= plh->count) RAISE_ERROR("posting list has more than its %u postings", plh->count);
+        ps[*n].positions = NULL;
+        if(plh->options == WP_FIELD_POSITIONS) {
+          RELAY_ERROR(wp_segment_read_positions(s, &po, buf, buf_size));
+          ps[*n].positions = malloc(sizeof(pos_t) * po.num_positions);
+          memcpy(ps[*n].positions, po.positions, sizeof(pos_t) * po.num_positions);
+        }
+        ps[*n].doc_id = po.doc_id;
+        ps[*n].num_positions = po.num_positions;
+        (*n)++;
+      }
+      RELAY_ERROR(wp_segment_read_dense_posting(s, plh->next_offset, plh->options, po.doc_id - 1, &po));
+    }
+  }
+  else {
+    for(offset_t offset = plh->next_offset; offset != OFFSET_NONE; offset = po.next_offset) {
+      RELAY_ERROR(wp_segment_read_posting(s, offset, plh->options, &po, 1));
+      if(wp_segment_is_deleted(s, po.doc_id)) free(po.positions);
+      else {
+        if(*n >= plh->count) {
+          free(po.positions);
+          RAISE_ERROR("posting list has more than its %u postings", plh->count);
+        }
+        ps[*n].doc_id = po.doc_id;
+        ps[*n].num_positions = po.num_positions;
+        ps[*n].positions = po.positions;
+        (*n)++;
+      }
+    }
+  }
+
+  return NO_ERROR;
+}
+
+static void free_appended_postings(uint32_t num_postings, appended_posting* postings) {
+  for(uint32_t i = 0; i < num_postings; i++) free(postings[i].positions);
+  free(postings);
+}
+
+// reads the postings of a term, except those of deleted docs, into a
+// malloc'd array in ascending docid order
+RAISING_STATIC(read_all_postings(wp_segment* s, posting_list_header* plh, uint32_t* num_postings, appended_posting** postings)) {
+  appended_posting* ps = malloc(sizeof(appended_posting) * (plh->count > 0 ? plh->count : 1));
+  uint32_t n = 0, buf_size = 0;
+  pos_t* buf = NULL;
+
+  wp_error* e = read_postings_into(s, plh, ps, &n, &buf, &buf_size);
+  free(buf);
+  if(e != NULL) {
+    free_appended_postings(n, ps);
+    RELAY_ERROR(e);
+  }
+
+  for(uint32_t i = 0; i < n / 2; i++) {
+    appended_posting tmp = ps[i];
+    ps[i] = ps[n - 1 - i];
+    ps[n - 1 - i] = tmp;
+  }
+
+  *num_postings = n;
+  *postings = ps;
+  return NO_ERROR;
+}
+
+// the posting list header of field:word, or NULL if there isn't one yet
+static posting_list_header* find_plh(wp_segment* s, const char* field, const char* word) {
+  stringmap* sh = MMAP_OBJ(s->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(s->stringpool, stringpool);
+
+  term t;
+  t.field_s = stringmap_string_to_int(sh, sp, field);
+  t.word_s = stringmap_string_to_int(sh, sp, word);
+  if((t.field_s == (uint32_t)-1) || (t.word_s == (uint32_t)-1)) return NULL;
+  return termhash_get_val(MMAP_OBJ(s->termhash, termhash), t);
+}
+
+// adds postings to field:word in dest, which encodes them with the options
+// of its own posting list for the term, if it has one
+RAISING_STATIC(add_appended_postings(wp_segment* dest, const char* field, const char* word, uint32_t options, uint32_t num_postings, appended_posting* postings, docid_t doc_offset, int* success)) {
+  for(uint32_t i = 0; (i < num_postings) && *success; i++) {
+    appended_posting* ap = &postings[i];
+    segment_growth growth;
+    memset(&growth, 0, sizeof(growth));
+    RELAY_ERROR(sizeof_posting(dest, field, word, options, ap->num_positions, ap->positions, &growth));
+    RELAY_ERROR(wp_segment_ensure_fit(dest, &growth, success));
+    if(!*success) break;
+
+    // WP_FIELD_DOCS_ONLY postings don't know how many positions they had
+    RELAY_ERROR(add_posting(dest, field, word, options, doc_offset + ap->doc_id, ap->num_positions > 0 ? ap->num_positions : 1, ap->positions));
+  }
+
+  return NO_ERROR;
+}
+
+// a field's options can change between segments, so the same term can be
+// stored with more in one than in another. the merged segment keeps the
+// least any of them has (the WP_FIELD_* values go from most to least),
+// which means rewriting what dest has so far if src has less. the postings
+// left behind are dropped when dest is sealed.
+RAISING_STATIC(append_term(wp_segment* dest, wp_segment* src, const char* field, const char* word, posting_list_header* plh, docid_t doc_offset, int* success)) {
+  posting_list_header* dest_plh = find_plh(dest, field, word);
+  uint32_t num_postings = 0;
+  appended_posting* postings = NULL;
+  wp_error* e;
+
+  if((dest_plh != NULL) && (dest_plh->options < plh->options)) {
+    DEBUG("rewriting %s:%s with options %u rather than %u", field, word, plh->options, dest_plh->options);
+    RELAY_ERROR(read_all_postings(dest, dest_plh, &num_postings, &postings));
+    MMAP_OBJ(dest->postings, postings_region)->num_postings -= dest_plh->count; // the ones left behind
+    *dest_plh = blank_plh;
+    dest_plh->options = plh->options;
+    e = add_appended_postings(dest, field, word, plh->options, num_postings, postings, 0, success);
+    free_appended_postings(num_postings, postings);
+    RELAY_ERROR(e);
+    if(!*success) return NO_ERROR;
+  }
+
+  RELAY_ERROR(read_all_postings(src, plh, &num_postings, &postings));
+  e = add_appended_postings(dest, field, word, plh->options, num_postings, postings, doc_offset, success);
+  free_appended_postings(num_postings, postings);
+  RELAY_ERROR(e);
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_append_postings(wp_segment* dest, wp_segment* src, int* success) {
+  segment_info* destsi = MMAP_OBJ(dest->seginfo, segment_info);
+  segment_info* srcsi = MMAP_OBJ(src->seginfo, segment_info);
+  stringmap* sh = MMAP_OBJ(src->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(src->stringpool, stringpool);
+  termhash* th = MMAP_OBJ(src->termhash, termhash);
+  term* keys = TERMHASH_KEYS(th);
+  posting_list_header* vals = TERMHASH_VALS(th);
+
+  if(wp_segment_is_sealed(dest)) RAISE_ERROR("can't append to a sealed segment");
+
+  *success = 1;
+  docid_t doc_offset = destsi->num_docs;
+  if((uint64_t)doc_offset + srcsi->num_docs > MAX_LOGICAL_DOCID) {
+    *success = 0;
+    return NO_ERROR;
+  }
+  destsi->num_docs += srcsi->num_docs;
+  DEBUG("appending %u docs from %s to %s after doc %u", srcsi->num_docs, src->pathname_base, dest->pathname_base, doc_offset);
+
+  for(uint32_t i = 0; (i < th->n_buckets) && *success; i++) {
+    if(!termhash_slot_used(th, i) || (keys[i].field_s == 0)) continue; // labels come later
+    const char* word = stringmap_int_to_string(sh, sp, keys[i].word_s);
+
+    if(keys[i].field_s == WP_KEY_FIELD) {
+      segment_growth growth;
+      memset(&growth, 0, sizeof(growth));
+      RELAY_ERROR(wp_segment_sizeof_key(dest, word, &growth));
+      RELAY_ERROR(wp_segment_ensure_fit(dest, &growth, success));
+      if(*success) RELAY_ERROR(wp_segment_set_key(dest, word, doc_offset + (docid_t)vals[i].next_offset));
+    }
+    else {
+      const char* field = stringmap_int_to_string(sh, sp, keys[i].field_s);
+      RELAY_ERROR(append_term(dest, src, field, word, &vals[i], doc_offset, success));
+    }
+  }
+  if(!*success) return NO_ERROR;
+
+  // later segments' field options win
+  for(uint32_t i = 0; i < srcsi->num_field_options; i++) {
+    field_options* fo = &srcsi->field_options[i];
+    RELAY_ERROR(wp_segment_set_field_options(dest, fo->field, fo->options));
+  }
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_append_labels(wp_segment* dest, wp_segment* src, docid_t doc_offset) {
+  uint32_t num_docs = MMAP_OBJ(src->seginfo, segment_info)->num_docs;
+  if((uint64_t)doc_offset + num_docs > wp_segment_num_docs(dest)) RAISE_ERROR("can't append labels for docs %u to %u to a segment with %" PRIu64 " docs", doc_offset + 1, doc_offset + num_docs, wp_segment_num_docs(dest));
+
+  stringmap* sh = MMAP_OBJ(src->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(src->stringpool, stringpool);
+  termhash* th = MMAP_OBJ(src->termhash, termhash);
+  term* keys = TERMHASH_KEYS(th);
+  docid_t* doc_ids = malloc(sizeof(docid_t) * (num_docs > 0 ? num_docs : 1));
+
+  for(uint32_t i = 0; i < th->n_buckets; i++) {
+    if(!termhash_slot_used(th, i) || (keys[i].field_s != 0)) continue;
+
+    // read_label goes newest first, so fill the array from the end
+    uint32_t n = 0;
+    posting po;
+    RELAY_ERROR(wp_segment_read_label(src, keys[i].word_s, num_docs, &po));
+    while(po.doc_id != DOCID_NONE) {
+      if(n >= num_docs) RAISE_ERROR("label has more docs than the segment");
+      n++;
+      doc_ids[num_docs - n] = doc_offset + po.doc_id;
+      RELAY_ERROR(wp_segment_read_label(src, keys[i].word_s, po.doc_id - 1, &po));
+    }
+
+    const char* label = stringmap_int_to_string(sh, sp, keys[i].word_s);
+    RELAY_ERROR(wp_segment_add_label_to_docs(dest, label, n, &doc_ids[num_docs - n]));
+  }
+  free(doc_ids);
+
+  tombstones* ts = MMAP_OBJ(src->tombstones, tombstones);
+  for(docid_t doc_id = 1; (doc_id < ts->num_slots) && (doc_id <= num_docs); doc_id++) {
+    if(wp_segment_is_deleted(src, doc_id)) RELAY_ERROR(wp_segment_delete_doc(dest, doc_offset + doc_id));
+  }
+
+  return NO_ERROR;
+}
+
 wp_error* wp_segment_dumpinfo(wp_segment* segment, FILE* stream) {
   segment_info* si = MMAP_OBJ(segment->seginfo, segment_info);
   postings_region* pr = MMAP_OBJ(segment->postings, postings_region);
+  postings_region* ps = MMAP_OBJ(segment->positions, postings_region);
   stringmap* sh = MMAP_OBJ(segment->stringmap, stringmap);
   stringpool* sp = MMAP_OBJ(segment->stringpool, stringpool);
   termhash* th = MMAP_OBJ(segment->termhash, termhash);
+  postings_region* pl = MMAP_OBJ(segment->labels, postings_region);
 
   #define p(a, b) 100.0 * (float)a / (float)b
 
-  fprintf(stream, "segment has type %u and version %u\n", pr->postings_type_and_flags, si->segment_version);
-  fprintf(stream, "segment has %u docs and %u postings\n", si->num_docs, pr->num_postings);
-  fprintf(stream, "postings region is %6ukb at %3.1f%% saturation\n", segment->postings.content->size / 1024, p(pr->postings_head, pr->postings_tail));
-  fprintf(stream, "    string hash is %6ukb at %3.1f%% saturation\n", segment->stringmap.content->size / 1024, p(sh->n_occupied, sh->n_buckets));
-  fprintf(stream, "     stringpool is %6ukb at %3.1f%% saturation\n", segment->stringpool.content->size / 1024, p(sp->next, sp->size));
-  fprintf(stream, "     term hash has %6ukb at %3.1f%% saturation\n", segment->termhash.content->size / 1024, p(th->n_occupied, th->n_buckets));
+  fprintf(stream, "segment has type %u and version %u%s\n", pr->postings_type_and_flags, si->segment_version, wp_segment_is_sealed(segment) ? " (sealed)" : "");
+  fprintf(stream, "segment has %u docs (%" PRIu64 " deleted) and %" PRIu64 " postings\n", si->num_docs, wp_segment_num_deleted(segment), pr->num_postings);
+  fprintf(stream, "postings region is %6" PRIu64 "kb at %3.1f%% saturation\n", segment->postings.content->size / 1024, p(pr->postings_head, pr->postings_tail));
+  fprintf(stream, "positions region is %6" PRIu64 "kb at %3.1f%% saturation\n", segment->positions.content->size / 1024, p(ps->postings_head, ps->postings_tail));
+  fprintf(stream, "    string hash is %6" PRIu64 "kb at %3.1f%% saturation\n", segment->stringmap.content->size / 1024, p(sh->n_occupied, sh->n_buckets));
+  fprintf(stream, "     stringpool is %6" PRIu64 "kb at %3.1f%% saturation\n", segment->stringpool.content->size / 1024, p(sp->next, sp->size));
+  fprintf(stream, "     term hash has %6" PRIu64 "kb at %3.1f%% saturation\n", segment->termhash.content->size / 1024, p(th->n_occupied, th->n_buckets));
+  fprintf(stream, "  labels region is %6" PRIu64 "kb at %3.1f%% saturation, %3.1f%% free\n", segment->labels.content->size / 1024, p(pl->postings_head, pl->postings_tail), p(label_free_bytes(pl), pl->postings_head));
+
+  // how close the segment is to being full, i.e. to its fullest region being
+  // as big as it can get
+  offset_t fullest = pr->postings_head > ps->postings_head ? pr->postings_head : ps->postings_head;
+  fprintf(stream, "segment is %3.1f%% full\n", p(fullest, MAX_POSTINGS_REGION_TAIL));
+
+  return NO_ERROR;
+}
+
+wp_error* wp_segment_set_field_options(wp_segment* seg, const char* field, uint32_t options) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+
+  if(options > WP_FIELD_DOCS_ONLY) RAISE_ERROR("invalid field options %u", options);
+  if(strlen(field) > WP_MAX_FIELD_NAME_LENGTH) RAISE_ERROR("field name %s is too long for field options (max %d)", field, WP_MAX_FIELD_NAME_LENGTH);
+
+  for(uint32_t i = 0; i < si->num_field_options; i++) {
+    if(!strcmp(si->field_options[i].field, field)) {
+      si->field_options[i].options = options;
+      return NO_ERROR;
+    }
+  }
+
+  if(options == WP_FIELD_POSITIONS) return NO_ERROR; // the default
+  if(si->num_field_options >= WP_MAX_FIELD_OPTIONS) RAISE_ERROR("can't set options for more than %d fields", WP_MAX_FIELD_OPTIONS);
+
+  field_options* fo = &si->field_options[si->num_field_options];
+  strcpy(fo->field, field);
+  fo->options = options;
+  si->num_field_options++;
 
   return NO_ERROR;
 }
 
+uint32_t wp_segment_field_options(wp_segment* seg, const char* field) {
+  segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
+
+  for(uint32_t i = 0; i < si->num_field_options; i++) {
+    if(!strcmp(si->field_options[i].field, field)) return si->field_options[i].options;
+  }
+
+  return WP_FIELD_POSITIONS;
+}
+
 uint64_t wp_segment_num_docs(wp_segment* seg) {
   segment_info* si = MMAP_OBJ(seg->seginfo, segment_info);
   return si->num_docs;
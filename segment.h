@@ -31,18 +31,30 @@
 typedef struct posting {
   docid_t doc_id;
   uint32_t num_positions;
-  uint32_t next_offset;
+  offset_t next_offset;
+  offset_t positions_offset; // where the positions are in the positions region
+  uint32_t positions_size; // and how many bytes they take up
   pos_t* positions;
 } posting;
 
-// a label posting entry. currently this is also the actual representation of
-// label postings on disk.
-typedef struct label_posting {
-  docid_t doc_id;
-  uint32_t next_offset;
-} label_posting;
-
-#define OFFSET_NONE (uint32_t)0
+// labels are stored as compressed bitmaps of docids, split by the high 16
+// bits of the docids into containers. a label's posting list header points
+// to a directory of its containers, sorted by key. see segment.c for details.
+typedef struct label_container {
+  uint16_t key; // the high 16 bits of every docid in here
+  uint8_t type; // a sorted array of the low 16 bits, or a bitmap of them
+  uint8_t size_class; // of the block holding them
+  uint32_t count; // number of docids in here
+  offset_t offset; // where the array or bitmap is in the labels region
+} label_container;
+
+typedef struct label_directory {
+  uint32_t num_containers;
+  uint8_t size_class; // of the block holding this directory
+  label_container containers[];
+} label_directory;
+
+#define OFFSET_NONE (offset_t)0
 #define DOCID_NONE (docid_t)0
 
 // docids:
@@ -60,26 +72,113 @@ typedef struct label_posting {
 // this will make automatic segment loading and unloading easier, once we have
 // that implemented. (and there are limits to things like the number of unique
 // terms also; see termhash.h.)
+//
+// offsets within a segment's regions are 64 bits wide (see offset_t), so the
+// size of a segment is bounded by MAX_POSTINGS_REGION_SIZE rather than by the
+// offsets.
 
 #define MAX_LOGICAL_DOCID 2147483646 // don't tweak me
-#define MAX_POSTINGS_REGION_SIZE (256*1024*1024) // tweak me
+#define MAX_POSTINGS_REGION_SIZE ((uint64_t)8*1024*1024*1024) // tweak me
+
+// every POSTINGS_SKIP_INTERVAL postings of a term, we write a skip record
+// (see termhash.h) pointing to that posting, so that advancing through a
+// long posting list doesn't have to decode every posting along the way.
+#define POSTINGS_SKIP_INTERVAL 32 // tweak me
+
+// in the live postings region, each term's postings are written into chunks
+// of its own, which grow from POSTINGS_MIN_CHUNK_SIZE up to
+// POSTINGS_MAX_CHUNK_SIZE bytes as the term gets more postings. its first
+// POSTINGS_UNCHUNKED postings are written without a chunk, taking up only
+// the bytes they need.
+#define POSTINGS_UNCHUNKED 2 // tweak me
+#define POSTINGS_MIN_CHUNK_SIZE 32 // tweak me
+#define POSTINGS_MAX_CHUNK_SIZE 1024 // tweak me
+
+// when a segment is sealed, a term that's in at least one in
+// POSTINGS_DENSE_FRACTION of its docs is stored as a bitmap over the docids
+// rather than as a list. bitmaps are smaller for such terms, and can be probed
+// for a doc directly rather than walked.
+#define POSTINGS_DENSE_FRACTION 4 // tweak me
+
+// field options. by default, every posting records which doc a term occurs
+// in, how many times, and at which positions. for fields that are never
+// searched for phrases (say, email addresses or message ids), you can ask for
+// less to be stored. the options for a term are fixed when the segment first
+// sees it.
+#define WP_FIELD_POSITIONS 0 // doc ids, frequencies and positions (the default)
+#define WP_FIELD_FREQS 1 // doc ids and frequencies
+#define WP_FIELD_DOCS_ONLY 2 // just doc ids
+
+#define WP_MAX_FIELD_OPTIONS 32 // number of fields that can have non-default options
+#define WP_MAX_FIELD_NAME_LENGTH 31
+
+// external keys. a doc can be given a key (say, its message id) that stays
+// the same when the doc is replaced by a newer version. keys live in the
+// termhash next to the terms, under this field string id, which no string can
+// have; the posting list header's next_offset holds the doc id.
+#define WP_KEY_FIELD ((uint32_t)-2)
+
+// the forward label store: for every doc, where in the labels region the
+// ids of its labels are, or OFFSET_NONE if it has none. each doc's label ids
+// are kept as a count followed by the ids in sorted order.
+typedef struct doc_labels {
+  uint32_t num_slots; // docids up to num_slots - 1 have an entry here
+  offset_t offsets[];
+} doc_labels;
+
+// deleted documents. their postings stay where they are, but they're
+// skipped by searches and not counted.
+typedef struct tombstones {
+  uint32_t num_slots; // docids up to num_slots - 1 have a bit here
+  uint32_t num_deleted;
+  uint64_t bits[];
+} tombstones;
+
+// label containers switch from sorted arrays to bitmaps once they have more
+// than this many docids, at which point the bitmap is no bigger.
+#define LABEL_ARRAY_MAX_SIZE 4096 // don't tweak me
 
 #define WP_SEGMENT_POSTING_REGION_PATH_SUFFIX "pr"
+#define WP_SEGMENT_POSITIONS_REGION_PATH_SUFFIX "ps"
+#define WP_SEGMENT_DOC_LABELS_PATH_SUFFIX "dl"
+#define WP_SEGMENT_TOMBSTONES_PATH_SUFFIX "ts"
+#define WP_SEGMENT_SEALED_VALS_PATH_SUFFIX "tv" // only while sealing
 
 // the header for the postings region
 typedef struct postings_region {
   uint32_t postings_type_and_flags;
-  uint32_t num_postings;
-  uint32_t postings_head, postings_tail;
+  uint64_t num_postings;
+  offset_t postings_head, postings_tail;
   uint8_t postings[]; // where the postings go yo
 } postings_region;
 
+typedef struct field_options {
+  char field[WP_MAX_FIELD_NAME_LENGTH + 1];
+  uint32_t options;
+} field_options;
+
 typedef struct segment_info {
   uint32_t segment_version;
   uint32_t num_docs;
+  uint32_t generation; // bumped whenever the postings region is rewritten
+  uint32_t seal_committed; // a seal's new files are on disk; see wp_segment_seal
+  uint32_t num_field_options;
+  field_options field_options[WP_MAX_FIELD_OPTIONS];
   pthread_rwlock_t lock;
+  pthread_rwlock_t label_lock; // serializes label changers; see wp_segment_grab_label_lock
 } segment_info;
 
+// how much adding some stuff to a segment will grow it by. start with a zeroed
+// one and fill it in with wp_segment_sizeof_posting.
+typedef struct segment_growth {
+  uint64_t postings_bytes;
+  uint64_t positions_bytes;
+  uint64_t label_bytes;
+  uint32_t num_strings; // new entries in the stringmap
+  uint32_t string_bytes; // and the bytes they take up in the stringpool
+  uint32_t num_terms; // new entries in the termhash
+} segment_growth;
+
 // a segment is a bunch of all these things
 typedef struct wp_segment {
   mmap_obj seginfo;
@@ -87,7 +186,13 @@ typedef struct wp_segment {
   mmap_obj stringpool;
   mmap_obj termhash;
   mmap_obj postings;
+  mmap_obj positions;
   mmap_obj labels;
+  mmap_obj doc_labels;
+  mmap_obj tombstones;
+  char* pathname_base;
+  uint32_t generation; // the generation of the postings region we have loaded
+  int shared_labels; // searches may be reading while we change labels; see wp_segment_grab_label_lock
 } wp_segment;
 
 // API methods
@@ -107,9 +212,13 @@ wp_error* wp_segment_reload(wp_segment* segment) RAISES_ERROR;
 // public: unload a segment
 wp_error* wp_segment_unload(wp_segment* s) RAISES_ERROR;
 
-// public: number of docs in a segment
+// public: number of docs in a segment, including deleted ones. (this is also
+// the largest docid.)
 uint64_t wp_segment_num_docs(wp_segment* s);
 
+// public: number of deleted docs in a segment
+uint64_t wp_segment_num_deleted(wp_segment* s);
+
 // public: delete a segment from disk
 wp_error* wp_segment_delete(const char* pathname_base) RAISES_ERROR;
 
@@ -118,37 +227,153 @@ wp_error* wp_segment_grab_readlock(wp_segment* seg) RAISES_ERROR;
 wp_error* wp_segment_grab_writelock(wp_segment* seg) RAISES_ERROR;
 wp_error* wp_segment_release_lock(wp_segment* seg) RAISES_ERROR;
 
-// private: read a posting from the postings region at a given offset
-wp_error* wp_segment_read_posting(wp_segment* s, uint32_t offset, posting* po, int include_positions) RAISES_ERROR;
-
-// private: read a label from the label postings region at a given offset
-wp_error* wp_segment_read_label(wp_segment* s, uint32_t offset, posting* po) RAISES_ERROR;
+// public: grab the locks for changing label on a segment, and release them.
+// label changers are serialized among themselves, but only block searches
+// if label is new to the segment, so they don't need the write lock. either
+// way, the segment is reloaded for you.
+wp_error* wp_segment_grab_label_lock(wp_segment* seg, const char* label) RAISES_ERROR;
+wp_error* wp_segment_release_label_lock(wp_segment* seg) RAISES_ERROR;
+
+// private: read a posting from the postings region at a given offset. options
+// must be the options of the posting list (see WP_FIELD_*). in a sealed
+// segment, doc ids and positions offsets are delta-encoded against the
+// previous posting in the list, so when reading sequentially, po must still
+// hold the previous posting. (the first posting in a list and the targets of
+// skip records can be read on their own.)
+//
+// for WP_FIELD_FREQS postings, num_positions is always set to the term
+// frequency, and positions is always NULL.
+wp_error* wp_segment_read_posting(wp_segment* s, offset_t offset, uint32_t options, posting* po, int include_positions) RAISES_ERROR;
+
+// private: fill in the positions of a WP_FIELD_POSITIONS posting read with
+// include_positions=0.
+// rather than mallocing a new array each time, the positions are decoded into
+// the scratch buffer *buf of *buf_size entries, which is realloc'd when it's
+// too small. po->positions points into it, so it's only good until the next
+// call with the same buffer. start with a NULL buffer of size 0, and free it
+// when you're done.
+wp_error* wp_segment_read_positions(wp_segment* s, posting* po, pos_t** buf, uint32_t* buf_size) RAISES_ERROR;
+
+// private: read a skip record from the postings region at a given offset
+wp_error* wp_segment_read_skip(wp_segment* s, offset_t offset, block_header* bh) RAISES_ERROR;
+
+// private: read the label posting with the largest docid that's at most
+// doc_id, for the label with string id label_s. sets po->doc_id to DOCID_NONE
+// if there isn't one. to iterate through a label's docs in the same
+// (descending) order as postings, call this again with one less than the last
+// docid.
+wp_error* wp_segment_read_label(wp_segment* s, uint32_t label_s, docid_t doc_id, posting* po) RAISES_ERROR;
+
+// private: read the posting with the largest docid that's at most doc_id from
+// a dense posting list (one whose header has dense set) starting at offset,
+// with options options. sets po->doc_id to DOCID_NONE if there isn't one.
+// positions aren't read, but can be with wp_segment_read_positions. to
+// iterate through the list, call this again with one less than the last
+// docid.
+wp_error* wp_segment_read_dense_posting(wp_segment* s, offset_t offset, uint32_t options, docid_t doc_id, posting* po) RAISES_ERROR;
 
 // public: add a posting. be sure you've called wp_segment_ensure_fit with the
-// size of the postings list entry before doing this! (you can obtain the size
-// by calling wp_entry_sizeof_postings_region()).
+// growth the posting will cause before doing this! (you can obtain it by
+// calling wp_entry_sizeof_postings_region()).
 wp_error* wp_segment_add_posting(wp_segment* s, const char* field, const char* word, docid_t doc_id, uint32_t num_positions, pos_t positions[]) RAISES_ERROR;
 
-// public: add a label to an existing document
+// public: add a label to an existing document. raises an error if the
+// segment has no room for it.
 wp_error* wp_segment_add_label(wp_segment* s, const char* label, docid_t doc_id) RAISES_ERROR;
 
 // public: remove a label from an existing document
 wp_error* wp_segment_remove_label(wp_segment* s, const char* label, docid_t doc_id) RAISES_ERROR;
 
+// public: add a label to a batch of existing documents, whose doc ids must be
+// in ascending order. this is much faster than adding them one at a time.
+wp_error* wp_segment_add_label_to_docs(wp_segment* s, const char* label, uint32_t num_docs, docid_t* doc_ids) RAISES_ERROR;
+
+// public: remove a label from a batch of existing documents, whose doc ids
+// must be in ascending order
+wp_error* wp_segment_remove_label_from_docs(wp_segment* s, const char* label, uint32_t num_docs, docid_t* doc_ids) RAISES_ERROR;
+
+// public: delete a document. it will no longer appear in search results, and
+// loses all its labels. does nothing if it's already deleted.
+wp_error* wp_segment_delete_doc(wp_segment* s, docid_t doc_id) RAISES_ERROR;
+
+// public: has a document been deleted?
+int wp_segment_is_deleted(wp_segment* s, docid_t doc_id);
+
+// public: set the external key of a document, replacing whatever doc the key
+// pointed to before. be sure you've called wp_segment_ensure_fit with the
+// growth from wp_segment_sizeof_key first!
+wp_error* wp_segment_set_key(wp_segment* s, const char* key, docid_t doc_id) RAISES_ERROR;
+
+// public: the doc that a key was last set on, or DOCID_NONE if it's never
+// been set in this segment. the doc may since have been deleted.
+docid_t wp_segment_lookup_key(wp_segment* s, const char* key);
+
+// public: get the string ids of the labels on a document, which you can look
+// up with stringmap_int_to_string. sets num_labels to the number of labels
+// the doc has, and fills in at most max_labels of them.
+wp_error* wp_segment_get_doc_labels(wp_segment* s, docid_t doc_id, uint32_t max_labels, uint32_t* num_labels, uint32_t* label_ids) RAISES_ERROR;
+
+// public: seal a segment that will receive no more postings, rewriting its
+// postings region into a compact, read-only form. labels can still be added
+// and removed afterwards. you must hold the write lock. does nothing if the
+// segment is already sealed. if we die partway through, wp_segment_load
+// either finishes the seal or throws it away.
+wp_error* wp_segment_seal(wp_segment* s) RAISES_ERROR;
+
+// public: rewrite the labels region compactly, with each label's docids laid
+// out together and no freed space, shrinking it to fit. you must hold the
+// write lock.
+wp_error* wp_segment_vacuum_labels(wp_segment* s) RAISES_ERROR;
+
+// public: append every doc in src to the end of dest, renumbered to follow
+// the docs already there, for merging segments. this copies their postings,
+// keys and field options, but leaves out the postings of deleted docs, and
+// doesn't copy labels or deletions at all (see below). dest must not be
+// sealed, and you must hold src's read lock. a term stored with different
+// options in dest and src ends up with the lesser of the two (e.g. without
+// positions if either lacks them). sets success to 0 if dest runs out of
+// room, in which case it's left with only some of src's postings, and should
+// be thrown away.
+wp_error* wp_segment_append_postings(wp_segment* dest, wp_segment* src, int* success) RAISES_ERROR;
+
+// public: copy the labels and deletions of src's docs to dest, once
+// wp_segment_append_postings has appended them after doc doc_offset. you
+// must hold src's write lock.
+wp_error* wp_segment_append_labels(wp_segment* dest, wp_segment* src, docid_t doc_offset) RAISES_ERROR;
+
+// public: has this segment been sealed?
+int wp_segment_is_sealed(wp_segment* s);
+
+// public: the generation of the segment's postings region. this changes
+// whenever the region is rewritten (e.g. by wp_segment_seal), which
+// invalidates any search state held against the segment.
+uint32_t wp_segment_generation(wp_segment* s);
+
+// public: set the options (see WP_FIELD_*) for a field. terms of the field
+// that the segment has already seen keep their old options.
+wp_error* wp_segment_set_field_options(wp_segment* s, const char* field, uint32_t options) RAISES_ERROR;
+
+// public: the options for a field
+uint32_t wp_segment_field_options(wp_segment* s, const char* field);
+
 // public: get a new docid
 wp_error* wp_segment_grab_docid(wp_segment* s, docid_t* docid) RAISES_ERROR;
 
 // public: dump a lot of info about the segment to a stream
 wp_error* wp_segment_dumpinfo(wp_segment* s, FILE* stream) RAISES_ERROR;
 
-// public: ensure that adding a certain number of postings bytes and label
-// postings bytes will still fit within the bounds of the segment. sets success
-// to 1 if true or 0 if false. if false, you should put that stuff in a new
-// segment.
-wp_error* wp_segment_ensure_fit(wp_segment* seg, uint32_t postings_bytes, uint32_t label_bytes, int* success) RAISES_ERROR;
+// public: ensure that growing the segment by growth will still fit within the
+// bounds of the segment, growing its regions and dictionaries as necessary.
+// sets success to 1 if true or 0 if false. if false, you should put that
+// stuff in a new segment.
+wp_error* wp_segment_ensure_fit(wp_segment* seg, segment_growth* growth, int* success) RAISES_ERROR;
+
+// private: add to growth what adding a posting with these positions for
+// field:word would take up in the segment
+wp_error* wp_segment_sizeof_posting(wp_segment* seg, const char* field, const char* word, uint32_t num_positions, pos_t* positions, segment_growth* growth) RAISES_ERROR;
 
-// private: return the size on disk of a position array
-wp_error* wp_segment_sizeof_posarray(wp_segment* seg, uint32_t num_positions, pos_t* positions, uint32_t* size) RAISES_ERROR;
+// private: add to growth what setting a key would take up in the segment
+wp_error* wp_segment_sizeof_key(wp_segment* seg, const char* key, segment_growth* growth) RAISES_ERROR;
 
 // private: count the number of occurences of a particular term
 wp_error* wp_segment_count_term(wp_segment* seg, const char* field, const char* term, uint32_t* num_results);
@@ -35,7 +35,7 @@ void termhash_init(termhash* h) {
   h->n_buckets = prime_list[h->n_buckets_idx];
   h->upper_bound = (uint32_t)(h->n_buckets * HASH_UPPER + 0.5);
   h->size = h->n_occupied = 0;
-  memset(TERMHASH_FLAGS(h), 0xaa, ((h->n_buckets>>4) + 1) * sizeof(uint32_t));
+  memset(TERMHASH_FLAGS(h), 0xaa, TERMHASH_FLAG_WORDS(h->n_buckets) * sizeof(uint32_t));
 }
 
 #define OFFSET(a, b) (long)((uint8_t*)a - (uint8_t*)b)
@@ -100,7 +100,7 @@ wp_error* termhash_bump_size(termhash *h) {
   uint32_t new_n_buckets = prime_list[h->n_buckets_idx];
 
   // first make a backup of the old flags in a separate memory region
-  size_t flagbaksize = ((h->n_buckets >> 4) + 1) * sizeof(uint32_t);
+  size_t flagbaksize = TERMHASH_FLAG_WORDS(h->n_buckets) * sizeof(uint32_t);
   uint32_t* flagbaks = malloc(flagbaksize);
   memcpy(flagbaks, TERMHASH_FLAGS(h), flagbaksize);
 
@@ -110,7 +110,7 @@ wp_error* termhash_bump_size(termhash *h) {
 
   // set pointers to the new locations
   uint32_t* newflags = (uint32_t*)h->boundary;
-  term* newkeys = (term*)(newflags + ((new_n_buckets >> 4) + 1));
+  term* newkeys = (term*)(newflags + TERMHASH_FLAG_WORDS(new_n_buckets));
   posting_list_header* newvals = (posting_list_header*)(newkeys + new_n_buckets);
 
   // move the vals and keys
@@ -118,7 +118,7 @@ wp_error* termhash_bump_size(termhash *h) {
   memmove(newkeys, oldkeys, h->n_buckets * sizeof(term));
 
   // clear the new flags
-  memset(newflags, 0xaa, ((new_n_buckets>>4) + 1) * sizeof(uint32_t));
+  memset(newflags, 0xaa, TERMHASH_FLAG_WORDS(new_n_buckets) * sizeof(uint32_t));
 
   // do the complicated stuff from khash.h
   for (unsigned int j = 0; j != h->n_buckets; ++j) {
@@ -251,25 +251,29 @@ wp_error* termhash_put_val(termhash* h, term t, posting_list_header* val) {
   return NO_ERROR;
 }
 
+int termhash_slot_used(termhash* h, uint32_t i) {
+  return !iseither(TERMHASH_FLAGS(h), i);
+}
+
 int termhash_needs_bump(termhash* h) {
   return (h->n_occupied >= h->upper_bound);
 }
 
 // returns the total size in bytes
 //   memory layout: termhash struct, then:
-//   ((n_buckets >> 4) + 1) uint32_t's for the flags
+//   TERMHASH_FLAG_WORDS(n_buckets) uint32_t's for the flags
 //   n_buckets terms for the keys
 //   n_buckets posting_list_header for the vals (offsets into postings lists)
 static uint32_t size(uint32_t n_buckets) {
   uint32_t size = (uint32_t)sizeof(termhash) +
-    (((n_buckets >> 4) + 1) * (uint32_t)sizeof(uint32_t)) +
+    (TERMHASH_FLAG_WORDS(n_buckets) * (uint32_t)sizeof(uint32_t)) +
     (n_buckets * (uint32_t)sizeof(term)) +
     (n_buckets * (uint32_t)sizeof(posting_list_header));
 
   DEBUG("size of a termhash with %u buckets is %lu + %lu + %lu + %lu = %u",
     n_buckets,
     (long)sizeof(termhash),
-    (long)(((n_buckets >> 4) + 1) * sizeof(uint32_t)),
+    (long)(TERMHASH_FLAG_WORDS(n_buckets) * sizeof(uint32_t)),
     (long)(n_buckets * sizeof(term)),
     (long)(n_buckets * sizeof(posting_list_header)),
     size);
@@ -15,6 +15,7 @@
 // memory.
 
 #include <stdint.h>
+#include "defaults.h"
 #include "error.h"
 
 typedef struct term {
@@ -22,16 +23,27 @@ typedef struct term {
   uint32_t word_s;
 } term;
 
+// options and dense share the word after count, which would otherwise be
+// padding, so that the header stays at 40 bytes
 typedef struct posting_list_header {
   uint32_t count;
-  uint32_t next_offset;
+  uint8_t options; // what's stored for each posting; see WP_FIELD_* in segment.h
+  uint8_t dense; // 1 if sealed as a bitmap rather than a list (see segment.c)
+  offset_t next_offset;
+  offset_t skip_offset; // head of the skip record chain (see segment.c)
+  offset_t chunk_head; // where the next posting goes in the live postings region
+  offset_t chunk_tail; // the end of the current chunk (see segment.c)
 } posting_list_header;
 
+// a skip record. these are stored in the postings region alongside the
+// postings themselves, and form a backwards-linked chain that lets readers
+// jump over runs of postings without decoding them. block_start is the offset
+// of a posting, and max_docid is the doc id stored there; next_offset is the
+// offset of the next (older) skip record.
 typedef struct block_header {
   uint32_t max_docid;
-  uint32_t next_offset;
-  uint32_t block_start;
-  uint8_t data[];
+  offset_t next_offset;
+  offset_t block_start;
 } block_header;
 
 #define INITIAL_N_BUCKETS_IDX 1
@@ -39,15 +51,18 @@ typedef struct block_header {
 typedef struct termhash {
   uint8_t n_buckets_idx;
   uint32_t n_buckets, size, n_occupied, upper_bound;
-  uint8_t boundary[];
+  uint64_t boundary[]; // 8-byte aligned, like the vals
   // in memory at this point
-  // ((n_buckets >> 4) + 1) uint32_t's for the flags
+  // TERMHASH_FLAG_WORDS(n_buckets) uint32_t's for the flags
   // n_buckets terms for the keys
   // n_buckets posting_list_header for the vals
 } termhash;
 
+// the flags need (n_buckets >> 4) + 1 uint32_t's. we round that up to an even
+// number so that the keys, and the vals after them, stay 8-byte aligned.
+#define TERMHASH_FLAG_WORDS(n_buckets) ((((n_buckets) >> 4) + 2) & ~1U)
 #define TERMHASH_FLAGS(h) ((uint32_t*)(h)->boundary)
-#define TERMHASH_KEYS(h) ((term*)((uint32_t*)(h)->boundary + (((h)->n_buckets >> 4) + 1)))
+#define TERMHASH_KEYS(h) ((term*)((uint32_t*)(h)->boundary + TERMHASH_FLAG_WORDS((h)->n_buckets)))
 #define TERMHASH_VALS(h) ((posting_list_header*)(TERMHASH_KEYS(h) + (h)->n_buckets))
 
 // API methods
@@ -68,6 +83,11 @@ posting_list_header* termhash_get_val(termhash* h, term t); // convenience
 // for details on what all the return values mean.
 uint32_t termhash_put(termhash* h, term t, int *ret); // khash-style
 
+// private: khash-style iteration: returns non-zero if slot i (between 0 and
+// n_buckets - 1) holds a term. you can then look at the keys and vals arrays
+// yourself.
+int termhash_slot_used(termhash* h, uint32_t i);
+
 // public: adds a term to the hash with the given value
 wp_error* termhash_put_val(termhash* h, term t, posting_list_header* val) RAISES_ERROR; // convenience
 
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include "intersect.h"
+#include "error.h"
+#include "test.h"
+
+// fills docids with n distinct docids from 1..range, in descending order
+static void random_docids(docid_t* docids, uint32_t n, docid_t range) {
+  uint32_t k = 0;
+  for(docid_t doc_id = range; (doc_id > 0) && (k < n); doc_id--) {
+    if((uint32_t)(rand() % doc_id) < n - k) docids[k++] = doc_id;
+  }
+}
+
+static uint32_t slow_intersect(const docid_t* a, uint32_t na, const docid_t* b, uint32_t nb, docid_t* out) {
+  uint32_t n = 0;
+  for(uint32_t i = 0; i < na; i++) {
+    for(uint32_t j = 0; j < nb; j++) if(a[i] == b[j]) out[n++] = a[i];
+  }
+  return n;
+}
+
+TEST(docids_gallop) {
+  docid_t docids[] = { 50, 40, 30, 20, 10 };
+
+  ASSERT_EQUALS_UINT(0, wp_docids_gallop(docids, 5, 60));
+  ASSERT_EQUALS_UINT(0, wp_docids_gallop(docids, 5, 50));
+  ASSERT_EQUALS_UINT(1, wp_docids_gallop(docids, 5, 49));
+  ASSERT_EQUALS_UINT(3, wp_docids_gallop(docids, 5, 20));
+  ASSERT_EQUALS_UINT(4, wp_docids_gallop(docids, 5, 15));
+  ASSERT_EQUALS_UINT(5, wp_docids_gallop(docids, 5, 5));
+  ASSERT_EQUALS_UINT(0, wp_docids_gallop(docids, 0, 5));
+
+  return NO_ERROR;
+}
+
+TEST(intersections_match_the_slow_way) {
+  uint32_t sizes[] = { 0, 1, 3, 4, 7, 8, 9, 31, 100, 129, 1000 };
+  uint32_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  docid_t* a = malloc(sizeof(docid_t) * 1000);
+  docid_t* b = malloc(sizeof(docid_t) * 1000);
+  docid_t* expected = malloc(sizeof(docid_t) * 1000);
+  docid_t* got = malloc(sizeof(docid_t) * 1000);
+
+  srand(42);
+  for(uint32_t x = 0; x < num_sizes; x++) {
+    for(uint32_t y = 0; y < num_sizes; y++) {
+      uint32_t na = sizes[x], nb = sizes[y];
+      random_docids(a, na, 2000);
+      random_docids(b, nb, 2000);
+      uint32_t num_expected = slow_intersect(a, na, b, nb, expected);
+
+      uint32_t n = wp_intersect_docids_scalar(a, na, b, nb, got);
+      ASSERT_EQUALS_UINT(num_expected, n);
+      ASSERT(!memcmp(expected, got, sizeof(docid_t) * n));
+
+      n = wp_intersect_docids_merge(a, na, b, nb, got);
+      ASSERT_EQUALS_UINT(num_expected, n);
+      ASSERT(!memcmp(expected, got, sizeof(docid_t) * n));
+
+      n = wp_intersect_docids_gallop(a, na, b, nb, got);
+      ASSERT_EQUALS_UINT(num_expected, n);
+      ASSERT(!memcmp(expected, got, sizeof(docid_t) * n));
+
+      n = wp_intersect_docids(a, na, b, nb, got);
+      ASSERT_EQUALS_UINT(num_expected, n);
+      ASSERT(!memcmp(expected, got, sizeof(docid_t) * n));
+
+      // in place
+      n = wp_intersect_docids(a, na, b, nb, a);
+      ASSERT_EQUALS_UINT(num_expected, n);
+      ASSERT(!memcmp(expected, a, sizeof(docid_t) * n));
+    }
+  }
+
+  free(a);
+  free(b);
+  free(expected);
+  free(got);
+  return NO_ERROR;
+}
+
+TEST(intersections_of_runs) {
+  docid_t a[300], b[300], out[300];
+
+  // b has every other docid of a, so every vector compare finds something
+  for(uint32_t i = 0; i < 300; i++) a[i] = 1000 - i;
+  for(uint32_t i = 0; i < 150; i++) b[i] = 1000 - 2 * i;
+
+  uint32_t n = wp_intersect_docids_merge(a, 300, b, 150, out);
+  ASSERT_EQUALS_UINT(150, n);
+  for(uint32_t i = 0; i < n; i++) ASSERT_EQUALS_UINT(b[i], out[i]);
+
+  // no overlap at all
+  n = wp_intersect_docids_merge(a, 300, a, 0, out);
+  ASSERT_EQUALS_UINT(0, n);
+  for(uint32_t i = 0; i < 300; i++) b[i] = 500 - i;
+  n = wp_intersect_docids_merge(a, 300, b, 300, out);
+  ASSERT_EQUALS_UINT(0, n);
+
+  // a single docid against a long run
+  docid_t one = 701;
+  n = wp_intersect_docids(&one, 1, a, 300, out);
+  ASSERT_EQUALS_UINT(1, n);
+  ASSERT_EQUALS_UINT(701, out[0]);
+
+  return NO_ERROR;
+}
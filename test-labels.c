@@ -197,3 +197,492 @@ TEST(adding_and_removing_labels_are_reflected_in_search) {
   RELAY_ERROR(shutdown(index));
   return NO_ERROR;
 }
+
+TEST(labels_can_be_fetched_for_docs) {
+  wp_index* index;
+  uint64_t doc_ids[3] = { 3, 1, 2 };
+  char** labels[3];
+
+  RELAY_ERROR(setup(&index));
+
+  RELAY_ERROR(wp_index_add_label(index, "starred", 1));
+  RELAY_ERROR(wp_index_add_label(index, "read", 1));
+  RELAY_ERROR(wp_index_add_label(index, "read", 3));
+  RELAY_ERROR(wp_index_add_label(index, "attachment", 1));
+  RELAY_ERROR(wp_index_add_label(index, "read", 1)); // already there
+  RELAY_ERROR(wp_index_add_label(index, "inbox", 1));
+  RELAY_ERROR(wp_index_remove_label(index, "starred", 1));
+  RELAY_ERROR(wp_index_add_label(index, "sent", 1)); // needs a bigger block
+
+  RELAY_ERROR(wp_index_get_labels(index, 3, doc_ids, labels));
+
+  // doc 3
+  ASSERT(labels[0][0] != NULL);
+  ASSERT(!strcmp(labels[0][0], "read"));
+  ASSERT(labels[0][1] == NULL);
+
+  // doc 1. labels come back in label id order, which is the order they were
+  // first seen in
+  ASSERT(labels[1][0] != NULL && !strcmp(labels[1][0], "read"));
+  ASSERT(labels[1][1] != NULL && !strcmp(labels[1][1], "attachment"));
+  ASSERT(labels[1][2] != NULL && !strcmp(labels[1][2], "inbox"));
+  ASSERT(labels[1][3] != NULL && !strcmp(labels[1][3], "sent"));
+  ASSERT(labels[1][4] == NULL);
+
+  // doc 2
+  ASSERT(labels[2][0] == NULL);
+
+  for(int i = 0; i < 3; i++) wp_index_free_labels(labels[i]);
+
+  doc_ids[0] = 4;
+  wp_error* e = wp_index_get_labels(index, 1, doc_ids, labels);
+  ASSERT(e != NULL);
+  wp_error_free(e);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+TEST(labels_can_be_changed_in_bulk) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10];
+  uint32_t num_results;
+  uint64_t doc_ids[3] = { 1, 3, 3 };
+
+  RELAY_ERROR(setup(&index));
+
+  RELAY_ERROR(wp_index_add_label_to_docs(index, "bob", 3, doc_ids));
+  RUN_QUERY("~bob");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(3, results[0]);
+  ASSERT_EQUALS_UINT64(1, results[1]);
+
+  // labels everything with "four" in it
+  RELAY_ERROR(wp_query_parse("four", "body", &query));
+  RELAY_ERROR(wp_index_add_label_to_query(index, "bob", query));
+  wp_query_free(query);
+  RUN_QUERY("~bob");
+  ASSERT_EQUALS_UINT(3, num_results);
+
+  RELAY_ERROR(wp_query_parse("~bob -five", "body", &query));
+  RELAY_ERROR(wp_index_remove_label_from_query(index, "bob", query));
+  wp_query_free(query);
+  RUN_QUERY("~bob");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(3, results[0]);
+
+  doc_ids[0] = 3;
+  doc_ids[1] = 1;
+  wp_error* e = wp_index_add_label_to_docs(index, "bob", 2, doc_ids);
+  ASSERT(e != NULL); // out of order
+  wp_error_free(e);
+
+  doc_ids[0] = 2;
+  doc_ids[1] = 4;
+  e = wp_index_add_label_to_docs(index, "bob", 2, doc_ids);
+  ASSERT(e != NULL); // no doc 4
+  wp_error_free(e);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+TEST(deleted_docs_disappear_from_search) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10];
+  uint32_t num_results;
+  uint64_t num_docs;
+
+  RELAY_ERROR(setup(&index));
+
+  RELAY_ERROR(wp_index_add_label(index, "bob", 2));
+  RELAY_ERROR(wp_index_add_label(index, "bob", 3));
+  RELAY_ERROR(wp_index_delete_doc(index, 2));
+  RELAY_ERROR(wp_index_delete_doc(index, 2)); // already deleted
+
+  RUN_QUERY("three");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(3, results[0]);
+  ASSERT_EQUALS_UINT64(1, results[1]);
+
+  RUN_QUERY("-four");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(1, results[0]);
+
+  RUN_QUERY("~bob");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(3, results[0]);
+
+  RELAY_ERROR(wp_index_num_docs(index, &num_docs));
+  ASSERT_EQUALS_UINT64(2, num_docs);
+
+  RELAY_ERROR(wp_query_parse("two", "body", &query));
+  RELAY_ERROR(wp_index_count_results(index, query, &num_results));
+  wp_query_free(query);
+  ASSERT_EQUALS_UINT(1, num_results);
+
+  wp_error* e = wp_index_delete_doc(index, 4);
+  ASSERT(e != NULL);
+  wp_error_free(e);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+RAISING_STATIC(upsert_string(wp_index* index, const char* key, const char* string, uint64_t* doc_id)) {
+  wp_entry* entry = wp_entry_new();
+
+  RELAY_ERROR(wp_entry_add_string(entry, "body", string));
+  RELAY_ERROR(wp_index_upsert_entry(index, key, entry, doc_id));
+  RELAY_ERROR(wp_entry_free(entry));
+
+  return NO_ERROR;
+}
+
+TEST(upserted_entries_replace_the_doc_with_their_key) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10];
+  uint32_t num_results;
+  uint64_t doc_id, num_docs;
+  char** labels[1];
+
+  RELAY_ERROR(setup(&index));
+
+  RELAY_ERROR(wp_index_lookup_key(index, "msg-a", &doc_id));
+  ASSERT_EQUALS_UINT64(0, doc_id);
+
+  RELAY_ERROR(upsert_string(index, "msg-a", "six seven", &doc_id));
+  ASSERT_EQUALS_UINT64(4, doc_id);
+  RELAY_ERROR(upsert_string(index, "msg-b", "six eight", &doc_id));
+  ASSERT_EQUALS_UINT64(5, doc_id);
+  RELAY_ERROR(wp_index_add_label(index, "bob", 4));
+
+  RELAY_ERROR(upsert_string(index, "msg-a", "six nine", &doc_id));
+  ASSERT_EQUALS_UINT64(6, doc_id);
+  RELAY_ERROR(wp_index_lookup_key(index, "msg-a", &doc_id));
+  ASSERT_EQUALS_UINT64(6, doc_id);
+  RELAY_ERROR(wp_index_lookup_key(index, "msg-b", &doc_id));
+  ASSERT_EQUALS_UINT64(5, doc_id);
+
+  RUN_QUERY("six");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(6, results[0]);
+  ASSERT_EQUALS_UINT64(5, results[1]);
+
+  RUN_QUERY("seven");
+  ASSERT_EQUALS_UINT(0, num_results);
+
+  // the label came along
+  RUN_QUERY("~bob");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(6, results[0]);
+
+  doc_id = 6;
+  RELAY_ERROR(wp_index_get_labels(index, 1, &doc_id, labels));
+  ASSERT(labels[0][0] != NULL);
+  ASSERT(!strcmp("bob", labels[0][0]));
+  ASSERT(labels[0][1] == NULL);
+  wp_index_free_labels(labels[0]);
+
+  RELAY_ERROR(wp_index_num_docs(index, &num_docs));
+  ASSERT_EQUALS_UINT64(5, num_docs);
+
+  // deleting the doc deletes the key
+  RELAY_ERROR(wp_index_delete_doc(index, 5));
+  RELAY_ERROR(wp_index_lookup_key(index, "msg-b", &doc_id));
+  ASSERT_EQUALS_UINT64(0, doc_id);
+  RELAY_ERROR(upsert_string(index, "msg-b", "six ten", &doc_id));
+  ASSERT_EQUALS_UINT64(7, doc_id);
+
+  RUN_QUERY("six");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(7, results[0]);
+  ASSERT_EQUALS_UINT64(6, results[1]);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+TEST(the_newest_segment_cant_be_dropped) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10];
+  uint32_t num_results;
+
+  RELAY_ERROR(setup(&index));
+
+  wp_error* e = wp_index_drop_oldest_segments(index, 1);
+  ASSERT(e != NULL);
+  wp_error_free(e);
+  RELAY_ERROR(wp_index_drop_oldest_segments(index, 0));
+
+  RUN_QUERY("three");
+  ASSERT_EQUALS_UINT(3, num_results);
+  ASSERT(wp_index_exists(INDEX_PATH));
+
+  RELAY_ERROR(shutdown(index));
+  ASSERT(!wp_index_exists(INDEX_PATH));
+  return NO_ERROR;
+}
+
+// adds num_docs docs, ten to a segment. doc i has the words "common" and
+// "di", and the label "even" if i is even.
+RAISING_STATIC(setup_segments(wp_index** index, int num_docs)) {
+  char buf[100];
+
+  RELAY_ERROR(wp_index_delete(INDEX_PATH));
+  RELAY_ERROR(wp_index_create(index, INDEX_PATH));
+  wp_index_set_max_segment_docs(*index, 10);
+
+  for(int i = 1; i <= num_docs; i++) {
+    snprintf(buf, 100, "common d%d", i);
+    RELAY_ERROR(add_string(*index, buf));
+    if((i % 2) == 0) RELAY_ERROR(wp_index_add_label(*index, "even", i));
+  }
+
+  return NO_ERROR;
+}
+
+RAISING_STATIC(count_results(wp_index* index, const char* q, uint32_t* num_results)) {
+  wp_query* query;
+  RELAY_ERROR(wp_query_parse(q, "body", &query));
+  RELAY_ERROR(wp_index_count_results(index, query, num_results));
+  wp_query_free(query);
+  return NO_ERROR;
+}
+
+TEST(the_oldest_segments_can_be_dropped) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10], doc_id;
+  uint32_t num_results, total;
+
+  RELAY_ERROR(setup_segments(&index, 35));
+  ASSERT_EQUALS_UINT(4, index->num_segments);
+  ASSERT(wp_segment_is_sealed(&index->segments[2])); // once we've rolled over from it
+  ASSERT(!wp_segment_is_sealed(&index->segments[3]));
+  ASSERT(wp_segment_exists(INDEX_PATH "0"));
+  ASSERT(wp_segment_exists(INDEX_PATH "1"));
+
+  // a query that's already under way when the segments go
+  RELAY_ERROR(wp_query_parse("common", "body", &query));
+  RELAY_ERROR(wp_index_setup_query(index, query));
+  RELAY_ERROR(wp_index_run_query(index, query, 10, &num_results, &results[0]));
+  ASSERT_EQUALS_UINT(10, num_results);
+  ASSERT_EQUALS_UINT64(35, results[0]);
+  total = num_results;
+
+  RELAY_ERROR(wp_index_drop_oldest_segments(index, 2));
+  ASSERT_EQUALS_UINT(2, index->num_segments);
+  ASSERT(!wp_segment_exists(INDEX_PATH "0"));
+  ASSERT(!wp_segment_exists(INDEX_PATH "1"));
+  ASSERT(wp_segment_exists(INDEX_PATH "2"));
+
+  do {
+    RELAY_ERROR(wp_index_run_query(index, query, 10, &num_results, &results[0]));
+    for(uint32_t i = 0; i < num_results; i++) ASSERT(results[i] > 20);
+    total += num_results;
+  } while(num_results > 0);
+  RELAY_ERROR(wp_index_teardown_query(index, query));
+  wp_query_free(query);
+  ASSERT_EQUALS_UINT(15, total);
+
+  // the rest keep their docids and labels
+  RUN_QUERY("d25");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(25, results[0]);
+  RUN_QUERY("d5");
+  ASSERT_EQUALS_UINT(0, num_results);
+  RELAY_ERROR(count_results(index, "~even", &num_results));
+  ASSERT_EQUALS_UINT(7, num_results);
+  RELAY_ERROR(wp_index_num_docs(index, &doc_id));
+  ASSERT_EQUALS_UINT64(15, doc_id);
+
+  // and numbering carries on
+  RELAY_ERROR(add_string(index, "common d36"));
+  RUN_QUERY("d36");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(36, results[0]);
+
+  // the same after a reload
+  RELAY_ERROR(wp_index_free(index));
+  ASSERT(wp_index_exists(INDEX_PATH));
+  RELAY_ERROR(wp_index_load(&index, INDEX_PATH));
+  RUN_QUERY("d25");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(25, results[0]);
+  RELAY_ERROR(count_results(index, "common", &num_results));
+  ASSERT_EQUALS_UINT(16, num_results);
+
+  RELAY_ERROR(shutdown(index));
+  ASSERT(!wp_index_exists(INDEX_PATH));
+  ASSERT(!wp_segment_exists(INDEX_PATH "2"));
+  ASSERT(!wp_segment_exists(INDEX_PATH "3"));
+  return NO_ERROR;
+}
+
+TEST(only_older_segments_can_be_merged) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10];
+  uint32_t num_results;
+
+  RELAY_ERROR(setup(&index));
+
+  wp_error* e = wp_index_merge_segments(index, 0, 1);
+  ASSERT(e != NULL);
+  wp_error_free(e);
+  e = wp_index_merge_segments(index, 0, 0);
+  ASSERT(e != NULL);
+  wp_error_free(e);
+
+  RUN_QUERY("three");
+  ASSERT_EQUALS_UINT(3, num_results);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+// every result of q, in the order they come out, a page at a time
+RAISING_STATIC(all_results(wp_index* index, const char* q, uint32_t max_num_results, uint64_t* results, uint32_t* num_results)) {
+  wp_query* query;
+  uint32_t n;
+
+  *num_results = 0;
+  RELAY_ERROR(wp_query_parse(q, "body", &query));
+  RELAY_ERROR(wp_index_setup_query(index, query));
+  do {
+    uint32_t page = max_num_results - *num_results < 10 ? max_num_results - *num_results : 10;
+    RELAY_ERROR(wp_index_run_query(index, query, page, &n, &results[*num_results]));
+    *num_results += n;
+  } while((n > 0) && (*num_results < max_num_results));
+  RELAY_ERROR(wp_index_teardown_query(index, query));
+  wp_query_free(query);
+
+  return NO_ERROR;
+}
+
+TEST(merged_segments_keep_their_docs) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10], before[50], after[50], num_docs;
+  uint32_t num_results, num_before, num_after, total;
+
+  RELAY_ERROR(setup_segments(&index, 35));
+  RELAY_ERROR(wp_index_delete_doc(index, 15));
+  RELAY_ERROR(wp_index_add_label(index, "star", 7));
+  RELAY_ERROR(wp_index_add_label(index, "star", 23));
+  ASSERT_EQUALS_UINT(4, index->num_segments);
+  RELAY_ERROR(all_results(index, "common", 50, before, &num_before));
+  ASSERT_EQUALS_UINT(34, num_before);
+
+  // a query that's already under way when the segments are merged
+  RELAY_ERROR(wp_query_parse("common", "body", &query));
+  RELAY_ERROR(wp_index_setup_query(index, query));
+  RELAY_ERROR(wp_index_run_query(index, query, 10, &num_results, &results[0]));
+  ASSERT_EQUALS_UINT(10, num_results);
+  ASSERT_EQUALS_UINT64(35, results[0]);
+  total = num_results;
+
+  RELAY_ERROR(wp_index_merge_segments(index, 0, 3));
+  ASSERT_EQUALS_UINT(2, index->num_segments);
+  ASSERT_EQUALS_UINT64(0, index->docid_offsets[0]);
+  ASSERT_EQUALS_UINT64(30, index->docid_offsets[1]);
+  ASSERT_EQUALS_UINT(3, index->segment_ids[1]);
+  for(int i = 0; i < 3; i++) {
+    char buf[100];
+    snprintf(buf, 100, INDEX_PATH "%d", i);
+    ASSERT(!wp_segment_exists(buf));
+  }
+
+  uint64_t last = results[num_results - 1];
+  do {
+    RELAY_ERROR(wp_index_run_query(index, query, 10, &num_results, &results[0]));
+    for(uint32_t i = 0; i < num_results; i++) {
+      ASSERT(results[i] < last);
+      ASSERT(results[i] != 15);
+      last = results[i];
+    }
+    total += num_results;
+  } while(num_results > 0);
+  RELAY_ERROR(wp_index_teardown_query(index, query));
+  wp_query_free(query);
+  ASSERT_EQUALS_UINT(34, total);
+
+  // every doc is where it was, with its labels, and deleted docs stay deleted
+  for(int pass = 0; pass < 2; pass++) {
+    RELAY_ERROR(all_results(index, "common", 50, after, &num_after));
+    ASSERT_EQUALS_UINT(num_before, num_after);
+    for(uint32_t i = 0; i < num_after; i++) ASSERT_EQUALS_UINT64(before[i], after[i]);
+
+    RUN_QUERY("d23");
+    ASSERT_EQUALS_UINT(1, num_results);
+    ASSERT_EQUALS_UINT64(23, results[0]);
+    RUN_QUERY("d15");
+    ASSERT_EQUALS_UINT(0, num_results);
+    RUN_QUERY("~star");
+    ASSERT_EQUALS_UINT(2, num_results);
+    ASSERT_EQUALS_UINT64(23, results[0]);
+    ASSERT_EQUALS_UINT64(7, results[1]);
+    RELAY_ERROR(count_results(index, "~even", &num_results));
+    ASSERT_EQUALS_UINT(17, num_results);
+    RELAY_ERROR(wp_index_num_docs(index, &num_docs));
+    ASSERT_EQUALS_UINT64(34, num_docs);
+
+    // and again after a reload
+    RELAY_ERROR(wp_index_free(index));
+    RELAY_ERROR(wp_index_load(&index, INDEX_PATH));
+    ASSERT_EQUALS_UINT(2, index->num_segments);
+    ASSERT_EQUALS_UINT64(30, index->docid_offsets[1]);
+  }
+
+  // the merged segment takes changes like any other
+  RELAY_ERROR(wp_index_delete_doc(index, 20));
+  RELAY_ERROR(wp_index_add_label(index, "star", 3));
+  RUN_QUERY("~star");
+  ASSERT_EQUALS_UINT(3, num_results);
+  ASSERT_EQUALS_UINT64(3, results[2]);
+  RELAY_ERROR(count_results(index, "common", &num_results));
+  ASSERT_EQUALS_UINT(33, num_results);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+TEST(segments_with_different_field_options_can_be_merged) {
+  wp_index* index;
+  wp_query* query;
+  uint64_t results[10];
+  uint32_t num_results;
+
+  // "common" has positions in the first and third segments, and only docids
+  // in the second
+  RELAY_ERROR(setup_segments(&index, 10));
+  RELAY_ERROR(wp_index_set_field_options(index, "body", WP_FIELD_DOCS_ONLY));
+  RELAY_ERROR(add_string(index, "common d11"));
+  RELAY_ERROR(add_string(index, "common d12"));
+  wp_index_set_max_segment_docs(index, 2);
+  RELAY_ERROR(wp_index_set_field_options(index, "body", WP_FIELD_POSITIONS));
+  RELAY_ERROR(add_string(index, "common d13"));
+  RELAY_ERROR(add_string(index, "common d14"));
+  RELAY_ERROR(add_string(index, "common d15"));
+  ASSERT_EQUALS_UINT(4, index->num_segments);
+
+  RELAY_ERROR(wp_index_merge_segments(index, 0, 3));
+  ASSERT_EQUALS_UINT(2, index->num_segments);
+
+  RELAY_ERROR(count_results(index, "common", &num_results));
+  ASSERT_EQUALS_UINT(15, num_results);
+  RUN_QUERY("d12");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(12, results[0]);
+  RUN_QUERY("d4");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(4, results[0]);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
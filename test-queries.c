@@ -48,6 +48,44 @@ TEST(query_cloning) {
   return NO_ERROR;
 }
 
+TEST(query_optimization) {
+  wp_query* q;
+  char buf[100];
+
+  RELAY_ERROR(wp_query_parse("a (b (c a)) -(-d)", "body", &q));
+  wp_query_optimize(q);
+  wp_query_to_s(q, 100, buf);
+  ASSERT(!strcmp(buf, "(AND body:\"a\" body:\"b\" body:\"c\" body:\"d\")"));
+  wp_query_free(q);
+
+  RELAY_ERROR(wp_query_parse("(a b) OR (a b) OR (c OR a)", "body", &q));
+  wp_query_optimize(q);
+  wp_query_to_s(q, 100, buf);
+  ASSERT(!strcmp(buf, "(OR (AND body:\"a\" body:\"b\") body:\"c\" body:\"a\")"));
+  wp_query_free(q);
+
+  RELAY_ERROR(wp_query_parse("* a *", "body", &q));
+  wp_query_optimize(q);
+  wp_query_to_s(q, 100, buf);
+  ASSERT(!strcmp(buf, "body:\"a\""));
+  wp_query_free(q);
+
+  RELAY_ERROR(wp_query_parse("* *", "body", &q));
+  wp_query_optimize(q);
+  wp_query_to_s(q, 100, buf);
+  ASSERT(!strcmp(buf, "<EVERY>"));
+  wp_query_free(q);
+
+  // order matters in phrases, and so do repeats
+  RELAY_ERROR(wp_query_parse("\"a a\" * OR a", "body", &q));
+  wp_query_optimize(q);
+  wp_query_to_s(q, 100, buf);
+  ASSERT(!strcmp(buf, "(AND (PHRASE body:\"a\" body:\"a\") (OR <EVERY> body:\"a\"))"));
+  wp_query_free(q);
+
+  return NO_ERROR;
+}
+
 static const char* substituter(const char* field, const char* term) {
   (void)field;
   char* ret = calloc(strlen(term) + 3, sizeof(char));
@@ -113,6 +113,58 @@ TEST(disjunctions) {
   return NO_ERROR;
 }
 
+TEST(wide_disjunctions) {
+  wp_index* index;
+  uint64_t results[10];
+  uint32_t num_results;
+  wp_query* query;
+  char buf[1024];
+
+  RELAY_ERROR(wp_index_delete(INDEX_PATH));
+  RELAY_ERROR(wp_index_create(&index, INDEX_PATH));
+
+  // most docs match two children of the disjunctions below at once
+  for(int i = 1; i <= 200; i++) {
+    snprintf(buf, 1024, "m%d m%d n%d", i % 50, (i * 7) % 50, i % 3);
+    RELAY_ERROR(add_string(index, buf));
+  }
+
+  char* s = buf;
+  for(int i = 0; i < 50; i++) s += sprintf(s, "%sm%d", i == 0 ? "" : " OR ", i);
+
+  uint32_t total = 0;
+  uint64_t last = UINT64_MAX;
+  RELAY_ERROR(wp_query_parse(buf, "body", &query));
+  RELAY_ERROR(wp_index_setup_query(index, query));
+  do {
+    RELAY_ERROR(wp_index_run_query(index, query, 10, &num_results, &results[0]));
+    for(uint32_t i = 0; i < num_results; i++) {
+      ASSERT(results[i] < last);
+      last = results[i];
+    }
+    total += num_results;
+  } while(num_results > 0);
+  RELAY_ERROR(wp_index_teardown_query(index, query));
+  wp_query_free(query);
+  ASSERT_EQUALS_UINT(200, total);
+
+  // and as a child of a conjunction, which advances rather than iterates it
+  uint32_t expected = 0;
+  for(int i = 1; i <= 200; i++) if((((i % 50) < 10) || (((i * 7) % 50) < 10)) && ((i % 3) == 0)) expected++;
+
+  s = buf;
+  s += sprintf(s, "n0 (");
+  for(int i = 0; i < 10; i++) s += sprintf(s, "%sm%d", i == 0 ? "" : " OR ", i);
+  sprintf(s, ")");
+  RELAY_ERROR(wp_query_parse(buf, "body", &query));
+  RELAY_ERROR(wp_index_count_results(index, query, &num_results));
+  wp_query_free(query);
+  ASSERT_EQUALS_UINT(expected, num_results);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
 TEST(phrases) {
   wp_index* index;
   uint64_t results[10];
@@ -405,3 +457,105 @@ TEST(every_selector) {
   RELAY_ERROR(shutdown(index));
   return NO_ERROR;
 }
+
+TEST(optimized_queries_find_the_same_docs) {
+  wp_index* index;
+  uint64_t results[10];
+  uint32_t num_results;
+  wp_query* query;
+
+  RELAY_ERROR(setup(&index));
+
+  RUN_QUERY("three (two (three -(-two)))");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(2, results[0]);
+  ASSERT_EQUALS_UINT64(1, results[1]);
+
+  RUN_QUERY("* four *");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(3, results[0]);
+  ASSERT_EQUALS_UINT64(2, results[1]);
+
+  RUN_QUERY("one OR (five OR one) OR one");
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT64(3, results[0]);
+  ASSERT_EQUALS_UINT64(1, results[1]);
+
+  // subtrees that can't match in this segment
+  RUN_QUERY("three (asdfasefs OR qwerqwer)");
+  ASSERT_EQUALS_UINT(0, num_results);
+
+  RUN_QUERY("(three asdfasefs) OR one");
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT64(1, results[0]);
+
+  RUN_QUERY("three -(asdfasefs OR -*)");
+  ASSERT_EQUALS_UINT(3, num_results);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
+
+// pages through all of q's results, checking that they come out in order
+RAISING_STATIC(count_all_results(wp_index* index, const char* q, uint32_t* total, int* ordered)) {
+  wp_query* query;
+  uint64_t results[10], last = UINT64_MAX;
+  uint32_t num_results;
+
+  *total = 0;
+  *ordered = 1;
+  RELAY_ERROR(wp_query_parse(q, "body", &query));
+  RELAY_ERROR(wp_index_setup_query(index, query));
+  do {
+    RELAY_ERROR(wp_index_run_query(index, query, 10, &num_results, &results[0]));
+    for(uint32_t i = 0; i < num_results; i++) {
+      if(results[i] >= last) *ordered = 0;
+      last = results[i];
+    }
+    *total += num_results;
+  } while(num_results > 0);
+  RELAY_ERROR(wp_index_teardown_query(index, query));
+  wp_query_free(query);
+
+  return NO_ERROR;
+}
+
+TEST(skewed_conjunctions) {
+  wp_index* index;
+  uint32_t total;
+  int ordered;
+  char buf[100];
+
+  RELAY_ERROR(wp_index_delete(INDEX_PATH));
+  RELAY_ERROR(wp_index_create(&index, INDEX_PATH));
+
+  for(int i = 1; i <= 1000; i++) {
+    snprintf(buf, 100, "all half%d%s", i % 2, (i % 50) == 0 ? " rare" : "");
+    RELAY_ERROR(add_string(index, buf));
+    if((i % 3) == 0) RELAY_ERROR(wp_index_add_label(index, "third", i));
+  }
+
+  // children of about the same size are intersected a block at a time; much
+  // more common ones are probed
+  RELAY_ERROR(count_all_results(index, "half0 all", &total, &ordered));
+  ASSERT_EQUALS_UINT(500, total);
+  ASSERT(ordered);
+
+  RELAY_ERROR(count_all_results(index, "rare all", &total, &ordered));
+  ASSERT_EQUALS_UINT(20, total);
+  ASSERT(ordered);
+
+  RELAY_ERROR(count_all_results(index, "all half1 rare", &total, &ordered));
+  ASSERT_EQUALS_UINT(0, total);
+
+  RELAY_ERROR(count_all_results(index, "half0 ~third", &total, &ordered));
+  ASSERT_EQUALS_UINT(166, total);
+  ASSERT(ordered);
+
+  RELAY_ERROR(count_all_results(index, "rare ~third all", &total, &ordered));
+  ASSERT_EQUALS_UINT(6, total);
+  ASSERT(ordered);
+
+  RELAY_ERROR(shutdown(index));
+  return NO_ERROR;
+}
@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include "test.h"
 #include "segment.h"
 #include "tokenizer.lex.h"
@@ -14,18 +15,18 @@ wp_error* setup(wp_segment* segment) {
 
 #define ADD_DOC(word, pos) \
   positions[0] = pos; \
-  RELAY_ERROR(wp_segment_ensure_fit(segment, postings_bytes, 0, &success)); \
+  memset(&growth, 0, sizeof(growth)); \
+  RELAY_ERROR(wp_segment_sizeof_posting(segment, "body", word, 1, positions, &growth)); \
+  RELAY_ERROR(wp_segment_ensure_fit(segment, &growth, &success)); \
   if(success != 1) RAISE_ERROR("couldn't ensure segment fit"); \
   RELAY_ERROR(wp_segment_add_posting(segment, "body", word, doc_id, 1, positions));
 
 wp_error* add_docs(wp_segment* segment) {
   docid_t doc_id;
   pos_t positions[10];
-  uint32_t postings_bytes;
+  segment_growth growth;
   int success;
 
-  RELAY_ERROR(wp_segment_sizeof_posarray(segment, 1, NULL, &postings_bytes));
-
   RELAY_ERROR(wp_segment_grab_docid(segment, &doc_id));
   ADD_DOC("one", 0);
   ADD_DOC("two", 1);
@@ -51,7 +52,7 @@ TEST(initial_state) {
   segment_info* si = MMAP_OBJ(segment.seginfo, segment_info);
   ASSERT_EQUALS_UINT(0, si->num_docs);
   postings_region* pr = MMAP_OBJ(segment.postings, postings_region);
-  ASSERT_EQUALS_UINT(0, pr->num_postings);
+  ASSERT_EQUALS_UINT64(0, pr->num_postings);
 
   RELAY_ERROR(wp_segment_unload(&segment));
   return NO_ERROR;
@@ -73,7 +74,7 @@ TEST(adding_a_doc_increments_counts) {
   segment_info* si = MMAP_OBJ(segment.seginfo, segment_info);
   ASSERT_EQUALS_UINT(1, si->num_docs);
   postings_region* pr = MMAP_OBJ(segment.postings, postings_region);
-  ASSERT_EQUALS_UINT(2, pr->num_postings);
+  ASSERT_EQUALS_UINT64(2, pr->num_postings);
 
   RELAY_ERROR(wp_segment_unload(&segment));
   return NO_ERROR;
@@ -404,3 +405,955 @@ TEST(negation_queries) {
   return NO_ERROR;
 }
 
+
+TEST(growth_matches_what_adding_postings_takes_up) {
+  wp_segment segment;
+  segment_growth growth;
+  pos_t positions[3] = { 0, 200, 40000 };
+  int success;
+  docid_t doc_id;
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "msgid", WP_FIELD_DOCS_ONLY));
+
+  // enough docs for "body:common" to need a few chunks and skip records
+  for(int i = 0; i < 3 * POSTINGS_SKIP_INTERVAL; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+
+    memset(&growth, 0, sizeof(growth));
+    RELAY_ERROR(wp_segment_sizeof_posting(&segment, "body", "common", 3, positions, &growth));
+    RELAY_ERROR(wp_segment_sizeof_posting(&segment, "msgid", (i % 2) ? "odd" : "even", 1, positions, &growth));
+
+    postings_region* pr = MMAP_OBJ(segment.postings, postings_region);
+    postings_region* ps = MMAP_OBJ(segment.positions, postings_region);
+    termhash* th = MMAP_OBJ(segment.termhash, termhash);
+    offset_t postings_head = pr->postings_head;
+    offset_t positions_head = ps->postings_head;
+    uint32_t num_terms = th->n_occupied;
+
+    RELAY_ERROR(wp_segment_ensure_fit(&segment, &growth, &success));
+    ASSERT(success == 1);
+    RELAY_ERROR(wp_segment_add_posting(&segment, "body", "common", doc_id, 3, positions));
+    RELAY_ERROR(wp_segment_add_posting(&segment, "msgid", (i % 2) ? "odd" : "even", doc_id, 1, positions));
+
+    pr = MMAP_OBJ(segment.postings, postings_region);
+    ps = MMAP_OBJ(segment.positions, postings_region);
+    th = MMAP_OBJ(segment.termhash, termhash);
+    // postings are allowed for at the largest they could be
+    ASSERT(pr->postings_head <= postings_head + growth.postings_bytes);
+    ASSERT_EQUALS_UINT64(positions_head + growth.positions_bytes, ps->postings_head);
+    ASSERT_EQUALS_UINT(num_terms + growth.num_terms, th->n_occupied);
+  }
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+wp_error* add_long_docs(wp_segment* segment) {
+  docid_t doc_id;
+  pos_t positions[10];
+  segment_growth growth;
+  int success;
+
+  // enough docs for several skip records on "common"
+  for(int i = 1; i <= 10 * POSTINGS_SKIP_INTERVAL; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(segment, &doc_id));
+    ADD_DOC("common", 0);
+    if((i % 77) == 0) {
+      ADD_DOC("rare", 1);
+    }
+  }
+
+  return NO_ERROR;
+}
+
+TEST(conjunctions_over_long_posting_lists) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query;
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(add_long_docs(&segment));
+
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_term("body", "rare"));
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  RUN_QUERY(query);
+
+  ASSERT_EQUALS_UINT(4, num_results);
+  ASSERT_EQUALS_UINT(308, results[0].doc_id);
+  ASSERT_EQUALS_UINT(231, results[1].doc_id);
+  ASSERT_EQUALS_UINT(154, results[2].doc_id);
+  ASSERT_EQUALS_UINT(77, results[3].doc_id);
+
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_term("body", "rare"));
+  query = wp_query_add(query, wp_query_new_negation());
+  query->last = wp_query_add(query->last, wp_query_new_term("body", "common"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(0, num_results);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(rarest_child_order_keeps_results_in_query_order) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query;
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(add_long_docs(&segment));
+
+  // "rare" drives the search, but its match still comes second
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  query = wp_query_add(query, wp_query_new_term("body", "rare"));
+  RUN_QUERY(query);
+
+  ASSERT_EQUALS_UINT(4, num_results);
+  ASSERT_EQUALS_UINT(308, results[0].doc_id);
+  ASSERT_EQUALS_UINT(77, results[3].doc_id);
+  ASSERT_EQUALS_UINT(2, results[0].num_doc_matches);
+  ASSERT(!strcmp("common", results[0].doc_matches[0].word));
+  ASSERT(!strcmp("rare", results[0].doc_matches[1].word));
+
+  // positions are still matched in the phrase's order
+  query = wp_query_new_phrase();
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  query = wp_query_add(query, wp_query_new_term("body", "rare"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(4, num_results);
+  ASSERT_EQUALS_UINT(231, results[1].doc_id);
+
+  query = wp_query_new_phrase();
+  query = wp_query_add(query, wp_query_new_term("body", "rare"));
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(0, num_results);
+
+  // a negation is never cheaper than the term it's paired with here
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_negation());
+  query->last = wp_query_add(query->last, wp_query_new_term("body", "rare"));
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(10, num_results);
+  ASSERT_EQUALS_UINT(10 * POSTINGS_SKIP_INTERVAL, results[0].doc_id);
+
+  // a missing term means nothing to do
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  query = wp_query_add(query, wp_query_new_term("body", "missing"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(0, num_results);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+#define RUN_QUERY_DOCIDS(query) \
+  RELAY_ERROR(wp_search_init_search_state(query, &segment)); \
+  RELAY_ERROR(wp_search_run_query_on_segment_docids(query, &segment, 1000, &num_docids, docids)); \
+  RELAY_ERROR(wp_search_release_search_state(query));
+
+TEST(docid_blocks_match_results) {
+  wp_segment segment;
+  uint32_t num_results, num_docids;
+  search_result results[1000];
+  docid_t docids[1000];
+  wp_query* queries[6];
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(add_long_docs(&segment));
+  RELAY_ERROR(wp_segment_delete_doc(&segment, 154));
+
+  queries[0] = wp_query_new_term("body", "common");
+
+  queries[1] = wp_query_new_conjunction();
+  queries[1] = wp_query_add(queries[1], wp_query_new_term("body", "common"));
+  queries[1] = wp_query_add(queries[1], wp_query_new_term("body", "rare"));
+
+  queries[2] = wp_query_new_disjunction();
+  queries[2] = wp_query_add(queries[2], wp_query_new_term("body", "rare"));
+  queries[2] = wp_query_add(queries[2], wp_query_new_term("body", "common"));
+
+  queries[3] = wp_query_new_negation();
+  queries[3] = wp_query_add(queries[3], wp_query_new_term("body", "rare"));
+
+  // the every child used to lose doc 1
+  queries[4] = wp_query_new_conjunction();
+  queries[4] = wp_query_add(queries[4], wp_query_new_every());
+  queries[4] = wp_query_add(queries[4], wp_query_new_negation());
+  queries[4]->last = wp_query_add(queries[4]->last, wp_query_new_term("body", "rare"));
+
+  queries[5] = wp_query_new_negation();
+  queries[5] = wp_query_add(queries[5], wp_query_new_disjunction());
+  queries[5]->last = wp_query_add(queries[5]->last, wp_query_new_term("body", "rare"));
+  queries[5]->last = wp_query_add(queries[5]->last, wp_query_new_term("body", "missing"));
+
+  uint32_t expected[6] = { 10 * POSTINGS_SKIP_INTERVAL - 1, 3, 10 * POSTINGS_SKIP_INTERVAL - 1, 10 * POSTINGS_SKIP_INTERVAL - 4, 10 * POSTINGS_SKIP_INTERVAL - 4, 10 * POSTINGS_SKIP_INTERVAL - 4 };
+  for(int i = 0; i < 6; i++) {
+    RELAY_ERROR(wp_search_init_search_state(queries[i], &segment));
+    RELAY_ERROR(wp_search_run_query_on_segment(queries[i], &segment, 1000, &num_results, results));
+    RELAY_ERROR(wp_search_release_search_state(queries[i]));
+    RUN_QUERY_DOCIDS(queries[i]);
+
+    ASSERT_EQUALS_UINT(expected[i], num_docids);
+    ASSERT_EQUALS_UINT(num_results, num_docids);
+    for(uint32_t j = 0; j < num_docids; j++) ASSERT_EQUALS_UINT(results[j].doc_id, docids[j]);
+  }
+
+  // a block at a time from the top
+  RELAY_ERROR(wp_search_init_search_state(queries[2], &segment));
+  uint32_t total = 0;
+  do {
+    RELAY_ERROR(wp_search_run_query_on_segment_docids(queries[2], &segment, 7, &num_docids, &docids[total]));
+    total += num_docids;
+  } while(num_docids == 7);
+  RELAY_ERROR(wp_search_release_search_state(queries[2]));
+  ASSERT_EQUALS_UINT(expected[2], total);
+  ASSERT_EQUALS_UINT(10 * POSTINGS_SKIP_INTERVAL, docids[0]);
+  ASSERT_EQUALS_UINT(1, docids[total - 1]);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(sealing_preserves_query_results) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query;
+  pos_t positions[10];
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(add_docs(&segment));
+  RELAY_ERROR(add_long_docs(&segment));
+
+  uint32_t live_size = MMAP_OBJ(segment.postings, postings_region)->postings_head;
+  ASSERT(!wp_segment_is_sealed(&segment));
+  RELAY_ERROR(wp_segment_seal(&segment));
+  ASSERT(wp_segment_is_sealed(&segment));
+  ASSERT(MMAP_OBJ(segment.postings, postings_region)->postings_head < live_size);
+
+  query = wp_query_new_phrase();
+  query = wp_query_add(query, wp_query_new_term("body", "two"));
+  query = wp_query_add(query, wp_query_new_term("body", "three"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(2, num_results);
+  ASSERT_EQUALS_UINT(2, results[0].doc_id);
+  ASSERT_EQUALS_UINT(1, results[1].doc_id);
+
+  // the long docs start after the three from add_docs
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_term("body", "rare"));
+  query = wp_query_add(query, wp_query_new_term("body", "common"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(4, num_results);
+  ASSERT_EQUALS_UINT(311, results[0].doc_id);
+  ASSERT_EQUALS_UINT(234, results[1].doc_id);
+  ASSERT_EQUALS_UINT(157, results[2].doc_id);
+  ASSERT_EQUALS_UINT(80, results[3].doc_id);
+
+  query = wp_query_new_term("body", "common");
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(10, num_results);
+  ASSERT_EQUALS_UINT(323, results[0].doc_id);
+  ASSERT_EQUALS_UINT(314, results[9].doc_id);
+
+  // sealed segments take no more postings
+  positions[0] = 0;
+  wp_error* e = wp_segment_add_posting(&segment, "body", "hello", 1000, 1, positions);
+  ASSERT(e != NULL);
+  wp_error_free(e);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+// copies a file, for faking a seal that died partway through
+RAISING_STATIC(copy_file(const char* from, const char* to)) {
+  char buf[4096];
+  size_t n;
+
+  FILE* in = fopen(from, "r");
+  if(in == NULL) RAISE_SYSERROR("cannot open %s", from);
+  FILE* out = fopen(to, "w");
+  if(out == NULL) {
+    fclose(in);
+    RAISE_SYSERROR("cannot create %s", to);
+  }
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+  fclose(in);
+  fclose(out);
+
+  return NO_ERROR;
+}
+
+TEST(interrupted_seals_are_finished_or_thrown_away) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query = wp_query_new_term("body", "common");
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(add_docs(&segment));
+  RELAY_ERROR(add_long_docs(&segment));
+  RELAY_ERROR(copy_file(SEGMENT_PATH ".pr", SEGMENT_PATH ".pr.live"));
+  RELAY_ERROR(copy_file(SEGMENT_PATH ".ps", SEGMENT_PATH ".ps.live"));
+  RELAY_ERROR(copy_file(SEGMENT_PATH ".th", SEGMENT_PATH ".th.live"));
+  RELAY_ERROR(wp_segment_unload(&segment));
+
+  // a seal that died before committing leaves files that are thrown away
+  RELAY_ERROR(copy_file(SEGMENT_PATH ".pr", SEGMENT_PATH ".pr.sealing"));
+  RELAY_ERROR(wp_segment_load(&segment, SEGMENT_PATH));
+  ASSERT(!wp_segment_is_sealed(&segment));
+  ASSERT(access(SEGMENT_PATH ".pr.sealing", F_OK) == -1);
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(10, num_results);
+  ASSERT_EQUALS_UINT(323, results[0].doc_id);
+
+  // one that committed but moved nothing into place is finished. fake it
+  // by sealing, then putting the live files back.
+  RELAY_ERROR(wp_segment_seal(&segment));
+  termhash* th = MMAP_OBJ(segment.termhash, termhash);
+  uint64_t vals_size = sizeof(posting_list_header) * th->n_buckets;
+  mmap_obj vals;
+  RELAY_ERROR(mmap_obj_create(&vals, "wp/sealvals", SEGMENT_PATH ".tv.sealing", vals_size));
+  memcpy(MMAP_OBJ(vals, posting_list_header), TERMHASH_VALS(th), vals_size);
+  RELAY_ERROR(mmap_obj_unload(&vals));
+  MMAP_OBJ(segment.seginfo, segment_info)->seal_committed = 1;
+  uint32_t generation = wp_segment_generation(&segment);
+  RELAY_ERROR(wp_segment_unload(&segment));
+
+  ASSERT(rename(SEGMENT_PATH ".pr", SEGMENT_PATH ".pr.sealing") == 0);
+  ASSERT(rename(SEGMENT_PATH ".ps", SEGMENT_PATH ".ps.sealing") == 0);
+  ASSERT(rename(SEGMENT_PATH ".pr.live", SEGMENT_PATH ".pr") == 0);
+  ASSERT(rename(SEGMENT_PATH ".ps.live", SEGMENT_PATH ".ps") == 0);
+  ASSERT(rename(SEGMENT_PATH ".th.live", SEGMENT_PATH ".th") == 0);
+
+  RELAY_ERROR(wp_segment_load(&segment, SEGMENT_PATH));
+  ASSERT(wp_segment_is_sealed(&segment));
+  ASSERT(!MMAP_OBJ(segment.seginfo, segment_info)->seal_committed);
+  ASSERT(wp_segment_generation(&segment) != generation);
+  ASSERT(access(SEGMENT_PATH ".pr.sealing", F_OK) == -1);
+  ASSERT(access(SEGMENT_PATH ".ps.sealing", F_OK) == -1);
+  ASSERT(access(SEGMENT_PATH ".tv.sealing", F_OK) == -1);
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(10, num_results);
+  ASSERT_EQUALS_UINT(323, results[0].doc_id);
+  ASSERT_EQUALS_UINT(314, results[9].doc_id);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+// runs a query to completion with positions, summing up the doc ids and
+// positions of the results so that runs can be compared
+RAISING_STATIC(run_query_sum(wp_segment* segment, wp_query* query, uint32_t* num_results, uint64_t* sum)) {
+  search_result results[100];
+  uint32_t n;
+
+  *num_results = 0;
+  *sum = 0;
+  RELAY_ERROR(wp_search_init_search_state(query, segment));
+  RELAY_ERROR(wp_search_request_positions(query));
+  do {
+    RELAY_ERROR(wp_search_run_query_on_segment(query, segment, 100, &n, results));
+    for(uint32_t i = 0; i < n; i++) {
+      *sum = *sum * 31 + results[i].doc_id;
+      for(uint16_t j = 0; j < results[i].num_doc_matches; j++) {
+        doc_match* dm = &results[i].doc_matches[j];
+        *sum = *sum * 31 + dm->num_positions;
+        if(dm->positions != NULL) for(uint16_t k = 0; k < dm->num_positions; k++) *sum = *sum * 31 + dm->positions[k];
+      }
+      wp_search_result_free(&results[i]);
+    }
+    *num_results += n;
+  } while(n == 100);
+  RELAY_ERROR(wp_search_release_search_state(query));
+
+  return NO_ERROR;
+}
+
+RAISING_STATIC(add_fitted_posting(wp_segment* segment, const char* field, const char* word, docid_t doc_id, uint32_t num_positions, pos_t* positions)) {
+  segment_growth growth;
+  int success;
+
+  memset(&growth, 0, sizeof(growth));
+  RELAY_ERROR(wp_segment_sizeof_posting(segment, field, word, num_positions, positions, &growth));
+  RELAY_ERROR(wp_segment_ensure_fit(segment, &growth, &success));
+  if(success != 1) RAISE_ERROR("couldn't ensure segment fit");
+  RELAY_ERROR(wp_segment_add_posting(segment, field, word, doc_id, num_positions, positions));
+
+  return NO_ERROR;
+}
+
+static posting_list_header* term_plh(wp_segment* segment, const char* field, const char* word) {
+  stringmap* sh = MMAP_OBJ(segment->stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(segment->stringpool, stringpool);
+  term t;
+
+  t.field_s = stringmap_string_to_int(sh, sp, field);
+  t.word_s = stringmap_string_to_int(sh, sp, word);
+  return termhash_get_val(MMAP_OBJ(segment->termhash, termhash), t);
+}
+
+TEST(terms_get_growing_chunks_only_once_they_need_them) {
+  wp_segment segment;
+  segment_growth growth;
+  pos_t positions[1] = { 3 };
+  char buf[20];
+  int success;
+  docid_t doc_id;
+
+  RELAY_ERROR(setup(&segment));
+
+  // words that only occur once take up just what their posting needs, with
+  // no chunk to spare
+  offset_t start = MMAP_OBJ(segment.postings, postings_region)->postings_head;
+  for(int i = 0; i < 200; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    snprintf(buf, 20, "once%d", i);
+    memset(&growth, 0, sizeof(growth));
+    RELAY_ERROR(wp_segment_sizeof_posting(&segment, "body", buf, 1, positions, &growth));
+    RELAY_ERROR(wp_segment_ensure_fit(&segment, &growth, &success));
+    ASSERT(success == 1);
+    RELAY_ERROR(wp_segment_add_posting(&segment, "body", buf, doc_id, 1, positions));
+
+    posting_list_header* plh = term_plh(&segment, "body", buf);
+    ASSERT(plh->chunk_head == plh->chunk_tail);
+  }
+  ASSERT(MMAP_OBJ(segment.postings, postings_region)->postings_head - start <= 200 * 8);
+
+  // a common word, interleaved with more of those, gets chunks of its own
+  // that grow as it does, with its postings one after the other within each
+  uint32_t num_chunks = 0;
+  offset_t last_size = 0, last_tail = OFFSET_NONE, last_head = OFFSET_NONE;
+  for(int i = 0; i < 600; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    RELAY_ERROR(add_fitted_posting(&segment, "body", "common", doc_id, 1, positions));
+    snprintf(buf, 20, "also%d", i);
+    RELAY_ERROR(add_fitted_posting(&segment, "body", buf, doc_id, 1, positions));
+
+    posting_list_header* plh = term_plh(&segment, "body", "common");
+    if(plh->chunk_tail != last_tail) { // a new chunk, which this posting starts
+      offset_t size = plh->chunk_tail - plh->next_offset;
+      if(i < POSTINGS_UNCHUNKED) ASSERT(plh->chunk_head == plh->chunk_tail);
+      else {
+        ASSERT(size >= last_size);
+        ASSERT(size <= POSTINGS_MAX_CHUNK_SIZE);
+        last_size = size;
+        num_chunks++;
+      }
+    }
+    else ASSERT(plh->next_offset == last_head);
+    last_tail = plh->chunk_tail;
+    last_head = plh->chunk_head;
+  }
+  ASSERT_EQUALS_UINT64(POSTINGS_MAX_CHUNK_SIZE, last_size);
+  ASSERT(num_chunks < 20);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+#define NUM_DENSE_QUERIES 6
+
+TEST(dense_terms_find_the_same_docs_as_lists) {
+  wp_segment segment;
+  docid_t doc_id;
+  pos_t positions[5] = { 1, 2, 4, 8, 300 };
+  uint32_t counts[2][NUM_DENSE_QUERIES];
+  uint64_t sums[2][NUM_DENSE_QUERIES];
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "to", WP_FIELD_DOCS_ONLY));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "from", WP_FIELD_FREQS));
+
+  for(uint32_t i = 1; i <= 1000; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    if((i % 3) != 0) RELAY_ERROR(add_fitted_posting(&segment, "body", "dense", doc_id, 1 + i % 5, positions));
+    if((i % 50) == 0) RELAY_ERROR(add_fitted_posting(&segment, "body", "sparse", doc_id, 1, &positions[1]));
+    RELAY_ERROR(add_fitted_posting(&segment, "to", "all", doc_id, 1, positions));
+    if((i % 2) == 0) RELAY_ERROR(add_fitted_posting(&segment, "from", "half", doc_id, 1 + i % 4, positions));
+  }
+
+  for(int sealed = 0; sealed < 2; sealed++) {
+    if(sealed) RELAY_ERROR(wp_segment_seal(&segment));
+
+    wp_query* queries[NUM_DENSE_QUERIES];
+    queries[0] = wp_query_new_term("body", "dense");
+    queries[1] = wp_query_new_term("from", "half");
+    queries[2] = wp_query_add(wp_query_add(wp_query_new_conjunction(), wp_query_new_term("body", "sparse")), wp_query_new_term("body", "dense"));
+    queries[3] = wp_query_add(wp_query_add(wp_query_new_conjunction(), wp_query_new_term("from", "half")), wp_query_new_term("to", "all"));
+    queries[4] = wp_query_add(wp_query_new_conjunction(), wp_query_new_term("from", "half"));
+    queries[4] = wp_query_add(queries[4], wp_query_add(wp_query_new_negation(), wp_query_new_term("body", "dense")));
+    queries[5] = wp_query_add(wp_query_add(wp_query_new_phrase(), wp_query_new_term("body", "dense")), wp_query_new_term("body", "dense"));
+    for(int i = 0; i < NUM_DENSE_QUERIES; i++) RELAY_ERROR(run_query_sum(&segment, queries[i], &counts[sealed][i], &sums[sealed][i]));
+  }
+
+  ASSERT_EQUALS_UINT(667, counts[0][0]);
+  ASSERT_EQUALS_UINT(500, counts[0][1]);
+  ASSERT_EQUALS_UINT(14, counts[0][2]);
+  ASSERT_EQUALS_UINT(500, counts[0][3]);
+  ASSERT_EQUALS_UINT(166, counts[0][4]);
+  for(int i = 0; i < NUM_DENSE_QUERIES; i++) {
+    ASSERT_EQUALS_UINT(counts[0][i], counts[1][i]);
+    ASSERT_EQUALS_UINT64(sums[0][i], sums[1][i]);
+  }
+
+  // only the common terms went dense
+  stringmap* sh = MMAP_OBJ(segment.stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(segment.stringpool, stringpool);
+  termhash* th = MMAP_OBJ(segment.termhash, termhash);
+  term t = { .field_s = stringmap_string_to_int(sh, sp, "body"), .word_s = stringmap_string_to_int(sh, sp, "dense") };
+  ASSERT(termhash_get_val(th, t)->dense);
+  t.word_s = stringmap_string_to_int(sh, sp, "sparse");
+  ASSERT(!termhash_get_val(th, t)->dense);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(reading_many_positions) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query;
+  pos_t positions[100];
+  docid_t doc_id;
+
+  RELAY_ERROR(setup(&segment));
+
+  // mostly single-byte deltas, with the occasional multi-byte one
+  for(uint32_t i = 0; i < 100; i++) positions[i] = (i * 3) + ((i / 20) * 1000);
+  RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+  RELAY_ERROR(wp_segment_add_posting(&segment, "body", "many", doc_id, 100, positions));
+
+  for(int sealed = 0; sealed < 2; sealed++) {
+    if(sealed) RELAY_ERROR(wp_segment_seal(&segment));
+
+    // positions are only decoded on request
+    query = wp_query_new_term("body", "many");
+    RUN_QUERY(query);
+    ASSERT_EQUALS_UINT(1, num_results);
+    ASSERT_EQUALS_UINT(0, results[0].doc_matches[0].num_positions);
+
+    query = wp_query_new_term("body", "many");
+    RELAY_ERROR(wp_search_init_search_state(query, &segment));
+    RELAY_ERROR(wp_search_request_positions(query));
+    RELAY_ERROR(wp_search_run_query_on_segment(query, &segment, 10, &num_results, &results[0]));
+    RELAY_ERROR(wp_search_release_search_state(query));
+    ASSERT_EQUALS_UINT(1, num_results);
+    ASSERT_EQUALS_UINT(1, results[0].num_doc_matches);
+    ASSERT_EQUALS_UINT(100, results[0].doc_matches[0].num_positions);
+    for(uint32_t i = 0; i < 100; i++) ASSERT_EQUALS_UINT(positions[i], results[0].doc_matches[0].positions[i]);
+  }
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(field_options_limit_what_is_stored) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query;
+  pos_t positions[3] = { 0, 5, 9 };
+  pos_t position = 1;
+  docid_t doc_id;
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "to", WP_FIELD_DOCS_ONLY));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "from", WP_FIELD_FREQS));
+  ASSERT_EQUALS_UINT(WP_FIELD_DOCS_ONLY, wp_segment_field_options(&segment, "to"));
+  ASSERT_EQUALS_UINT(WP_FIELD_POSITIONS, wp_segment_field_options(&segment, "body"));
+
+  for(int i = 0; i < 40; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    RELAY_ERROR(wp_segment_add_posting(&segment, "to", "bob", doc_id, 3, positions));
+    RELAY_ERROR(wp_segment_add_posting(&segment, "from", "alice", doc_id, 3, positions));
+    RELAY_ERROR(wp_segment_add_posting(&segment, "from", "carol", doc_id, 1, &position));
+    RELAY_ERROR(wp_segment_add_posting(&segment, "body", "carol", doc_id, 1, &position));
+  }
+
+  // only the body terms took up any room in the positions region
+  postings_region* ps = MMAP_OBJ(segment.positions, postings_region);
+  ASSERT_EQUALS_UINT64(41, ps->postings_head);
+
+  for(int sealed = 0; sealed < 2; sealed++) {
+    if(sealed) RELAY_ERROR(wp_segment_seal(&segment));
+
+    query = wp_query_new_term("to", "bob");
+    RELAY_ERROR(wp_search_init_search_state(query, &segment));
+    RELAY_ERROR(wp_search_request_positions(query));
+    RELAY_ERROR(wp_search_run_query_on_segment(query, &segment, 10, &num_results, &results[0]));
+    RELAY_ERROR(wp_search_release_search_state(query));
+    ASSERT_EQUALS_UINT(10, num_results);
+    ASSERT_EQUALS_UINT(40, results[0].doc_id);
+    ASSERT_EQUALS_UINT(0, results[0].doc_matches[0].num_positions);
+    ASSERT(results[0].doc_matches[0].positions == NULL);
+
+    // frequencies are there whether positions are requested or not
+    query = wp_query_new_term("from", "alice");
+    RUN_QUERY(query);
+    ASSERT_EQUALS_UINT(10, num_results);
+    ASSERT_EQUALS_UINT(3, results[9].doc_matches[0].num_positions);
+    ASSERT(results[9].doc_matches[0].positions == NULL);
+
+    query = wp_query_new_conjunction();
+    query = wp_query_add(query, wp_query_new_term("to", "bob"));
+    query = wp_query_add(query, wp_query_new_term("from", "carol"));
+    RUN_QUERY(query);
+    ASSERT_EQUALS_UINT(10, num_results);
+    ASSERT_EQUALS_UINT(31, results[9].doc_id);
+    ASSERT_EQUALS_UINT(1, results[9].doc_matches[1].num_positions);
+
+    // phrases need positions
+    query = wp_query_new_phrase();
+    query = wp_query_add(query, wp_query_new_term("from", "alice"));
+    query = wp_query_add(query, wp_query_new_term("from", "carol"));
+    RUN_QUERY(query);
+    ASSERT_EQUALS_UINT(0, num_results);
+  }
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(labels_on_many_docs) {
+  wp_segment segment;
+  uint32_t num_results;
+  search_result results[10];
+  wp_query* query;
+  docid_t doc_id;
+  posting po;
+
+  RELAY_ERROR(setup(&segment));
+
+  // enough docs for several containers, each big enough to be a bitmap
+  for(uint32_t i = 1; i <= 3 * 65536; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    if((doc_id % 3) == 0) RELAY_ERROR(wp_segment_add_label(&segment, "all", doc_id));
+  }
+  RELAY_ERROR(wp_segment_add_label(&segment, "all", 3)); // already there
+  RELAY_ERROR(wp_segment_add_label(&segment, "one", 69999));
+
+  stringmap* sh = MMAP_OBJ(segment.stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(segment.stringpool, stringpool);
+  uint32_t all_s = stringmap_string_to_int(sh, sp, "all");
+
+  // iterating goes through every labeled doc in descending order
+  uint32_t count = 0;
+  int in_order = 1;
+  docid_t last_doc_id = 3 * 65536 + 3;
+  RELAY_ERROR(wp_segment_read_label(&segment, all_s, MAX_LOGICAL_DOCID, &po));
+  while(po.doc_id != DOCID_NONE) {
+    if(po.doc_id != last_doc_id - 3) in_order = 0;
+    last_doc_id = po.doc_id;
+    count++;
+    RELAY_ERROR(wp_segment_read_label(&segment, all_s, po.doc_id - 1, &po));
+  }
+  ASSERT(in_order);
+  ASSERT_EQUALS_UINT(65536, count);
+
+  // and docs can be probed directly
+  RELAY_ERROR(wp_segment_read_label(&segment, all_s, 70000, &po));
+  ASSERT_EQUALS_UINT(69999, po.doc_id);
+  RELAY_ERROR(wp_segment_read_label(&segment, all_s, 2, &po));
+  ASSERT_EQUALS_UINT(DOCID_NONE, po.doc_id);
+
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_label("all"));
+  query = wp_query_add(query, wp_query_new_label("one"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(1, num_results);
+  ASSERT_EQUALS_UINT(69999, results[0].doc_id);
+
+  // emptying out the middle container turns it back into an array and then
+  // drops it
+  for(docid_t i = 65536; i < 2 * 65536; i++) if(i != 69999) RELAY_ERROR(wp_segment_remove_label(&segment, "all", i));
+  RELAY_ERROR(wp_segment_read_label(&segment, all_s, 2 * 65536, &po));
+  ASSERT_EQUALS_UINT(69999, po.doc_id);
+
+  RELAY_ERROR(wp_segment_remove_label(&segment, "all", 69999));
+  RELAY_ERROR(wp_segment_remove_label(&segment, "all", 69999)); // already gone
+  RELAY_ERROR(wp_segment_read_label(&segment, all_s, 2 * 65536, &po));
+  ASSERT_EQUALS_UINT(65535, po.doc_id);
+
+  query = wp_query_new_conjunction();
+  query = wp_query_add(query, wp_query_new_label("all"));
+  query = wp_query_add(query, wp_query_new_label("one"));
+  RUN_QUERY(query);
+  ASSERT_EQUALS_UINT(0, num_results);
+
+  termhash* th = MMAP_OBJ(segment.termhash, termhash);
+  term t = { .field_s = 0, .word_s = all_s };
+  ASSERT_EQUALS_UINT(65536 - 65536 / 3, termhash_get_val(th, t)->count);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(labels_changed_in_bulk_match_labels_changed_one_at_a_time) {
+  wp_segment segment;
+  docid_t doc_id;
+  posting bulk_po, single_po;
+  uint32_t num_docs = 0;
+  docid_t* doc_ids = malloc(sizeof(docid_t) * 2 * 65536);
+
+  RELAY_ERROR(setup(&segment));
+
+  // enough to spill from an array container into a bitmap container and on
+  // into the next container
+  for(uint32_t i = 1; i <= 2 * 65536; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    if((doc_id % 7) < 2) {
+      doc_ids[num_docs++] = doc_id;
+      RELAY_ERROR(wp_segment_add_label(&segment, "single", doc_id));
+    }
+  }
+  RELAY_ERROR(wp_segment_add_label_to_docs(&segment, "bulk", num_docs / 2, doc_ids));
+  RELAY_ERROR(wp_segment_add_label_to_docs(&segment, "bulk", num_docs, doc_ids)); // overlaps
+
+  // and shrink the first container back into an array
+  uint32_t num_removed = 0;
+  while(doc_ids[num_removed] < 60000) num_removed++;
+  RELAY_ERROR(wp_segment_remove_label_from_docs(&segment, "bulk", num_removed, doc_ids));
+  for(uint32_t i = 0; i < num_removed; i++) RELAY_ERROR(wp_segment_remove_label(&segment, "single", doc_ids[i]));
+
+  stringmap* sh = MMAP_OBJ(segment.stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(segment.stringpool, stringpool);
+  uint32_t bulk_s = stringmap_string_to_int(sh, sp, "bulk");
+  uint32_t single_s = stringmap_string_to_int(sh, sp, "single");
+
+  uint32_t count = 0;
+  int same = 1;
+  RELAY_ERROR(wp_segment_read_label(&segment, bulk_s, MAX_LOGICAL_DOCID, &bulk_po));
+  RELAY_ERROR(wp_segment_read_label(&segment, single_s, MAX_LOGICAL_DOCID, &single_po));
+  while(bulk_po.doc_id != DOCID_NONE) {
+    if(bulk_po.doc_id != single_po.doc_id) same = 0;
+    count++;
+    RELAY_ERROR(wp_segment_read_label(&segment, bulk_s, bulk_po.doc_id - 1, &bulk_po));
+    RELAY_ERROR(wp_segment_read_label(&segment, single_s, single_po.doc_id - 1, &single_po));
+  }
+  ASSERT(same);
+  ASSERT_EQUALS_UINT(DOCID_NONE, single_po.doc_id);
+  ASSERT_EQUALS_UINT(num_docs - num_removed, count);
+
+  // the forward store agrees
+  uint32_t num_labels, label_ids[2];
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, doc_ids[num_docs - 1], 2, &num_labels, label_ids));
+  ASSERT_EQUALS_UINT(2, num_labels);
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, doc_ids[0], 2, &num_labels, label_ids));
+  ASSERT_EQUALS_UINT(0, num_labels);
+
+  free(doc_ids);
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(vacuuming_labels_keeps_them_and_shrinks_the_region) {
+  wp_segment segment;
+  docid_t doc_id;
+  posting po;
+  uint32_t num_labels, label_ids[3];
+
+  RELAY_ERROR(setup(&segment));
+
+  // churn through enough labels to leave lots of freed blocks behind
+  for(uint32_t i = 1; i <= 70000; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    RELAY_ERROR(wp_segment_add_label(&segment, "churn", doc_id));
+    if((doc_id % 2) == 0) RELAY_ERROR(wp_segment_add_label(&segment, "even", doc_id));
+    if((doc_id % 1000) == 0) RELAY_ERROR(wp_segment_add_label(&segment, "rare", doc_id));
+  }
+  for(docid_t i = 1; i <= 70000; i++) if((i % 100) != 0) RELAY_ERROR(wp_segment_remove_label(&segment, "churn", i));
+  for(docid_t i = 1; i <= 60000; i++) if((i % 2) == 0) RELAY_ERROR(wp_segment_remove_label(&segment, "even", i));
+
+  postings_region* pr = MMAP_OBJ(segment.labels, postings_region);
+  offset_t old_head = pr->postings_head;
+  RELAY_ERROR(wp_segment_vacuum_labels(&segment));
+  pr = MMAP_OBJ(segment.labels, postings_region);
+  ASSERT(pr->postings_head < old_head / 2);
+
+  stringmap* sh = MMAP_OBJ(segment.stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(segment.stringpool, stringpool);
+  uint32_t churn_s = stringmap_string_to_int(sh, sp, "churn");
+  uint32_t even_s = stringmap_string_to_int(sh, sp, "even");
+
+  uint32_t count = 0;
+  int in_order = 1;
+  RELAY_ERROR(wp_segment_read_label(&segment, churn_s, MAX_LOGICAL_DOCID, &po));
+  while(po.doc_id != DOCID_NONE) {
+    if(po.doc_id != 70000 - 100 * count) in_order = 0;
+    count++;
+    RELAY_ERROR(wp_segment_read_label(&segment, churn_s, po.doc_id - 1, &po));
+  }
+  ASSERT(in_order);
+  ASSERT_EQUALS_UINT(700, count);
+
+  count = 0;
+  RELAY_ERROR(wp_segment_read_label(&segment, even_s, MAX_LOGICAL_DOCID, &po));
+  while(po.doc_id != DOCID_NONE) {
+    count++;
+    RELAY_ERROR(wp_segment_read_label(&segment, even_s, po.doc_id - 1, &po));
+  }
+  ASSERT_EQUALS_UINT(5000, count);
+
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, 70000, 3, &num_labels, label_ids));
+  ASSERT_EQUALS_UINT(3, num_labels);
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, 1, 3, &num_labels, label_ids));
+  ASSERT_EQUALS_UINT(0, num_labels);
+
+  // and everything can still grow afterwards
+  for(docid_t i = 1; i <= 1000; i++) RELAY_ERROR(wp_segment_add_label(&segment, "even", 2 * i));
+  RELAY_ERROR(wp_segment_add_label(&segment, "rare", 70000 - 1));
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, 1998, 3, &num_labels, label_ids));
+  ASSERT_EQUALS_UINT(1, num_labels);
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, 69999, 3, &num_labels, label_ids));
+  ASSERT_EQUALS_UINT(1, num_labels);
+  RELAY_ERROR(wp_segment_read_label(&segment, even_s, 2001, &po));
+  ASSERT_EQUALS_UINT(2000, po.doc_id);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(label_changes_leave_old_versions_for_searches) {
+  wp_segment segment;
+  docid_t doc_id;
+  posting po;
+  docid_t doc_ids[50];
+
+  RELAY_ERROR(setup(&segment));
+  for(uint32_t i = 1; i <= 100; i++) RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+  for(uint32_t i = 0; i < 50; i++) doc_ids[i] = i + 1;
+  RELAY_ERROR(wp_segment_add_label_to_docs(&segment, "tag", 50, doc_ids));
+
+  stringmap* sh = MMAP_OBJ(segment.stringmap, stringmap);
+  stringpool* sp = MMAP_OBJ(segment.stringpool, stringpool);
+  termhash* th = MMAP_OBJ(segment.termhash, termhash);
+  term t = { .field_s = 0, .word_s = stringmap_string_to_int(sh, sp, "tag") };
+  offset_t old_offset = termhash_get_val(th, t)->next_offset;
+
+  // with a search holding the read lock, a label changer still gets in
+  RELAY_ERROR(wp_segment_grab_readlock(&segment));
+  RELAY_ERROR(wp_segment_grab_label_lock(&segment, "tag"));
+  RELAY_ERROR(wp_segment_remove_label_from_docs(&segment, "tag", 10, &doc_ids[40]));
+  RELAY_ERROR(wp_segment_add_label(&segment, "tag", 60));
+  RELAY_ERROR(wp_segment_release_label_lock(&segment));
+
+  // new probes see the change
+  RELAY_ERROR(wp_segment_read_label(&segment, t.word_s, MAX_LOGICAL_DOCID, &po));
+  ASSERT_EQUALS_UINT(60, po.doc_id);
+  RELAY_ERROR(wp_segment_read_label(&segment, t.word_s, 59, &po));
+  ASSERT_EQUALS_UINT(40, po.doc_id);
+  ASSERT(termhash_get_val(th, t)->next_offset != old_offset);
+
+  // but the version the search started with is untouched
+  postings_region* pr = MMAP_OBJ(segment.labels, postings_region);
+  label_directory* old_dir = (label_directory*)(pr->postings + old_offset);
+  ASSERT_EQUALS_UINT(1, old_dir->num_containers);
+  ASSERT_EQUALS_UINT(50, old_dir->containers[0].count);
+  RELAY_ERROR(wp_segment_release_lock(&segment));
+
+  // once nothing is searching, the old blocks get reused
+  offset_t head = pr->postings_head;
+  RELAY_ERROR(wp_segment_grab_label_lock(&segment, "tag"));
+  RELAY_ERROR(wp_segment_add_label(&segment, "tag", 70));
+  RELAY_ERROR(wp_segment_release_label_lock(&segment));
+  pr = MMAP_OBJ(segment.labels, postings_region);
+  ASSERT_EQUALS_UINT64(head, pr->postings_head);
+
+  uint32_t num_labels, label_id;
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, 70, 1, &num_labels, &label_id));
+  ASSERT_EQUALS_UINT(1, num_labels);
+  ASSERT_EQUALS_UINT(t.word_s, label_id);
+  RELAY_ERROR(wp_segment_get_doc_labels(&segment, 45, 1, &num_labels, &label_id));
+  ASSERT_EQUALS_UINT(0, num_labels);
+
+  // so do ones left behind by a search, once anything takes the write lock
+  for(uint32_t i = 0; i < 20; i++) {
+    if(i == 1) head = MMAP_OBJ(segment.labels, postings_region)->postings_head;
+    RELAY_ERROR(wp_segment_grab_readlock(&segment));
+    RELAY_ERROR(wp_segment_grab_label_lock(&segment, "tag"));
+    if(i % 2) RELAY_ERROR(wp_segment_add_label(&segment, "tag", 80));
+    else RELAY_ERROR(wp_segment_remove_label(&segment, "tag", 80));
+    RELAY_ERROR(wp_segment_release_label_lock(&segment));
+    RELAY_ERROR(wp_segment_release_lock(&segment));
+    RELAY_ERROR(wp_segment_grab_writelock(&segment));
+    RELAY_ERROR(wp_segment_release_lock(&segment));
+  }
+  ASSERT_EQUALS_UINT64(head, MMAP_OBJ(segment.labels, postings_region)->postings_head);
+
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
+
+TEST(appended_segments_keep_their_docs) {
+  wp_segment segment, merged;
+  docid_t doc_id;
+  pos_t positions[3] = { 1, 2, 4 };
+  uint32_t counts[2][4];
+  uint64_t sums[4];
+  int success;
+
+  RELAY_ERROR(setup(&segment));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "to", WP_FIELD_DOCS_ONLY));
+  RELAY_ERROR(wp_segment_set_field_options(&segment, "from", WP_FIELD_FREQS));
+  for(uint32_t i = 1; i <= 300; i++) {
+    RELAY_ERROR(wp_segment_grab_docid(&segment, &doc_id));
+    if((i % 3) != 0) RELAY_ERROR(add_fitted_posting(&segment, "body", "dense", doc_id, 1 + i % 3, positions));
+    if((i % 50) == 25) RELAY_ERROR(add_fitted_posting(&segment, "body", "sparse", doc_id, 1, &positions[1]));
+    RELAY_ERROR(add_fitted_posting(&segment, "to", "all", doc_id, 1, positions));
+    if((i % 2) == 0) RELAY_ERROR(add_fitted_posting(&segment, "from", "half", doc_id, 1 + i % 4, positions));
+    if((i % 2) == 1) RELAY_ERROR(wp_segment_add_label(&segment, "odd", doc_id));
+  }
+  RELAY_ERROR(wp_segment_set_key(&segment, "seven", 7));
+  RELAY_ERROR(wp_segment_delete_doc(&segment, 100));
+  RELAY_ERROR(wp_segment_seal(&segment));
+
+  // the same docs twice over
+  RELAY_ERROR(wp_segment_delete(SEGMENT_PATH "-merged"));
+  RELAY_ERROR(wp_segment_create(&merged, SEGMENT_PATH "-merged"));
+  RELAY_ERROR(wp_segment_append_postings(&merged, &segment, &success));
+  ASSERT(success);
+  RELAY_ERROR(wp_segment_append_postings(&merged, &segment, &success));
+  ASSERT(success);
+  RELAY_ERROR(wp_segment_seal(&merged));
+  RELAY_ERROR(wp_segment_append_labels(&merged, &segment, 0));
+  RELAY_ERROR(wp_segment_append_labels(&merged, &segment, 300));
+
+  ASSERT_EQUALS_UINT64(600, wp_segment_num_docs(&merged));
+  ASSERT_EQUALS_UINT64(2, wp_segment_num_deleted(&merged));
+  ASSERT(wp_segment_is_deleted(&merged, 400));
+  ASSERT_EQUALS_UINT(307, wp_segment_lookup_key(&merged, "seven"));
+  ASSERT_EQUALS_UINT(WP_FIELD_FREQS, wp_segment_field_options(&merged, "from"));
+
+  for(int i = 0; i < 2; i++) {
+    wp_segment* s = (i == 0) ? &segment : &merged;
+    wp_query* queries[4];
+    queries[0] = wp_query_new_term("body", "dense");
+    queries[1] = wp_query_add(wp_query_add(wp_query_new_conjunction(), wp_query_new_term("from", "half")), wp_query_new_term("to", "all"));
+    queries[2] = wp_query_add(wp_query_add(wp_query_new_phrase(), wp_query_new_term("body", "dense")), wp_query_new_term("body", "dense"));
+    queries[3] = wp_query_add(wp_query_add(wp_query_new_conjunction(), wp_query_new_label("odd")), wp_query_new_term("body", "sparse"));
+    for(int j = 0; j < 4; j++) RELAY_ERROR(run_query_sum(s, queries[j], &counts[i][j], &sums[j]));
+  }
+  for(int j = 0; j < 4; j++) ASSERT_EQUALS_UINT(2 * counts[0][j], counts[1][j]);
+  ASSERT_EQUALS_UINT(6, counts[0][3]);
+
+  // the deleted doc's postings were left behind
+  postings_region* pr = MMAP_OBJ(segment.postings, postings_region);
+  postings_region* mpr = MMAP_OBJ(merged.postings, postings_region);
+  ASSERT(mpr->num_postings < 2 * pr->num_postings);
+
+  RELAY_ERROR(wp_segment_unload(&merged));
+  RELAY_ERROR(wp_segment_delete(SEGMENT_PATH "-merged"));
+  RELAY_ERROR(wp_segment_unload(&segment));
+  return NO_ERROR;
+}
@@ -34,7 +34,7 @@ TEST(termhash_overwriting) {
   termhash_init(h);
 
   term t1 = {5, 11};
-  posting_list_header plh = { 1, 1234 };
+  posting_list_header plh = { .count = 1, .next_offset = 1234 };
 
   ASSERT(termhash_get_val(h, t1) == NULL);
   RELAY_ERROR(termhash_put_val(h, t1, &plh));
@@ -42,9 +42,9 @@ TEST(termhash_overwriting) {
   posting_list_header* result = termhash_get_val(h, t1);
   ASSERT(result != NULL);
   ASSERT(result != &plh); // must make a copy
-  ASSERT_EQUALS_UINT(1234, result->next_offset);
+  ASSERT_EQUALS_UINT64(1234, result->next_offset);
 
-  posting_list_header plh2 = { 1, 2345 };
+  posting_list_header plh2 = { .count = 1, .next_offset = 2345 };
   RELAY_ERROR(termhash_put_val(h, t1, &plh2));
   ASSERT(termhash_get_val(h, t1)->next_offset == 2345);
 
@@ -57,7 +57,7 @@ TEST(termhash_many_puts) { // try and force a resize
   termhash_init(h);
 
   term t1 = {1, 0};
-  posting_list_header plh = { 0, 0 };
+  posting_list_header plh = { .count = 0, .next_offset = 0 };
 
   for(int i = 1; i < 100; i++) {
     t1.word_s = i;
@@ -72,7 +72,7 @@ TEST(termhash_many_puts) { // try and force a resize
 
   t1.word_s = 55;
   posting_list_header* plh2 = termhash_get_val(h, t1);
-  ASSERT_EQUALS_UINT(1055, plh2->next_offset);
+  ASSERT_EQUALS_UINT64(1055, plh2->next_offset);
 
   free(h);
   return NO_ERROR;
@@ -84,7 +84,7 @@ TEST(termhash_detects_out_of_room) {
 
   term t = {1, 0};
 
-  posting_list_header plh = { 0, 0 };
+  posting_list_header plh = { .count = 0, .next_offset = 0 };
   for(int i = 0; i < 3; i++) {
     t.word_s = i;
     plh.next_offset = 1000 + i;
@@ -29,7 +29,7 @@
 #define ASSERT_EQUALS_UINT64(truth, val) do { \
   (*asserts)++; \
   if(val != truth) { \
-    printf("-- test failure: " #val " == %" PRIu64 " but should be %u in %s (%s:%d)\n", val, truth, __PRETTY_FUNCTION__, __FILE__, __LINE__); \
+    printf("-- test failure: " #val " == %" PRIu64 " but should be %" PRIu64 " in %s (%s:%d)\n", (uint64_t)(val), (uint64_t)(truth), __PRETTY_FUNCTION__, __FILE__, __LINE__); \
     *fail = 1; \
     return NO_ERROR; \
   } \